@@ -5,7 +5,7 @@
  *
  *   Do not edit it by hand, your changes will be overwritten.
  *
- *   Generated at: 2018-09-03 21:56:19
+ *   Generated at: 2026-10-17 00:12:54
  */
 
 #include <stdio.h>
@@ -21,8 +21,18 @@ enum argparse_option_internal_t {
 	ARG_QUIT_LONG = 1000,
 	ARG_FORCE_LONG = 1001,
 	ARG_NO_HARDWARE_LONG = 1002,
-	ARG_VERBOSE_LONG = 1003,
-	ARG_UNIX_SOCKET_LONG = 1004,
+	ARG_REALTIME_LONG = 1003,
+	ARG_RT_CPU_LONG = 1004,
+	ARG_RT_PRIORITY_LONG = 1005,
+	ARG_PREDICT_LEAD_LONG = 1006,
+	ARG_LATCH_PHASE_LONG = 1007,
+	ARG_MAX_HEIGHT_LONG = 1008,
+	ARG_PATTERN_STORAGE_LONG = 1009,
+	ARG_STATE_FILE_LONG = 1010,
+	ARG_PATTERN_CACHE_LONG = 1011,
+	ARG_NO_ROW_DEDUP_LONG = 1012,
+	ARG_VERBOSE_LONG = 1013,
+	ARG_UNIX_SOCKET_LONG = 1014,
 };
 
 bool argparse_parse(int argc, char **argv, argparse_callback_t argument_callback) {
@@ -31,6 +41,16 @@ bool argparse_parse(int argc, char **argv, argparse_callback_t argument_callback
 		{ "quit",                             no_argument, 0, ARG_QUIT_LONG },
 		{ "force",                            no_argument, 0, ARG_FORCE_LONG },
 		{ "no-hardware",                      no_argument, 0, ARG_NO_HARDWARE_LONG },
+		{ "realtime",                         no_argument, 0, ARG_REALTIME_LONG },
+		{ "rt-cpu",                           required_argument, 0, ARG_RT_CPU_LONG },
+		{ "rt-priority",                      required_argument, 0, ARG_RT_PRIORITY_LONG },
+		{ "predict-lead",                     required_argument, 0, ARG_PREDICT_LEAD_LONG },
+		{ "latch-phase",                      required_argument, 0, ARG_LATCH_PHASE_LONG },
+		{ "max-height",                       required_argument, 0, ARG_MAX_HEIGHT_LONG },
+		{ "pattern-storage",                  required_argument, 0, ARG_PATTERN_STORAGE_LONG },
+		{ "state-file",                       required_argument, 0, ARG_STATE_FILE_LONG },
+		{ "pattern-cache",                    required_argument, 0, ARG_PATTERN_CACHE_LONG },
+		{ "no-row-dedup",                     no_argument, 0, ARG_NO_ROW_DEDUP_LONG },
 		{ "verbose",                          no_argument, 0, ARG_VERBOSE_LONG },
 		{ "unix_socket",                      required_argument, 0, ARG_UNIX_SOCKET_LONG },
 		{ 0 }
@@ -62,6 +82,66 @@ bool argparse_parse(int argc, char **argv, argparse_callback_t argument_callback
 				}
 				break;
 
+			case ARG_REALTIME_LONG:
+				if (!argument_callback(ARG_REALTIME, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_RT_CPU_LONG:
+				if (!argument_callback(ARG_RT_CPU, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_RT_PRIORITY_LONG:
+				if (!argument_callback(ARG_RT_PRIORITY, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_PREDICT_LEAD_LONG:
+				if (!argument_callback(ARG_PREDICT_LEAD, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_LATCH_PHASE_LONG:
+				if (!argument_callback(ARG_LATCH_PHASE, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_MAX_HEIGHT_LONG:
+				if (!argument_callback(ARG_MAX_HEIGHT, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_PATTERN_STORAGE_LONG:
+				if (!argument_callback(ARG_PATTERN_STORAGE, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_STATE_FILE_LONG:
+				if (!argument_callback(ARG_STATE_FILE, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_PATTERN_CACHE_LONG:
+				if (!argument_callback(ARG_PATTERN_CACHE, optarg)) {
+					return false;
+				}
+				break;
+
+			case ARG_NO_ROW_DEDUP_LONG:
+				if (!argument_callback(ARG_NO_ROW_DEDUP, optarg)) {
+					return false;
+				}
+				break;
+
 			case ARG_VERBOSE_SHORT:
 			case ARG_VERBOSE_LONG:
 				if (!argument_callback(ARG_VERBOSE, optarg)) {
@@ -93,19 +173,55 @@ bool argparse_parse(int argc, char **argv, argparse_callback_t argument_callback
 }
 
 void argparse_show_syntax(void) {
-	fprintf(stderr, "usage: knitserver [--quit] [-f] [--no-hardware] [-v] socket\n");
+	fprintf(stderr, "usage: knitserver [--quit] [-f] [--no-hardware] [--realtime] [--rt-cpu cpu]\n");
+	fprintf(stderr, "                  [--rt-priority prio] [--predict-lead us]\n");
+	fprintf(stderr, "                  [--latch-phase steps] [--max-height rows]\n");
+	fprintf(stderr, "                  [--pattern-storage path] [--state-file path]\n");
+	fprintf(stderr, "                  [--pattern-cache kib] [--no-row-dedup] [-v]\n");
+	fprintf(stderr, "                  socket\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "Brother KH-930 knitting server\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "positional arguments:\n");
-	fprintf(stderr, "  socket         UNIX socket that the KnitPi knitting server listens on.\n");
+	fprintf(stderr, "  socket                UNIX socket that the KnitPi knitting server listens\n");
+	fprintf(stderr, "                        on.\n");
 	fprintf(stderr, "\n");
 	fprintf(stderr, "optional arguments:\n");
-	fprintf(stderr, "  --quit         Quit after handling a single connection.\n");
-	fprintf(stderr, "  -f, --force    Erase the socket if it already exists.\n");
-	fprintf(stderr, "  --no-hardware  Do not initialize actual hardware. Used for debugging\n");
-	fprintf(stderr, "                 purposes only.\n");
-	fprintf(stderr, "  -v, --verbose  Increase verbosity. Can be specified multiple times.\n");
+	fprintf(stderr, "  --quit                Quit after handling a single connection.\n");
+	fprintf(stderr, "  -f, --force           Erase the socket if it already exists.\n");
+	fprintf(stderr, "  --no-hardware         Do not initialize actual hardware. Used for debugging\n");
+	fprintf(stderr, "                        purposes only.\n");
+	fprintf(stderr, "  --realtime            Run GPIO and actuation threads with SCHED_FIFO\n");
+	fprintf(stderr, "                        priority pinned to a dedicated CPU core and lock all\n");
+	fprintf(stderr, "                        memory. Requires CAP_SYS_NICE and CAP_IPC_LOCK.\n");
+	fprintf(stderr, "  --rt-cpu cpu          CPU core that real-time threads are pinned to.\n");
+	fprintf(stderr, "                        Defaults to 3.\n");
+	fprintf(stderr, "  --rt-priority prio    SCHED_FIFO priority of real-time threads. Defaults to\n");
+	fprintf(stderr, "                        80.\n");
+	fprintf(stderr, "  --predict-lead us     Latch the solenoid word for the next needle position\n");
+	fprintf(stderr, "                        this many microseconds before the carriage is\n");
+	fprintf(stderr, "                        predicted to arrive there. Compensates for SPI and\n");
+	fprintf(stderr, "                        scheduling latency. Disabled by default.\n");
+	fprintf(stderr, "  --latch-phase steps   Latch the solenoid word for the next needle position\n");
+	fprintf(stderr, "                        this many quadrature steps (0-3) before the carriage\n");
+	fprintf(stderr, "                        reaches it. Defaults to 0, i.e., latch only once the\n");
+	fprintf(stderr, "                        needle position is reached.\n");
+	fprintf(stderr, "  --max-height rows     Maximum height of patterns in rows. Defaults to 1000.\n");
+	fprintf(stderr, "  --pattern-storage path\n");
+	fprintf(stderr, "                        Directory in which the row storage of large patterns\n");
+	fprintf(stderr, "                        is memory mapped. Should not be on a RAM-backed file\n");
+	fprintf(stderr, "                        system. Defaults to /var/tmp.\n");
+	fprintf(stderr, "  --state-file path     Persist pattern and knitting progress in this file\n");
+	fprintf(stderr, "                        (and the pattern next to it) and restore them on\n");
+	fprintf(stderr, "                        startup, so that knitting can resume after a restart.\n");
+	fprintf(stderr, "                        Disabled by default.\n");
+	fprintf(stderr, "  --pattern-cache kib   Memory budget in kiB for keeping decoded patterns of\n");
+	fprintf(stderr, "                        recent uploads, so that uploading the same image again\n");
+	fprintf(stderr, "                        does not decode it again. 0 disables the cache.\n");
+	fprintf(stderr, "                        Defaults to 4096 kiB.\n");
+	fprintf(stderr, "  --no-row-dedup        Store uploaded patterns with one row of pixel data per\n");
+	fprintf(stderr, "                        pattern row instead of deduplicating identical rows.\n");
+	fprintf(stderr, "  -v, --verbose         Increase verbosity. Can be specified multiple times.\n");
 }
 
 void argparse_parse_or_die(int argc, char **argv, argparse_callback_t argument_callback) {
@@ -124,6 +240,16 @@ static const char *option_enum_to_str(enum argparse_option_t option) {
 		case ARG_QUIT: return "ARG_QUIT";
 		case ARG_FORCE: return "ARG_FORCE";
 		case ARG_NO_HARDWARE: return "ARG_NO_HARDWARE";
+		case ARG_REALTIME: return "ARG_REALTIME";
+		case ARG_RT_CPU: return "ARG_RT_CPU";
+		case ARG_RT_PRIORITY: return "ARG_RT_PRIORITY";
+		case ARG_PREDICT_LEAD: return "ARG_PREDICT_LEAD";
+		case ARG_LATCH_PHASE: return "ARG_LATCH_PHASE";
+		case ARG_MAX_HEIGHT: return "ARG_MAX_HEIGHT";
+		case ARG_PATTERN_STORAGE: return "ARG_PATTERN_STORAGE";
+		case ARG_STATE_FILE: return "ARG_STATE_FILE";
+		case ARG_PATTERN_CACHE: return "ARG_PATTERN_CACHE";
+		case ARG_NO_ROW_DEDUP: return "ARG_NO_ROW_DEDUP";
 		case ARG_VERBOSE: return "ARG_VERBOSE";
 		case ARG_UNIX_SOCKET: return "ARG_UNIX_SOCKET";
 	}
@@ -5,7 +5,7 @@
  *
  *   Do not edit it by hand, your changes will be overwritten.
  *
- *   Generated at: 2018-09-03 21:56:19
+ *   Generated at: 2026-10-17 00:12:54
  */
 
 #ifndef __ARGPARSE_H__
@@ -17,6 +17,16 @@ enum argparse_option_t {
 	ARG_QUIT,
 	ARG_FORCE,
 	ARG_NO_HARDWARE,
+	ARG_REALTIME,
+	ARG_RT_CPU,
+	ARG_RT_PRIORITY,
+	ARG_PREDICT_LEAD,
+	ARG_LATCH_PHASE,
+	ARG_MAX_HEIGHT,
+	ARG_PATTERN_STORAGE,
+	ARG_STATE_FILE,
+	ARG_PATTERN_CACHE,
+	ARG_NO_ROW_DEDUP,
 	ARG_VERBOSE,
 	ARG_UNIX_SOCKET,
 };
@@ -27,6 +27,8 @@
 #include "debouncer.h"
 #include "tools.h"
 #include "isleep.h"
+#include "latency.h"
+#include "realtime.h"
 
 static bool run_debouncer_thread;
 static struct debouncer_state_t debounce_state[GPIO_COUNT] = {
@@ -67,6 +69,7 @@ void debouncer_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 				/* We don't have that change recorded yet. */
 				debounce->pending_change = true;
 				memcpy(&debounce->change_time, ts, sizeof(struct timespec));
+				memcpy(&debounce->edge_time, ts, sizeof(struct timespec));
 				add_timespec_offset(&debounce->change_time, debounce->debounce_time_ms);
 				isleep_interrupt(&sleeper);
 			}
@@ -79,6 +82,7 @@ static void* debouncer_thread(void *vcallback) {
 	struct {
 		int gpio_id;
 		bool new_state;
+		struct timespec edge_time;
 	} notifiers[GPIO_COUNT];
 
 	while (run_debouncer_thread) {
@@ -99,6 +103,7 @@ static void* debouncer_thread(void *vcallback) {
 					debounce_state[i].pending_change = false;
 					notifiers[notification_count].gpio_id = i;
 					notifiers[notification_count].new_state = debounce_state[i].debounced_state;
+					notifiers[notification_count].edge_time = debounce_state[i].edge_time;
 					notification_count++;
 				} else {
 					/* No, not yet -- adapt sleep timer */
@@ -110,7 +115,13 @@ static void* debouncer_thread(void *vcallback) {
 
 		/* Finally notify all changed handlers */
 		for (int i = 0; i < notification_count; i++) {
-			global_debouncer_output_callback(notifiers[i].gpio_id, &now, notifiers[i].new_state);
+			struct timespec dispatch_time;
+			latency_timestamp(&dispatch_time);
+			latency_record(LATENCY_DEBOUNCER, &notifiers[i].edge_time, &dispatch_time);
+			latency_set_edge(&notifiers[i].edge_time);
+			global_debouncer_output_callback(notifiers[i].gpio_id, &notifiers[i].edge_time, notifiers[i].new_state);
+			latency_set_edge(NULL);
+			latency_record_since(LATENCY_CALLBACK, &dispatch_time);
 		}
 		isleep_abs(&sleeper, &sleep_until);
 	}
@@ -120,7 +131,7 @@ static void* debouncer_thread(void *vcallback) {
 bool start_debouncer_thread(gpio_irq_callback_t debouncer_output_callback) {
 	run_debouncer_thread = true;
 	global_debouncer_output_callback = debouncer_output_callback;
-	if (!start_detached_thread(debouncer_thread, debouncer_output_callback)) {
+	if (!start_realtime_thread(debouncer_thread, debouncer_output_callback, "knitpi-actuate")) {
 		fprintf(stderr, "Failed to start debouncer thread.\n");
 		return false;
 	}
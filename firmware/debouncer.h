@@ -35,6 +35,7 @@ struct debouncer_state_t {
 	bool pending_change;
 	uint16_t debounce_time_ms;
 	struct timespec change_time;
+	struct timespec edge_time;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
@@ -25,6 +25,7 @@
 #include <pthread.h>
 #include "gpio_thread.h"
 #include "tools.h"
+#include "realtime.h"
 
 static bool run_thread;
 
@@ -36,15 +37,16 @@ static void* gpio_thread_body(void *vhandler) {
 	return NULL;
 }
 
-void start_gpio_thread(gpio_irq_callback_t irq_handler, bool initial_notify) {
+bool start_gpio_thread(gpio_irq_callback_t irq_handler, bool initial_notify) {
 	run_thread = true;
-	if (!start_detached_thread(gpio_thread_body, irq_handler)) {
+	if (!start_realtime_thread(gpio_thread_body, irq_handler, "knitpi-gpio")) {
 		perror("failed to start GPIO thread");
-		return;
+		return false;
 	}
 	if (initial_notify) {
 		gpio_notify_all_inputs(irq_handler);
 	}
+	return true;
 }
 
 void stop_gpio_thread(void) {
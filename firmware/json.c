@@ -28,7 +28,7 @@
 #include <assert.h>
 #include "json.h"
 
-void json_print_dict(FILE *f, const struct json_dict_entry_t *entries) {
+static void json_print_dict_inline(FILE *f, const struct json_dict_entry_t *entries) {
 	assert(entries);
 	fprintf(f, "{ ");
 	bool first = true;
@@ -52,10 +52,26 @@ void json_print_dict(FILE *f, const struct json_dict_entry_t *entries) {
 				fprintf(f, "%s", entries->value.boolean ? "true" : "false");
 				break;
 
+			case JSON_INT_ARRAY:
+				fprintf(f, "[ ");
+				for (unsigned int i = 0; i < entries->value.int_array.count; i++) {
+					fprintf(f, (i == 0) ? "%d" : ", %d", entries->value.int_array.values[i]);
+				}
+				fprintf(f, " ]");
+				break;
+
+			case JSON_DICT:
+				json_print_dict_inline(f, entries->value.dict);
+				break;
 		}
 		entries++;
 	}
-	fprintf(f, " }\n");
+	fprintf(f, " }");
+}
+
+void json_print_dict(FILE *f, const struct json_dict_entry_t *entries) {
+	json_print_dict_inline(f, entries);
+	fprintf(f, "\n");
 }
 
 void __attribute__ ((format (printf, 3, 4))) json_respond_simple(FILE *f, const char *msg_type, const char *message, ...) {
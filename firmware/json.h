@@ -32,6 +32,8 @@ enum json_type_t {
 	JSON_INT,
 	JSON_STRING,
 	JSON_BOOL,
+	JSON_INT_ARRAY,
+	JSON_DICT,
 };
 
 struct json_dict_entry_t {
@@ -41,12 +43,19 @@ struct json_dict_entry_t {
 		int integer;
 		const char *string;
 		bool boolean;
+		struct {
+			const int *values;
+			unsigned int count;
+		} int_array;
+		const struct json_dict_entry_t *dict;
 	} value;
 };
 
 #define JSON_DICTENTRY_INT(_key, _value)		{ .key = (_key), .value_type = JSON_INT, .value.integer = (_value) }
 #define JSON_DICTENTRY_STR(_key, _value)		{ .key = (_key), .value_type = JSON_STRING, .value.string = (_value) }
 #define JSON_DICTENTRY_BOOL(_key, _value)		{ .key = (_key), .value_type = JSON_BOOL, .value.boolean = (_value) }
+#define JSON_DICTENTRY_INT_ARRAY(_key, _values, _count)		{ .key = (_key), .value_type = JSON_INT_ARRAY, .value.int_array.values = (_values), .value.int_array.count = (_count) }
+#define JSON_DICTENTRY_DICT(_key, _value)		{ .key = (_key), .value_type = JSON_DICT, .value.dict = (_value) }
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 void json_print_dict(FILE *f, const struct json_dict_entry_t *entries);
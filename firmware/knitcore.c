@@ -24,96 +24,531 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 
 #include "json.h"
 #include "knitcore.h"
 #include "peripherals.h"
 #include "needles.h"
 #include "pgmopts.h"
+#include "latency.h"
+#include "tools.h"
+#include "sled.h"
+#include "realtime.h"
+#include "persist.h"
+
+/* Completes the initialization of a server state that was initialized with
+ * SERVER_STATE_INITIALIZER, must be called before any thread is started. */
+bool init_server_state(struct server_state_t *server_state) {
+	return init_priority_inheritance_mutex(&server_state->update_lock) && init_priority_inheritance_mutex(&server_state->prediction.mutex);
+}
+
+/* Has the knitting progress recorded in the state file if persistence is
+ * enabled. Needs to be called whenever any of the persisted values changes.
+ * Never blocks, can be called from any thread. */
+void persist_server_state(struct server_state_t *server_state) {
+	if (!server_state->persist) {
+		return;
+	}
+	atomic_store(&server_state->persistence.requested, true);
+	isleep_interrupt(&server_state->persistence.wakeup);
+}
 
 void set_knitting_mode(struct server_state_t *server_state, bool knitting_mode) {
-	if (server_state->knitting_mode == knitting_mode) {
+	if (atomic_exchange(&server_state->knitting_mode, knitting_mode) == knitting_mode) {
 		return;
 	}
 
-	server_state->knitting_mode = knitting_mode;
 	logmsg(LLVL_TRACE, "Knitting mode: %s", knitting_mode ? "enabled" : "disabled");
 	if (!pgm_opts->no_hardware) {
 		gpio_set_to(GPIO_LED_RED, knitting_mode);
 		gpio_set_to(GPIO_74HC595_OE, knitting_mode);
 	}
+	persist_server_state(server_state);
 	isleep_interrupt(&server_state->event_notification);
 }
 
+/* Readers never block. The returned snapshot (which may be NULL) stays valid
+ * until read_snapshot_end() is called. */
+const struct pattern_snapshot_t* read_snapshot_begin(struct server_state_t *server_state) {
+	rcu_read_lock(&server_state->snapshot_rcu);
+	return atomic_load(&server_state->snapshot);
+}
+
+void read_snapshot_end(struct server_state_t *server_state) {
+	rcu_read_unlock(&server_state->snapshot_rcu);
+}
+
+/* Serializes all writers. Returns the currently published snapshot, which
+ * remains valid until the update is either committed or aborted. */
+const struct pattern_snapshot_t* update_snapshot_begin(struct server_state_t *server_state) {
+	rcu_write_lock(&server_state->snapshot_rcu);
+	return atomic_load(&server_state->snapshot);
+}
+
+void update_snapshot_abort(struct server_state_t *server_state) {
+	rcu_write_unlock(&server_state->snapshot_rcu);
+}
+
+/* The row is set before the snapshot is published. Since it is only ever
+ * reset to zero or clamped to a pattern that is smaller than the current one,
+ * it is valid for both the old and the new snapshot. A row that is advanced
+ * concurrently by the sled is not overwritten. */
+static void update_snapshot_row(struct server_state_t *server_state, const struct pattern_t *pattern, int32_t pattern_row) {
+	if (pattern_row != SNAPSHOT_KEEP_PATTERN_ROW) {
+		atomic_store(&server_state->pattern_row, pattern_row);
+	} else if (pattern) {
+		int32_t current_row = atomic_load(&server_state->pattern_row);
+		while ((current_row >= (int32_t)pattern->height) && !atomic_compare_exchange_weak(&server_state->pattern_row, &current_row, (int32_t)pattern->height - 1));
+	}
+}
+
+/* Publishes a new snapshot with the pattern of the given layer (the reference
+ * is transferred), offset and the row at which knitting continues, either an
+ * explicit one or SNAPSHOT_KEEP_PATTERN_ROW to keep the current row as long as
+ * it is within the new pattern. The previous snapshot, and its pattern if it
+ * is being replaced and no longer referenced elsewhere, are freed once no
+ * reader can reference them anymore. A new pattern is persisted afterwards by
+ * the persistence thread. */
+bool update_snapshot_commit_layer(struct server_state_t *server_state, struct pattern_layer_t *layer, int32_t pattern_offset, int32_t pattern_row) {
+	struct pattern_snapshot_t *old_snapshot = atomic_load(&server_state->snapshot);
+	struct pattern_snapshot_t *new_snapshot = NULL;
+	struct pattern_t *pattern = layer ? layer->pattern : NULL;
+	if (layer) {
+		new_snapshot = calloc(1, sizeof(struct pattern_snapshot_t));
+		if (!new_snapshot) {
+			logmsg(LLVL_ERROR, "Failed to allocate pattern snapshot.");
+			pattern_layer_put(layer);
+			rcu_write_unlock(&server_state->snapshot_rcu);
+			return false;
+		}
+		/* Versions are never reused, not even after the pattern was cleared */
+		new_snapshot->version = ++server_state->last_snapshot_version;
+		new_snapshot->pattern_version = (old_snapshot && (old_snapshot->pattern == pattern)) ? old_snapshot->pattern_version : ++server_state->last_pattern_version;
+		new_snapshot->layer = layer;
+		new_snapshot->pattern = pattern;
+		new_snapshot->pattern_offset = pattern_offset;
+	}
+
+	if (!old_snapshot || (old_snapshot->pattern != pattern)) {
+		/* A resume of the restored pattern no longer applies */
+		atomic_store(&server_state->resume_knitting, false);
+		png_cache_clear(&server_state->png_cache);
+		preview_clear(&server_state->preview);
+	}
+	update_snapshot_row(server_state, pattern, pattern_row);
+	atomic_store(&server_state->snapshot, new_snapshot);
+	persist_server_state(server_state);
+	rcu_write_unlock(&server_state->snapshot_rcu);
+	request_actuation_tables(server_state);
+
+	if (old_snapshot) {
+		rcu_synchronize(&server_state->snapshot_rcu);
+		pattern_layer_put(old_snapshot->layer);
+		free(old_snapshot);
+	}
+	return true;
+}
+
+/* Like update_snapshot_commit_layer(), but takes ownership of the given
+ * pattern instead, unless it is the pattern of the current snapshot. */
+bool update_snapshot_commit(struct server_state_t *server_state, struct pattern_t *pattern, int32_t pattern_offset, int32_t pattern_row) {
+	const struct pattern_snapshot_t *old_snapshot = atomic_load(&server_state->snapshot);
+	struct pattern_layer_t *layer = NULL;
+	if (pattern && old_snapshot && (old_snapshot->pattern == pattern)) {
+		layer = pattern_layer_get(old_snapshot->layer);
+	} else if (pattern) {
+		layer = pattern_layer_new(pattern);
+		if (!layer) {
+			rcu_write_unlock(&server_state->snapshot_rcu);
+			return false;
+		}
+	}
+	return update_snapshot_commit_layer(server_state, layer, pattern_offset, pattern_row);
+}
+
+void free_snapshot(struct server_state_t *server_state) {
+	update_snapshot_begin(server_state);
+	update_snapshot_commit(server_state, NULL, 0, SNAPSHOT_KEEP_PATTERN_ROW);
+}
+
+/* Restores pattern and knitting state from the given persistence and from
+ * then on persists all changes there. If knitting was in progress, it resumes
+ * as soon as the carriage position is known. */
+void restore_server_state(struct server_state_t *server_state, struct persist_t *persist) {
+	struct pattern_t *pattern;
+	struct persist_state_t state;
+	if (persist_load(persist, &pattern, &state)) {
+		server_state->repeat_mode = (state.repeat_mode <= RPTMODE_MANUAL) ? state.repeat_mode : RPTMODE_ONESHOT;
+		server_state->even_rows_left_to_right = state.even_rows_left_to_right;
+		if (pattern) {
+			update_snapshot_begin(server_state);
+			if (update_snapshot_commit(server_state, pattern, state.pattern_offset, state.pattern_row)) {
+				/* Already persisted, it is not written again */
+				server_state->persistence.pattern_version = atomic_load(&server_state->snapshot)->pattern_version;
+				server_state->resume_knitting = state.knitting_mode;
+				logmsg(LLVL_INFO, "Restored %u x %u pattern at row %d, offset %d%s.", pattern->width, pattern->height, state.pattern_row, state.pattern_offset, state.knitting_mode ? ", knitting resumes once the carriage position is known" : "");
+			}
+		}
+	}
+	server_state->persist = persist;
+	persist_server_state(server_state);
+}
+
+/* Writes the pattern first if it was replaced since it was last persisted,
+ * outside of the read section with a reference of its own, and only then the
+ * state record that refers to it. */
+static void persist_pending_state(struct server_state_t *server_state) {
+	struct state_persistence_t *persistence = &server_state->persistence;
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(server_state);
+	uint32_t pattern_version = snapshot ? snapshot->pattern_version : 0;
+	int32_t pattern_offset = snapshot ? snapshot->pattern_offset : 0;
+	struct pattern_layer_t *layer = (snapshot && (pattern_version != persistence->pattern_version)) ? pattern_layer_get(snapshot->layer) : NULL;
+	const struct persist_state_t state = {
+		.pattern_row = server_state->pattern_row,
+		.pattern_offset = pattern_offset,
+		.repeat_mode = server_state->repeat_mode,
+		.even_rows_left_to_right = server_state->even_rows_left_to_right,
+		.knitting_mode = server_state->knitting_mode || server_state->resume_knitting,
+	};
+	read_snapshot_end(server_state);
+
+	if (pattern_version != persistence->pattern_version) {
+		bool success = persist_write_pattern(server_state->persist, layer ? layer->pattern : NULL, pattern_offset);
+		pattern_layer_put(layer);
+		if (!success) {
+			/* The state record keeps referring to the previous pattern */
+			return;
+		}
+		persistence->pattern_version = pattern_version;
+		persistence->state_pending = true;
+	}
+	if (persistence->state_pending) {
+		persist_write_state(server_state->persist, &state);
+		persistence->state_pending = false;
+	}
+}
+
+static void* state_persistence_thread(void *vserver_state) {
+	struct server_state_t *server_state = (struct server_state_t*)vserver_state;
+	struct state_persistence_t *persistence = &server_state->persistence;
+	bool stop;
+	do {
+		/* Changes made before the stop request are still written */
+		stop = atomic_load(&persistence->stop);
+		if (atomic_exchange(&persistence->requested, false)) {
+			persistence->state_pending = true;
+		}
+		persist_pending_state(server_state);
+		if (!stop && !atomic_load(&persistence->requested) && !atomic_load(&persistence->stop)) {
+			isleep(&persistence->wakeup, PERSIST_RECHECK_MS);
+		}
+	} while (!stop);
+	return NULL;
+}
+
+/* Needs to be called after restore_server_state(), does nothing unless state
+ * is persisted. */
+bool start_state_persistence(struct server_state_t *server_state) {
+	if (!server_state->persist) {
+		return true;
+	}
+	if (pthread_create(&server_state->persistence.thread, NULL, state_persistence_thread, server_state)) {
+		perror("pthread_create");
+		return false;
+	}
+	server_state->persistence.running = true;
+	return true;
+}
+
+/* Writes all pending changes and stops the persistence thread. */
+void stop_state_persistence(struct server_state_t *server_state) {
+	if (!server_state->persistence.running) {
+		return;
+	}
+	atomic_store(&server_state->persistence.stop, true);
+	isleep_interrupt(&server_state->persistence.wakeup);
+	pthread_join(server_state->persistence.thread, NULL);
+	server_state->persistence.running = false;
+}
+
 static bool is_direction_left_to_right(const struct server_state_t *server_state) {
 	return server_state->even_rows_left_to_right == ((server_state->pattern_row % 2) == 0);
 }
 
-void sled_update(struct server_state_t *server_state) {
-	if (server_state->pattern == NULL) {
-		set_knitting_mode(server_state, false);
+static void compute_spi_data(const struct pattern_snapshot_t *snapshot, int32_t pattern_row, uint8_t spi_data[static 2], int carriage_position, bool left_to_right, bool belt_phase) {
+	if (pattern_row_is_empty(snapshot->pattern, pattern_row)) {
 		return;
 	}
+	struct needle_window_t window = get_needle_window_for_carriage_position(carriage_position, left_to_right);
+	for (int needle_id = window.min_needle; needle_id <= window.max_needle; needle_id += PATTERN_MASK_BITS) {
+		/* Stitches left of the pattern origin are always reported as unset */
+		uint64_t mask = pattern_get_mask(snapshot->pattern, needle_id - snapshot->pattern_offset, pattern_row);
+		int remaining_needles = window.max_needle - needle_id + 1;
+		if (remaining_needles < PATTERN_MASK_BITS) {
+			mask &= (1ULL << remaining_needles) - 1;
+		}
+		while (mask) {
+			actuate_solenoids_for_needle(spi_data, belt_phase, needle_id + __builtin_ctzll(mask));
+			mask &= mask - 1;
+		}
+	}
+}
 
-	if (!server_state->carriage_position_valid) {
-		set_knitting_mode(server_state, false);
-		return;
+static bool actuation_table_is_current(const struct actuation_table_t *table, const struct pattern_snapshot_t *snapshot, int32_t pattern_row) {
+	const struct knitmachine_params_t *params = get_knitmachine_params();
+	return table->valid && (table->snapshot_version == snapshot->version) && (table->pattern_row == pattern_row) && (table->window_offset == params->active_window_offset) && (table->window_size == params->active_window_size);
+}
+
+static void compile_actuation_table(struct actuation_table_t *table, const struct pattern_snapshot_t *snapshot, int32_t pattern_row) {
+	const struct knitmachine_params_t *params = get_knitmachine_params();
+
+	unsigned int sequence = atomic_load_explicit(&table->sequence, memory_order_relaxed);
+	atomic_store_explicit(&table->sequence, sequence + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	table->snapshot_version = snapshot->version;
+	table->pattern_row = pattern_row;
+	table->window_offset = params->active_window_offset;
+	table->window_size = params->active_window_size;
+	memset(table->spi_data, 0, sizeof(table->spi_data));
+	if ((pattern_row >= 0) && !pattern_row_is_empty(snapshot->pattern, pattern_row)) {
+		for (int left_to_right = 0; left_to_right < 2; left_to_right++) {
+			for (int belt_phase = 0; belt_phase < 2; belt_phase++) {
+				for (int i = 0; i < ACTUATION_TABLE_POSITIONS; i++) {
+					compute_spi_data(snapshot, pattern_row, table->spi_data[left_to_right][belt_phase][i], ACTUATION_TABLE_FIRST_POSITION + i, left_to_right, belt_phase);
+				}
+			}
+		}
 	}
+	table->valid = true;
 
-	uint8_t spi_data[] = { 0, 0 };
-	if ((server_state->pattern_row >= 0) && (server_state->pattern_row < server_state->pattern->height)) {
-		bool direction_left_to_right = is_direction_left_to_right(server_state);
-		struct needle_window_t window = get_needle_window_for_carriage_position(server_state->carriage_position, direction_left_to_right);
+	atomic_store_explicit(&table->sequence, sequence + 2, memory_order_release);
+	logmsg(LLVL_TRACE, "Compiled actuation table for row %d, snapshot version %u", table->pattern_row, table->snapshot_version);
+}
 
-		if (at_least_loglevel(LLVL_TRACE)) {
-			struct json_dict_entry_t entries[] = {
-				JSON_DICTENTRY_STR("json_id", "windata"),
-				JSON_DICTENTRY_INT("row", server_state->pattern_row),
-				JSON_DICTENTRY_INT("pattern_xoffset", server_state->pattern_offset),
-				JSON_DICTENTRY_INT("carriage_position", server_state->carriage_position),
+/* Looks up the solenoid word in whichever table belongs to the given row and
+ * snapshot. Never blocks; returns false if there is no such table or it was
+ * being rewritten during the lookup. */
+static bool lookup_actuation_table(const struct actuation_tables_t *tables, const struct pattern_snapshot_t *snapshot, int32_t pattern_row, unsigned int table_index, bool left_to_right, bool belt_phase, uint8_t spi_data[static 2]) {
+	for (unsigned int i = 0; i < ACTUATION_TABLE_SLOTS; i++) {
+		const struct actuation_table_t *table = &tables->slot[i];
+		unsigned int sequence = atomic_load_explicit(&table->sequence, memory_order_acquire);
+		if ((sequence & 1) || !actuation_table_is_current(table, snapshot, pattern_row)) {
+			continue;
+		}
+		uint8_t table_spi_data[2];
+		memcpy(table_spi_data, table->spi_data[left_to_right][belt_phase][table_index], sizeof(table_spi_data));
+		atomic_thread_fence(memory_order_acquire);
+		if (atomic_load_explicit(&table->sequence, memory_order_relaxed) == sequence) {
+			memcpy(spi_data, table_spi_data, sizeof(table_spi_data));
+			return true;
+		}
+	}
+	return false;
+}
+
+/* Row that follows pattern_row when the carriage finishes it, -1 if knitting
+ * ends there. Must be kept in sync with next_row(). */
+static int32_t get_following_row(const struct server_state_t *server_state, const struct pattern_t *pattern, int32_t pattern_row) {
+	if (server_state->repeat_mode == RPTMODE_MANUAL) {
+		return pattern_row;
+	} else if (pattern_row + 1 < (int32_t)pattern->height) {
+		return pattern_row + 1;
+	} else {
+		return (server_state->repeat_mode == RPTMODE_ONESHOT) ? -1 : 0;
+	}
+}
+
+/* Ensures that there are tables for the current and the following row. The
+ * table of the current row is never the one that is overwritten. Also moves
+ * the resident window of mapped patterns, which may need system calls and
+ * page faults, and flattens the rows of compositions ahead of the row change
+ * so that the actuation path never has to. */
+static void prepare_actuation_tables(struct server_state_t *server_state) {
+	struct actuation_tables_t *tables = &server_state->actuation_tables;
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(server_state);
+	if (snapshot) {
+		int32_t pattern_row = server_state->pattern_row;
+		const int32_t rows[ACTUATION_TABLE_SLOTS] = {
+			pattern_row,
+			get_following_row(server_state, snapshot->pattern, pattern_row),
+		};
+		if ((pattern_row >= 0) && (pattern_row < (int32_t)snapshot->pattern->height)) {
+			/* Centered on the following row, the window still contains the
+			 * adjacent current one */
+			pattern_set_resident_rows(snapshot->pattern, (rows[1] >= 0) ? rows[1] : rows[0]);
+		}
+		for (unsigned int i = 0; i < ACTUATION_TABLE_SLOTS; i++) {
+			if (rows[i] >= 0) {
+				pattern_prepare_row(snapshot->pattern, rows[i]);
+			}
+		}
+
+		bool slot_used[ACTUATION_TABLE_SLOTS] = { false };
+		bool row_present[ACTUATION_TABLE_SLOTS] = { false };
+		for (unsigned int i = 0; i < ACTUATION_TABLE_SLOTS; i++) {
+			for (unsigned int j = 0; j < ACTUATION_TABLE_SLOTS; j++) {
+				if (!slot_used[j] && actuation_table_is_current(&tables->slot[j], snapshot, rows[i])) {
+					slot_used[j] = true;
+					row_present[i] = true;
+					break;
+				}
+			}
+		}
+		for (unsigned int i = 0; i < ACTUATION_TABLE_SLOTS; i++) {
+			if (row_present[i] || (rows[i] < 0) || (rows[i] >= (int32_t)snapshot->pattern->height)) {
+				continue;
+			}
+			for (unsigned int j = 0; j < ACTUATION_TABLE_SLOTS; j++) {
+				if (!slot_used[j]) {
+					compile_actuation_table(&tables->slot[j], snapshot, rows[i]);
+					atomic_fetch_add(&tables->compiled_cnt, 1);
+					slot_used[j] = true;
+					break;
+				}
+			}
+		}
+	}
+	read_snapshot_end(server_state);
+}
+
+/* Asks the compiler thread to bring the actuation tables up to date. Never
+ * blocks, can be called from any thread. */
+void request_actuation_tables(struct server_state_t *server_state) {
+	atomic_store(&server_state->actuation_tables.requested, true);
+	isleep_interrupt(&server_state->actuation_tables.wakeup);
+}
+
+static void* actuation_table_compiler_thread(void *vserver_state) {
+	struct server_state_t *server_state = (struct server_state_t*)vserver_state;
+	struct actuation_tables_t *tables = &server_state->actuation_tables;
+	while (true) {
+		atomic_store(&tables->requested, false);
+		prepare_actuation_tables(server_state);
+		if (!atomic_load(&tables->requested)) {
+			isleep(&tables->wakeup, ACTUATION_TABLE_RECHECK_MS);
+		}
+	}
+	return NULL;
+}
+
+/* Tables are compiled by a regular thread, ahead of the row change, so that
+ * the actuation path only ever needs to look them up. */
+bool start_actuation_table_compiler(struct server_state_t *server_state) {
+	return start_detached_thread(actuation_table_compiler_thread, server_state);
+}
+
+static void trace_actuation(const struct pattern_snapshot_t *snapshot, int32_t pattern_row, int32_t carriage_position, bool belt_phase, bool direction_left_to_right) {
+	struct needle_window_t window = get_needle_window_for_carriage_position(carriage_position, direction_left_to_right);
+	struct json_dict_entry_t entries[] = {
+		JSON_DICTENTRY_STR("json_id", "windata"),
+		JSON_DICTENTRY_INT("row", pattern_row),
+		JSON_DICTENTRY_INT("pattern_xoffset", snapshot->pattern_offset),
+		JSON_DICTENTRY_INT("carriage_position", carriage_position),
+		JSON_DICTENTRY_BOOL("left_to_right", direction_left_to_right),
+		JSON_DICTENTRY_INT("window_min", window.min_needle),
+		JSON_DICTENTRY_INT("window_max", window.max_needle),
+		{ 0 }
+	};
+	json_trace(entries);
+
+	for (int needle_id = window.min_needle; needle_id <= window.max_needle; needle_id++) {
+		int x = needle_id - snapshot->pattern_offset;
+		if ((x >= 0) && pattern_get_color(snapshot->pattern, x, pattern_row)) {
+			char position_needle_name[32], actuated_needle_name[32];
+			needle_pos_to_text(position_needle_name, carriage_position);
+			needle_pos_to_text(actuated_needle_name, needle_id);
+			logmsg(LLVL_TRACE, "At %s (needle %d) actuating %s (needle %d), BP %d", position_needle_name, carriage_position, actuated_needle_name, needle_id, belt_phase);
+
+			/* Print output in JSON form */
+			struct json_dict_entry_t knit_entries[] = {
+				JSON_DICTENTRY_STR("json_id", "knitdata"),
+				JSON_DICTENTRY_INT("row", pattern_row),
+				JSON_DICTENTRY_INT("carriage_position", carriage_position),
 				JSON_DICTENTRY_BOOL("left_to_right", direction_left_to_right),
-				JSON_DICTENTRY_INT("window_min", window.min_needle),
-				JSON_DICTENTRY_INT("window_max", window.max_needle),
+				JSON_DICTENTRY_BOOL("belt_phase", belt_phase),
+				JSON_DICTENTRY_INT("pattern_x", x),
+				JSON_DICTENTRY_INT("needle_id", needle_id),
 				{ 0 }
 			};
-			json_trace(entries);
+			json_trace(knit_entries);
 		}
+	}
+}
 
-		for (int needle_id = window.min_needle; needle_id <= window.max_needle; needle_id++) {
-			int x = needle_id - server_state->pattern_offset;
-			if (x >= 0) {
-				uint8_t color = pattern_get_color(server_state->pattern, x, server_state->pattern_row);
-				if (color) {
-					if (at_least_loglevel(LLVL_TRACE)) {
-						char position_needle_name[32], actuated_needle_name[32];
-						needle_pos_to_text(position_needle_name, server_state->carriage_position);
-						needle_pos_to_text(actuated_needle_name, needle_id);
-						logmsg(LLVL_TRACE, "At %s (needle %d) actuating %s (needle %d), BP %d", position_needle_name, server_state->carriage_position, actuated_needle_name, needle_id, server_state->belt_phase);
-					}
-
-					if (at_least_loglevel(LLVL_TRACE)) {
-						/* Print output in JSON form */
-						struct json_dict_entry_t entries[] = {
-							JSON_DICTENTRY_STR("json_id", "knitdata"),
-							JSON_DICTENTRY_INT("row", server_state->pattern_row),
-							JSON_DICTENTRY_INT("carriage_position", server_state->carriage_position),
-							JSON_DICTENTRY_BOOL("left_to_right", direction_left_to_right),
-							JSON_DICTENTRY_BOOL("belt_phase", server_state->belt_phase),
-							JSON_DICTENTRY_INT("pattern_x", x),
-							JSON_DICTENTRY_INT("needle_id", needle_id),
-							{ 0 }
-						};
-						json_trace(entries);
-					}
-					actuate_solenoids_for_needle(spi_data, server_state->belt_phase, needle_id);
-				}
+static void latch_spi_data(struct server_state_t *server_state, const uint8_t spi_data[static 2]) {
+	struct spi_cache_t *cache = &server_state->spi_cache;
+	struct timespec now;
+	get_timespec_now(&now);
+	if (cache->valid && !memcmp(cache->spi_data, spi_data, sizeof(cache->spi_data))) {
+		int64_t age_ns = timespec_diff(&now, &cache->last_sent);
+		if ((age_ns >= 0) && (age_ns < SPI_CACHE_REFRESH_INTERVAL_MS * 1000000LL)) {
+			atomic_fetch_add_explicit(&cache->suppressed_cnt, 1, memory_order_relaxed);
+			return;
+		}
+	}
+
+	if (!pgm_opts->no_hardware) {
+		struct timespec spi_start;
+		latency_timestamp(&spi_start);
+		cache->valid = spi_send(SPI_74HC595, spi_data, 2);
+		latency_record_since(LATENCY_SPI_SEND, &spi_start);
+	} else {
+		cache->valid = true;
+	}
+	memcpy(cache->spi_data, spi_data, sizeof(cache->spi_data));
+	cache->last_sent = now;
+	atomic_fetch_add_explicit(&cache->sent_cnt, 1, memory_order_relaxed);
+}
+
+/* Must only ever be executed by one thread at a time, i.e., with the update
+ * lock held. */
+static void perform_sled_update(struct server_state_t *server_state) {
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(server_state);
+	if (snapshot == NULL) {
+		read_snapshot_end(server_state);
+		set_knitting_mode(server_state, false);
+		return;
+	}
+
+	if (!server_state->carriage_position_valid) {
+		read_snapshot_end(server_state);
+		set_knitting_mode(server_state, false);
+		return;
+	}
+	if (atomic_load(&server_state->resume_knitting) && atomic_exchange(&server_state->resume_knitting, false)) {
+		set_knitting_mode(server_state, true);
+	}
+
+	int32_t pattern_row = server_state->pattern_row;
+	int32_t carriage_position = atomic_load(&server_state->prediction.active) ? server_state->prediction.predicted_position : server_state->carriage_position;
+	bool belt_phase = server_state->belt_phase;
+
+	uint8_t spi_data[] = { 0, 0 };
+	if ((pattern_row >= 0) && (pattern_row < snapshot->pattern->height)) {
+		bool direction_left_to_right = is_direction_left_to_right(server_state);
+		int table_index = carriage_position - ACTUATION_TABLE_FIRST_POSITION;
+		bool table_hit = (table_index >= 0) && (table_index < ACTUATION_TABLE_POSITIONS) && lookup_actuation_table(&server_state->actuation_tables, snapshot, pattern_row, table_index, direction_left_to_right, belt_phase, spi_data);
+		if (!table_hit) {
+			/* Carriage is way off the needle bed or the table of this row is
+			 * not compiled yet, compute only this position manually */
+			compute_spi_data(snapshot, pattern_row, spi_data, carriage_position, direction_left_to_right, belt_phase);
+			if ((table_index >= 0) && (table_index < ACTUATION_TABLE_POSITIONS)) {
+				atomic_fetch_add_explicit(&server_state->actuation_tables.miss_cnt, 1, memory_order_relaxed);
+				request_actuation_tables(server_state);
 			}
 		}
+
 		if (at_least_loglevel(LLVL_TRACE)) {
+			trace_actuation(snapshot, pattern_row, carriage_position, belt_phase, direction_left_to_right);
+
 			/* Print output in JSON form */
 			struct json_dict_entry_t entries[] = {
 				JSON_DICTENTRY_STR("json_id", "spidata"),
-				JSON_DICTENTRY_INT("carriage_position", server_state->carriage_position),
+				JSON_DICTENTRY_INT("carriage_position", carriage_position),
 				JSON_DICTENTRY_INT("byte0", spi_data[0]),
 				JSON_DICTENTRY_INT("byte1", spi_data[1]),
 				{ 0 }
@@ -121,21 +556,41 @@ void sled_update(struct server_state_t *server_state) {
 			json_trace(entries);
 		}
 	}
-	if (!pgm_opts->no_hardware) {
-		spi_send(SPI_74HC595, spi_data, sizeof(spi_data));
-	}
+	read_snapshot_end(server_state);
+
+	latch_spi_data(server_state, spi_data);
+	latency_record_since_edge(LATENCY_EDGE_TO_SPI);
+}
+
+/* Called by the real-time threads that react to carriage movement. They always
+ * perform their own update: if a regular thread is currently inside the
+ * update, it inherits their priority until it is done. */
+static void sled_update_realtime(struct server_state_t *server_state) {
+	pthread_mutex_lock(&server_state->update_lock);
+	perform_sled_update(server_state);
+	pthread_mutex_unlock(&server_state->update_lock);
+}
+
+/* Can be called from any regular thread. These are serialized among
+ * themselves first, so that a real-time thread never has to wait for more
+ * than a single update of a regular thread. */
+void sled_update(struct server_state_t *server_state) {
+	request_actuation_tables(server_state);
+	pthread_mutex_lock(&server_state->update_request_lock);
+	sled_update_realtime(server_state);
+	pthread_mutex_unlock(&server_state->update_request_lock);
 }
 
-static void next_row(struct server_state_t *server_state) {
+static void next_row(struct server_state_t *server_state, const struct pattern_t *pattern) {
 	if (server_state->repeat_mode != RPTMODE_MANUAL) {
-		if (server_state->pattern_row + 1 < server_state->pattern->height) {
+		if (server_state->pattern_row + 1 < pattern->height) {
 			server_state->pattern_row++;
 		} else {
 			server_state->pattern_row = 0;
 			if (server_state->repeat_mode == RPTMODE_ONESHOT) {
 				set_knitting_mode(server_state, false);
 			} else {
-				if ((server_state->pattern->height % 2) == 1) {
+				if ((pattern->height % 2) == 1) {
 					server_state->even_rows_left_to_right = !server_state->even_rows_left_to_right;
 				}
 			}
@@ -144,39 +599,136 @@ static void next_row(struct server_state_t *server_state) {
 		/* Do not advance row, but inverse direction in manual mode */
 		server_state->even_rows_left_to_right = !server_state->even_rows_left_to_right;
 	}
+	request_actuation_tables(server_state);
+	persist_server_state(server_state);
 }
 
 static void check_for_next_row(struct server_state_t *server_state) {
-	if (!server_state->pattern) {
-		return;
-	}
 	if (!server_state->knitting_mode) {
 		return;
 	}
 
-	bool is_even_row = (server_state->pattern_row % 2) == 0;
-	if (server_state->even_rows_left_to_right == is_even_row) {
-		/* Waiting for position right of pattern */
-		int rightmost_needle = server_state->pattern->max_x + server_state->pattern_offset + 32;
-		if (server_state->carriage_position >= rightmost_needle) {
-			next_row(server_state);
-		}
-	} else {
-		int leftmost_needle = server_state->pattern->min_x + server_state->pattern_offset - 32;
-		if (server_state->carriage_position <= leftmost_needle) {
-			next_row(server_state);
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(server_state);
+	if (snapshot) {
+		bool is_even_row = (server_state->pattern_row % 2) == 0;
+		if (server_state->even_rows_left_to_right == is_even_row) {
+			/* Waiting for position right of pattern */
+			int rightmost_needle = snapshot->pattern->max_x + snapshot->pattern_offset + 32;
+			if (server_state->carriage_position >= rightmost_needle) {
+				next_row(server_state, snapshot->pattern);
+			}
+		} else {
+			int leftmost_needle = snapshot->pattern->min_x + snapshot->pattern_offset - 32;
+			if (server_state->carriage_position <= leftmost_needle) {
+				next_row(server_state, snapshot->pattern);
+			}
 		}
 	}
+	read_snapshot_end(server_state);
+}
+
+static int32_t motion_to_velocity(const struct sled_motion_t *motion) {
+	if (!motion || !motion->valid || (motion->step_period_ns == 0)) {
+		return 0;
+	}
+	return motion->direction * (int32_t)(1000000000LL / ((int64_t)motion->step_period_ns * SLED_STEPS_PER_POSITION));
 }
 
-void sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase) {
+/* Sets the new carriage position, supersedes any prediction that is currently
+ * latched and schedules the prediction for the next position. */
+static void update_prediction(struct server_state_t *server_state, int position, const struct sled_motion_t *motion) {
+	struct actuation_prediction_t *prediction = &server_state->prediction;
+	pthread_mutex_lock(&prediction->mutex);
+	if (atomic_load(&prediction->active) && (prediction->predicted_position != position)) {
+		atomic_fetch_add(&prediction->mispredicted_cnt, 1);
+	}
+	atomic_store(&prediction->active, false);
 	server_state->carriage_position = position;
+
+	prediction->armed = prediction->lead_time_us && motion && motion->valid;
+	if (prediction->armed) {
+		prediction->deadline = motion->last_step;
+		add_timespec_offset_ns(&prediction->deadline, ((int64_t)motion->steps_to_next_position * motion->step_period_ns) - (1000LL * prediction->lead_time_us));
+		prediction->from_position = position;
+		prediction->next_position = position + motion->direction;
+		pthread_cond_signal(&prediction->cond);
+	}
+	pthread_mutex_unlock(&prediction->mutex);
+}
+
+static void* actuation_prediction_thread(void *vserver_state) {
+	struct server_state_t *server_state = (struct server_state_t*)vserver_state;
+	struct actuation_prediction_t *prediction = &server_state->prediction;
+	pthread_mutex_lock(&prediction->mutex);
+	while (true) {
+		if (!prediction->armed) {
+			pthread_cond_wait(&prediction->cond, &prediction->mutex);
+			continue;
+		}
+
+		/* The deadline is in the clock domain of the GPIO edge timestamps,
+		 * the condition variable waits on CLOCK_REALTIME. */
+		struct timespec now;
+		latency_timestamp(&now);
+		int64_t remaining_ns = timespec_diff(&prediction->deadline, &now);
+		if (remaining_ns > 0) {
+			struct timespec abstime;
+			get_timespec_now(&abstime);
+			add_timespec_offset_ns(&abstime, remaining_ns);
+			pthread_cond_timedwait(&prediction->cond, &prediction->mutex, &abstime);
+			continue;
+		}
+
+		prediction->armed = false;
+		if (server_state->carriage_position == prediction->from_position) {
+			prediction->predicted_position = prediction->next_position;
+			atomic_store(&prediction->active, true);
+			atomic_fetch_add(&prediction->predicted_cnt, 1);
+			pthread_mutex_unlock(&prediction->mutex);
+			sled_update_realtime(server_state);
+			pthread_mutex_lock(&prediction->mutex);
+		}
+	}
+	return NULL;
+}
+
+bool start_actuation_prediction(struct server_state_t *server_state, unsigned int lead_time_us) {
+	server_state->prediction.lead_time_us = lead_time_us;
+	if (!start_realtime_thread(actuation_prediction_thread, server_state, "knitpi-predict")) {
+		server_state->prediction.lead_time_us = 0;
+		return false;
+	}
+	logmsg(LLVL_INFO, "Predictive actuation enabled, latching %u µs ahead of predicted carriage arrival.", lead_time_us);
+	return true;
+}
+
+/* Only uses atomics, so that the latch never waits for the prediction thread.
+ * The predicted position is stored before the prediction is activated, the
+ * sled update reads them in the opposite order. */
+void sled_phase_actuation_callback(struct server_state_t *server_state, int latch_position) {
+	struct actuation_prediction_t *prediction = &server_state->prediction;
+	if (latch_position == server_state->carriage_position) {
+		/* Carriage reversed before reaching the next needle */
+		if (atomic_exchange(&prediction->active, false)) {
+			atomic_fetch_add(&prediction->mispredicted_cnt, 1);
+		}
+	} else {
+		atomic_store(&prediction->predicted_position, latch_position);
+		atomic_store(&prediction->active, true);
+		atomic_fetch_add(&prediction->predicted_cnt, 1);
+	}
+	sled_update_realtime(server_state);
+}
+
+void sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase, const struct sled_motion_t *motion) {
+	update_prediction(server_state, position, motion);
+	server_state->carriage_velocity = motion_to_velocity(motion);
 	server_state->belt_phase = belt_phase;
 	if (server_state->carriage_position_valid) {
 		check_for_next_row(server_state);
 	}
 	server_state->carriage_position_valid = true;
 
-	sled_update(server_state);
+	sled_update_realtime(server_state);
 	isleep_interrupt(&server_state->event_notification);
 }
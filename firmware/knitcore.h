@@ -26,9 +26,36 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <pthread.h>
 #include "pattern.h"
 #include "atomic.h"
 #include "isleep.h"
+#include "rcu.h"
+#include "pattern_cache.h"
+#include "png_cache.h"
+#include "preview.h"
+#include "persist.h"
+
+#define ACTUATION_TABLE_FIRST_POSITION		-64
+#define ACTUATION_TABLE_POSITIONS			384
+
+/* Tables for the current and the next row are kept so that the table of the
+ * next row is already compiled when the carriage finishes the current one */
+#define ACTUATION_TABLE_SLOTS				2
+
+/* The compiler thread is woken whenever the row or the snapshot changes, but
+ * also checks its tables periodically in case a wakeup was missed */
+#define ACTUATION_TABLE_RECHECK_MS			100
+
+/* Likewise, the persistence thread is woken whenever persisted values change
+ * and retries pattern writes that failed periodically */
+#define PERSIST_RECHECK_MS					1000
+
+/* Even if the solenoid word did not change, it is sent again after this time
+ * to recover from any glitch on the shift register lines. */
+#define SPI_CACHE_REFRESH_INTERVAL_MS		250
 
 enum repeat_mode_t {
 	RPTMODE_ONESHOT,
@@ -36,29 +63,154 @@ enum repeat_mode_t {
 	RPTMODE_MANUAL,
 };
 
-struct server_state_t {
-	struct isleep_t event_notification;
-	bool knitting_mode;
-	enum repeat_mode_t repeat_mode;
-	bool even_rows_left_to_right;
-	bool carriage_position_valid;
-	bool belt_phase;
-	int32_t carriage_position;
+/* Solenoid words for one pattern row, precompiled for every carriage position
+ * in both directions and both belt phases so that the position callback only
+ * needs to do a single lookup. Indexed by [left_to_right][belt_phase][position
+ * - ACTUATION_TABLE_FIRST_POSITION]. Tables are only written by the compiler
+ * thread; the sequence number is odd while a table is being rewritten, so
+ * that readers can detect and discard torn reads without ever blocking. */
+struct actuation_table_t {
+	atomic_uint sequence;
+	bool valid;
+	uint32_t snapshot_version;
 	int32_t pattern_row;
-	int32_t pattern_offset;
+	unsigned int window_offset;
+	unsigned int window_size;
+	uint8_t spi_data[2][2][ACTUATION_TABLE_POSITIONS][2];
+};
+
+struct actuation_tables_t {
+	struct actuation_table_t slot[ACTUATION_TABLE_SLOTS];
+	struct isleep_t wakeup;
+	atomic_bool requested;
+	atomic_uint compiled_cnt;
+	atomic_uint miss_cnt;				/* Lookups that found no current table */
+};
+
+/* Pattern and knitting progress are written to the state file by a regular
+ * thread, so that neither the actuation path nor snapshot writers ever wait
+ * for the file system. Everything but the atomics belongs to the thread. */
+struct state_persistence_t {
+	pthread_t thread;
+	struct isleep_t wakeup;
+	atomic_bool requested;
+	atomic_bool stop;
+	bool running;
+	bool state_pending;
+	uint32_t pattern_version;				/* Last persisted pattern, zero if none */
+};
+
+/* Remembers the solenoid word that was last latched into the shift registers
+ * so that identical words do not cause another SPI transfer. */
+struct spi_cache_t {
+	bool valid;
+	uint8_t spi_data[2];
+	struct timespec last_sent;
+	atomic_uint sent_cnt;
+	atomic_uint suppressed_cnt;
+};
+
+/* When enabled, the word for the position the carriage is predicted to reach
+ * next is latched lead_time_us before the predicted arrival or once the
+ * carriage is at the configured quadrature phase before it. The next real
+ * position callback always supersedes any prediction. */
+struct actuation_prediction_t {
+	pthread_mutex_t mutex;				/* Priority inheritance, shared with the GPIO thread */
+	pthread_cond_t cond;
+	unsigned int lead_time_us;
+	bool armed;
+	struct timespec deadline;
+	int32_t from_position;
+	int32_t next_position;
+	atomic_bool active;
+	_Atomic int32_t predicted_position;
+	atomic_uint predicted_cnt;
+	atomic_uint mispredicted_cnt;
+};
+
+struct sled_motion_t;
+
+/* Passed to update_snapshot_commit() to continue knitting at the current row */
+#define SNAPSHOT_KEEP_PATTERN_ROW		-1
+
+/* Immutable once published. Clients that want to change pattern or offset
+ * create a new snapshot and publish it through the RCU pointer in the server
+ * state; the previous one is reclaimed after all readers are done with it. */
+struct pattern_snapshot_t {
+	uint32_t version;
+	uint32_t pattern_version;				/* Only changes when the pattern itself is replaced */
+	struct pattern_layer_t *layer;			/* Reference that keeps the pattern alive */
 	struct pattern_t *pattern;
+	int32_t pattern_offset;
+};
+
+struct server_state_t {
+	struct isleep_t event_notification;
+	atomic_bool knitting_mode;
+	_Atomic enum repeat_mode_t repeat_mode;
+	atomic_bool even_rows_left_to_right;
+	atomic_bool carriage_position_valid;
+	atomic_bool belt_phase;
+	_Atomic int32_t carriage_position;
+	_Atomic int32_t carriage_velocity;
+	_Atomic int32_t pattern_row;
+	struct rcu_t snapshot_rcu;
+	_Atomic(struct pattern_snapshot_t*) snapshot;
+	uint32_t last_snapshot_version;			/* Modified only by snapshot writers */
+	uint32_t last_pattern_version;
+	pthread_mutex_t update_lock;			/* Held while updating the solenoids, priority inheritance */
+	pthread_mutex_t update_request_lock;	/* Serializes updates requested by regular threads */
+	struct actuation_tables_t actuation_tables;
+	struct spi_cache_t spi_cache;
+	struct actuation_prediction_t prediction;
+	struct pattern_cache_t pattern_cache;
+	struct png_cache_t png_cache;
+	struct preview_t preview;
+	struct persist_t *persist;				/* NULL unless state is persisted */
+	struct state_persistence_t persistence;
+	atomic_bool resume_knitting;			/* Restored knitting mode, pending a valid carriage position */
 	struct atomic_ctr_t thread_count;
 };
 
 #define SERVER_STATE_INITIALIZER		{		\
 	.event_notification = ISLEEP_INITIALIZER,	\
+	.snapshot_rcu = RCU_INITIALIZER,			\
+	.update_request_lock = PTHREAD_MUTEX_INITIALIZER,	\
+	.actuation_tables = {						\
+		.wakeup = ISLEEP_INITIALIZER,			\
+	},											\
+	.prediction = {								\
+		.cond = PTHREAD_COND_INITIALIZER,		\
+	},											\
+	.pattern_cache = PATTERN_CACHE_INITIALIZER,	\
+	.png_cache = PNG_CACHE_INITIALIZER,			\
+	.preview = PREVIEW_INITIALIZER,				\
+	.persistence = {							\
+		.wakeup = ISLEEP_INITIALIZER,			\
+	},											\
 	.thread_count = ATOMIC_CTR_INITIALIZER(0),	\
 }
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool init_server_state(struct server_state_t *server_state);
+void persist_server_state(struct server_state_t *server_state);
 void set_knitting_mode(struct server_state_t *state, bool knitting_mode);
+const struct pattern_snapshot_t* read_snapshot_begin(struct server_state_t *server_state);
+void read_snapshot_end(struct server_state_t *server_state);
+const struct pattern_snapshot_t* update_snapshot_begin(struct server_state_t *server_state);
+void update_snapshot_abort(struct server_state_t *server_state);
+bool update_snapshot_commit_layer(struct server_state_t *server_state, struct pattern_layer_t *layer, int32_t pattern_offset, int32_t pattern_row);
+bool update_snapshot_commit(struct server_state_t *server_state, struct pattern_t *pattern, int32_t pattern_offset, int32_t pattern_row);
+void free_snapshot(struct server_state_t *server_state);
+void restore_server_state(struct server_state_t *server_state, struct persist_t *persist);
+bool start_state_persistence(struct server_state_t *server_state);
+void stop_state_persistence(struct server_state_t *server_state);
+void request_actuation_tables(struct server_state_t *server_state);
+bool start_actuation_table_compiler(struct server_state_t *server_state);
 void sled_update(struct server_state_t *server_state);
-void sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase);
+void sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase, const struct sled_motion_t *motion);
+bool start_actuation_prediction(struct server_state_t *server_state, unsigned int lead_time_us);
+void sled_phase_actuation_callback(struct server_state_t *server_state, int latch_position);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
 #endif
@@ -30,24 +30,78 @@
 #include "sled.h"
 #include "server.h"
 #include "pgmopts.h"
+#include "realtime.h"
+#include "pattern.h"
+#include "persist.h"
 
 int main(int argc, char **argv) {
 	parse_pgmopts(argc, argv);
 	set_loglevel(pgm_opts->loglevel);
 
+	const struct realtime_config_t realtime_config = {
+		.enabled = pgm_opts->realtime,
+		.cpu = pgm_opts->realtime_cpu,
+		.priority = pgm_opts->realtime_priority,
+	};
+	if (!realtime_init(&realtime_config)) {
+		logmsg(LLVL_FATAL, "Failed to enter real-time mode.");
+		exit(EXIT_FAILURE);
+	}
+
+	const struct pattern_storage_config_t pattern_storage_config = {
+		.max_height = pgm_opts->max_pattern_height,
+		.directory = pgm_opts->pattern_storage_dir,
+		.lock_resident_rows = pgm_opts->realtime,
+		.deduplicate_rows = !pgm_opts->no_row_dedup,
+	};
+	pattern_set_storage_config(&pattern_storage_config);
+
 	struct server_state_t server_state = SERVER_STATE_INITIALIZER;
+	if (!init_server_state(&server_state)) {
+		logmsg(LLVL_FATAL, "Failed to initialize server state.");
+		exit(EXIT_FAILURE);
+	}
+	if (!start_actuation_table_compiler(&server_state)) {
+		logmsg(LLVL_FATAL, "Failed to start actuation table compiler.");
+		exit(EXIT_FAILURE);
+	}
+	server_state.pattern_cache.memory_budget = (size_t)pgm_opts->pattern_cache_kib * 1024;
 	if (!pgm_opts->no_hardware) {
 		if (!all_peripherals_init()) {
 			logmsg(LLVL_FATAL, "Failed to initialize hardware peripherals.");
 			exit(EXIT_FAILURE);
 		}
 		sled_set_callback(&server_state, sled_actuation_callback);
-		start_debouncer_thread(sled_input);
-		start_gpio_thread(debouncer_input, true);
+		if (pgm_opts->latch_phase) {
+			sled_set_phase_callback(sled_phase_actuation_callback, pgm_opts->latch_phase);
+		}
+		if (pgm_opts->predict_lead_us && !start_actuation_prediction(&server_state, pgm_opts->predict_lead_us)) {
+			logmsg(LLVL_FATAL, "Failed to start actuation prediction.");
+			exit(EXIT_FAILURE);
+		}
+		if (!start_debouncer_thread(sled_input) || !start_gpio_thread(debouncer_input, true)) {
+			logmsg(LLVL_FATAL, "Failed to start input processing threads.");
+			exit(EXIT_FAILURE);
+		}
 		gpio_active(GPIO_LED_GREEN);
 		spi_clear(SPI_74HC595, 2);
 	}
 
+	struct persist_t *persist = NULL;
+	if (pgm_opts->state_file) {
+		persist = persist_open(pgm_opts->state_file);
+		if (!persist) {
+			logmsg(LLVL_FATAL, "Failed to open state file %s.", pgm_opts->state_file);
+			exit(EXIT_FAILURE);
+		}
+		restore_server_state(&server_state, persist);
+		if (!start_state_persistence(&server_state)) {
+			logmsg(LLVL_FATAL, "Failed to start state persistence.");
+			exit(EXIT_FAILURE);
+		}
+		sled_update(&server_state);
+	}
+
 	if (pgm_opts->force) {
 		unlink(pgm_opts->unix_socket);
 	}
@@ -56,6 +110,13 @@ int main(int argc, char **argv) {
 		logmsg(LLVL_FATAL, "Failed to start server.");
 		exit(EXIT_FAILURE);
 	}
-	pattern_free(server_state.pattern);
+	/* Keep the persisted state, it is restored on the next start */
+	stop_state_persistence(&server_state);
+	server_state.persist = NULL;
+	persist_close(persist);
+	free_snapshot(&server_state);
+	pattern_cache_clear(&server_state.pattern_cache);
+	png_cache_clear(&server_state.png_cache);
+	preview_clear(&server_state.preview);
 	return 0;
 }
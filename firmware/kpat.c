@@ -0,0 +1,253 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include "kpat.h"
+#include "logging.h"
+
+static void kpat_bounding_box(const struct pattern_t *pattern, struct kpat_header_t *header) {
+	header->min_x = pattern->width + 1;
+	header->min_y = pattern->height + 1;
+	header->max_x = 0;
+	header->max_y = 0;
+	for (unsigned int y = 0; y < pattern->height; y++) {
+		if (!pattern_row_is_empty(pattern, y)) {
+			header->min_x = (pattern->row_min_x[y] < header->min_x) ? pattern->row_min_x[y] : header->min_x;
+			header->max_x = (pattern->row_max_x[y] > header->max_x) ? pattern->row_max_x[y] : header->max_x;
+			header->min_y = (y < header->min_y) ? y : header->min_y;
+			header->max_y = y;
+		}
+	}
+}
+
+static unsigned int kpat_bounding_box_rows(const struct kpat_header_t *header) {
+	return (header->min_y <= header->max_y) ? (header->max_y - header->min_y + 1) : 0;
+}
+
+static uint64_t kpat_body_size(const struct kpat_header_t *header) {
+	if (header->unique_rows) {
+		return ((uint64_t)header->height * sizeof(uint32_t)) + ((uint64_t)header->unique_rows * header->width);
+	} else {
+		return (uint64_t)kpat_bounding_box_rows(header) * header->width;
+	}
+}
+
+/* Numbers the unique rows that are referenced in order of their first
+ * appearance, so that rows which are no longer referenced are not written.
+ * Returns NULL if memory could not be allocated. */
+static uint32_t* kpat_map_unique_rows(const struct pattern_t *pattern, uint32_t *referenced_rows) {
+	unsigned int unique_rows = pattern_unique_rows(pattern);
+	uint32_t *row_map = malloc(unique_rows * sizeof(uint32_t));
+	if (!row_map) {
+		perror("malloc row_map");
+		return NULL;
+	}
+	memset(row_map, 0xff, unique_rows * sizeof(uint32_t));
+	*referenced_rows = 0;
+	for (unsigned int y = 0; y < pattern->height; y++) {
+		uint32_t row_id = pattern_get_row_id(pattern, y);
+		if (row_map[row_id] == UINT32_MAX) {
+			row_map[row_id] = (*referenced_rows)++;
+		}
+	}
+	return row_map;
+}
+
+static void kpat_write_unique_rows(const struct pattern_t *pattern, const uint32_t *row_map, uint8_t *body) {
+	uint8_t *unique_rows = body + (pattern->height * sizeof(uint32_t));
+	uint32_t rows_written = 0;
+	for (unsigned int y = 0; y < pattern->height; y++) {
+		uint32_t row_id = row_map[pattern_get_row_id(pattern, y)];
+		memcpy(body + (y * sizeof(uint32_t)), &row_id, sizeof(uint32_t));
+		if (row_id == rows_written) {
+			pattern_get_row(pattern, y, unique_rows + (row_id * pattern->width));
+			rows_written++;
+		}
+	}
+}
+
+static bool kpat_write(const struct pattern_t *pattern, struct membuf_t *membuf) {
+	struct kpat_header_t header = {
+		.magic = KPAT_MAGIC,
+		.version = KPAT_VERSION,
+		.width = pattern->width,
+		.height = pattern->height,
+		.used_colors = pattern->used_colors,
+	};
+	kpat_bounding_box(pattern, &header);
+	uint32_t *row_map = pattern->dict ? kpat_map_unique_rows(pattern, &header.unique_rows) : NULL;
+	if (header.unique_rows && (kpat_body_size(&header) >= (uint64_t)kpat_bounding_box_rows(&header) * pattern->width)) {
+		header.unique_rows = 0;
+	}
+
+	unsigned int offset = membuf->length;
+	unsigned int palette_size = header.used_colors * sizeof(uint32_t);
+	uint64_t size = sizeof(header) + palette_size + kpat_body_size(&header);
+	if ((offset + size > UINT32_MAX) || !membuf_resize(membuf, offset + size)) {
+		logmsg(LLVL_ERROR, "Failed to allocate %" PRIu64 " bytes for %u x %u kpat pattern.", size, pattern->width, pattern->height);
+		free(row_map);
+		return false;
+	}
+	uint8_t *data = membuf->data + offset;
+	memcpy(data, &header, sizeof(header));
+	memcpy(data + sizeof(header), pattern->rgb_palette, palette_size);
+	uint8_t *body = data + sizeof(header) + palette_size;
+
+	if (header.unique_rows) {
+		kpat_write_unique_rows(pattern, row_map, body);
+	} else {
+		for (unsigned int i = 0; i < kpat_bounding_box_rows(&header); i++) {
+			uint8_t *row = body + (i * pattern->width);
+			const uint8_t *source = pattern_get_row(pattern, header.min_y + i, row);
+			if (source != row) {
+				memcpy(row, source, pattern->width);
+			}
+		}
+	}
+	free(row_map);
+	return true;
+}
+
+/* Appends any kind of pattern to membuf. Rows are written through a row
+ * dictionary if that is smaller than their bounding box. */
+bool kpat_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *membuf) {
+	if (pattern->dict) {
+		return kpat_write(pattern, membuf);
+	}
+	struct pattern_t *deduplicated = pattern_deduplicate(pattern);
+	bool success = kpat_write(deduplicated ? deduplicated : pattern, membuf);
+	pattern_free(deduplicated);
+	return success;
+}
+
+static bool kpat_colors_valid(const uint8_t *data, size_t length, unsigned int used_colors) {
+	for (size_t i = 0; i < length; i++) {
+		if (data[i] > used_colors) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool kpat_header_valid(const struct kpat_header_t *header, unsigned int length) {
+	if ((header->magic != KPAT_MAGIC) || (header->version != KPAT_VERSION)) {
+		logmsg(LLVL_ERROR, "Pattern data has no valid kpat header.");
+		return false;
+	}
+	if ((header->width > MAX_PATTERN_WIDTH) || (header->height > pattern_get_max_height()) || (header->used_colors > 255) || (header->unique_rows > header->height + 1)) {
+		logmsg(LLVL_ERROR, "kpat data describes an unsupported %u x %u pattern.", header->width, header->height);
+		return false;
+	}
+	if ((header->min_y <= header->max_y) && ((header->max_y >= header->height) || (header->min_x > header->max_x) || (header->max_x >= header->width))) {
+		logmsg(LLVL_ERROR, "kpat data has an invalid bounding box.");
+		return false;
+	}
+	if (sizeof(*header) + (header->used_colors * sizeof(uint32_t)) + kpat_body_size(header) != length) {
+		logmsg(LLVL_ERROR, "kpat data of %u x %u pattern has invalid length %u.", header->width, header->height, length);
+		return false;
+	}
+	return true;
+}
+
+static bool kpat_read_unique_rows(struct pattern_t *pattern, const struct kpat_header_t *header, const uint8_t *body) {
+	const uint8_t *unique_rows = body + (header->height * sizeof(uint32_t));
+	if (!kpat_colors_valid(unique_rows, (size_t)header->unique_rows * header->width, header->used_colors)) {
+		return false;
+	}
+	bool *row_empty = calloc(header->unique_rows, sizeof(bool));
+	if (!row_empty) {
+		perror("calloc row_empty");
+		return false;
+	}
+	for (unsigned int i = 0; i < header->unique_rows; i++) {
+		const uint8_t *row = unique_rows + (i * header->width);
+		row_empty[i] = !header->width || (!row[0] && !memcmp(row, row + 1, header->width - 1));
+	}
+
+	bool valid = true;
+	for (unsigned int y = 0; y < header->height; y++) {
+		uint32_t row_id;
+		memcpy(&row_id, body + (y * sizeof(uint32_t)), sizeof(uint32_t));
+		if (row_id >= header->unique_rows) {
+			valid = false;
+			break;
+		}
+		if (!row_empty[row_id]) {
+			pattern_set_row(pattern, y, unique_rows + (row_id * header->width));
+		}
+	}
+	free(row_empty);
+	return valid;
+}
+
+/* Rows without a dictionary are copied into the pixel storage of the pattern
+ * as a whole; only stitch masks and row occupancy are derived from them. */
+static bool kpat_read_rows(struct pattern_t *pattern, const struct kpat_header_t *header, const uint8_t *body) {
+	unsigned int row_count = kpat_bounding_box_rows(header);
+	if (!kpat_colors_valid(body, (size_t)row_count * header->width, header->used_colors)) {
+		return false;
+	}
+	if (row_count) {
+		memcpy(pattern_row_rw(pattern, header->min_y), body, (size_t)row_count * header->width);
+	}
+	for (unsigned int i = 0; i < row_count; i++) {
+		pattern_sync_row(pattern, header->min_y + i);
+	}
+	return true;
+}
+
+struct pattern_t* kpat_read_pattern(const struct membuf_t *membuf) {
+	struct kpat_header_t header;
+	if (membuf->length < sizeof(header)) {
+		logmsg(LLVL_ERROR, "kpat data too short (%u bytes).", membuf->length);
+		return NULL;
+	}
+	memcpy(&header, membuf->data, sizeof(header));
+	if (!kpat_header_valid(&header, membuf->length)) {
+		return NULL;
+	}
+
+	struct pattern_t *pattern = header.unique_rows ? pattern_new_deduplicated(header.width, header.height) : pattern_new(header.width, header.height);
+	if (!pattern) {
+		return NULL;
+	}
+	uint32_t rgb_palette[255];
+	memcpy(rgb_palette, membuf->data + sizeof(header), header.used_colors * sizeof(uint32_t));
+	pattern_set_palette(pattern, rgb_palette, header.used_colors);
+
+	const uint8_t *body = membuf->data + sizeof(header) + (header.used_colors * sizeof(uint32_t));
+	bool valid = header.unique_rows ? kpat_read_unique_rows(pattern, &header, body) : kpat_read_rows(pattern, &header, body);
+	if (valid) {
+		pattern_update_min_max(pattern);
+		valid = (pattern->min_x == header.min_x) && (pattern->max_x == header.max_x) && (pattern->min_y == header.min_y) && (pattern->max_y == header.max_y);
+	}
+	if (!valid) {
+		logmsg(LLVL_ERROR, "kpat data of %u x %u pattern is inconsistent.", header.width, header.height);
+		pattern_free(pattern);
+		return NULL;
+	}
+	return pattern;
+}
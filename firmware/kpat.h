@@ -0,0 +1,57 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __KPAT_H__
+#define __KPAT_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pattern.h"
+#include "membuf.h"
+
+#define KPAT_MAGIC					0x5441504b		/* "KPAT" */
+#define KPAT_VERSION				1
+
+/* Native pattern format, in host byte order. The header is followed by the
+ * palette (used_colors words). If unique_rows is zero, the rows min_y to
+ * max_y of the bounding box follow with one palette index byte per stitch,
+ * laid out exactly like the pixel data of a pattern; all other rows are
+ * empty. Otherwise, the unique row ID of every row (height words) and
+ * unique_rows rows of width bytes follow. The bounding box uses the
+ * convention of struct pattern_t, i.e., min > max for empty patterns. */
+struct kpat_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t used_colors;
+	uint32_t min_x, max_x;
+	uint32_t min_y, max_y;
+	uint32_t unique_rows;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool kpat_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *membuf);
+struct pattern_t* kpat_read_pattern(const struct membuf_t *membuf);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -0,0 +1,176 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+#include "latency.h"
+#include "tools.h"
+
+/* All counters are only ever written by the actuation path and read or reset
+ * by client threads. Relaxed atomics are sufficient: a sample that races with
+ * a reset may be partially accounted for, which is irrelevant for statistics
+ * but keeps recording down to a handful of uncontended instructions. */
+struct latency_histogram_t {
+	atomic_uint count;
+	atomic_uint min_us;
+	atomic_uint max_us;
+	atomic_uint buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+static struct latency_histogram_t histograms[LATENCY_STAGE_COUNT] = {
+	[0 ... LATENCY_STAGE_COUNT - 1] = {
+		.min_us = ATOMIC_VAR_INIT(UINT_MAX),
+	},
+};
+static _Atomic clockid_t latency_clock = ATOMIC_VAR_INIT(CLOCK_REALTIME);
+static atomic_bool latency_clock_determined;
+static _Thread_local struct timespec current_edge;
+static _Thread_local bool current_edge_valid;
+
+const char *latency_stage_to_str(enum latency_stage_t stage) {
+	switch (stage) {
+		case LATENCY_GPIO_WAKEUP:	return "gpio_wakeup";
+		case LATENCY_DEBOUNCER:		return "debouncer";
+		case LATENCY_CALLBACK:		return "callback";
+		case LATENCY_SPI_SEND:		return "spi_send";
+		case LATENCY_EDGE_TO_SPI:	return "edge_to_spi";
+		case LATENCY_STAGE_COUNT:	break;
+	}
+	return "unknown";
+}
+
+int latency_bucket_min_us(unsigned int bucket) {
+	return (bucket == 0) ? 0 : (1 << (bucket - 1));
+}
+
+static unsigned int latency_to_bucket(unsigned int latency_us) {
+	if (latency_us == 0) {
+		return 0;
+	}
+	unsigned int bucket = (sizeof(unsigned int) * 8) - __builtin_clz(latency_us);
+	return (bucket < LATENCY_HISTOGRAM_BUCKETS) ? bucket : (LATENCY_HISTOGRAM_BUCKETS - 1);
+}
+
+/* Depending on the kernel version, GPIO event timestamps are either taken from
+ * CLOCK_REALTIME or CLOCK_MONOTONIC. Determine which one it is by the first
+ * edge we see so that all subsequent measurements use the same clock. */
+static void determine_latency_clock(const struct timespec *edge_ts) {
+	if (atomic_load_explicit(&latency_clock_determined, memory_order_acquire)) {
+		return;
+	}
+	struct timespec realtime_now, monotonic_now;
+	clock_gettime(CLOCK_REALTIME, &realtime_now);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic_now);
+	int64_t realtime_diff = llabs(timespec_diff(&realtime_now, edge_ts));
+	int64_t monotonic_diff = llabs(timespec_diff(&monotonic_now, edge_ts));
+	atomic_store_explicit(&latency_clock, (monotonic_diff < realtime_diff) ? CLOCK_MONOTONIC : CLOCK_REALTIME, memory_order_relaxed);
+	atomic_store_explicit(&latency_clock_determined, true, memory_order_release);
+}
+
+void latency_timestamp(struct timespec *ts) {
+	clock_gettime(atomic_load_explicit(&latency_clock, memory_order_relaxed), ts);
+}
+
+void latency_record(enum latency_stage_t stage, const struct timespec *start, const struct timespec *end) {
+	struct latency_histogram_t *histogram = &histograms[stage];
+	int64_t latency_ns = timespec_diff(end, start);
+	unsigned int latency_us;
+	if (latency_ns < 0) {
+		latency_us = 0;
+	} else if (latency_ns / 1000 > UINT_MAX) {
+		latency_us = UINT_MAX;
+	} else {
+		latency_us = latency_ns / 1000;
+	}
+
+	atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&histogram->buckets[latency_to_bucket(latency_us)], 1, memory_order_relaxed);
+	if (latency_us < atomic_load_explicit(&histogram->min_us, memory_order_relaxed)) {
+		atomic_store_explicit(&histogram->min_us, latency_us, memory_order_relaxed);
+	}
+	if (latency_us > atomic_load_explicit(&histogram->max_us, memory_order_relaxed)) {
+		atomic_store_explicit(&histogram->max_us, latency_us, memory_order_relaxed);
+	}
+}
+
+void latency_record_since(enum latency_stage_t stage, const struct timespec *start) {
+	struct timespec now;
+	latency_timestamp(&now);
+	latency_record(stage, start, &now);
+}
+
+/* Records the latency from a kernel edge timestamp until now. */
+void latency_record_edge(enum latency_stage_t stage, const struct timespec *edge_ts) {
+	determine_latency_clock(edge_ts);
+	latency_record_since(stage, edge_ts);
+}
+
+/* Sets the edge timestamp that the calling thread is currently processing, or
+ * clears it when NULL is given. */
+void latency_set_edge(const struct timespec *edge_ts) {
+	if (edge_ts) {
+		determine_latency_clock(edge_ts);
+		current_edge = *edge_ts;
+		current_edge_valid = true;
+	} else {
+		current_edge_valid = false;
+	}
+}
+
+/* Only records something if the calling thread is processing an edge, i.e.,
+ * anything triggered by a client command is not accounted for. */
+void latency_record_since_edge(enum latency_stage_t stage) {
+	if (current_edge_valid) {
+		latency_record_since(stage, &current_edge);
+	}
+}
+
+void latency_get_stats(enum latency_stage_t stage, struct latency_stats_t *stats) {
+	const struct latency_histogram_t *histogram = &histograms[stage];
+	unsigned int count = atomic_load_explicit(&histogram->count, memory_order_relaxed);
+	unsigned int min_us = atomic_load_explicit(&histogram->min_us, memory_order_relaxed);
+	unsigned int max_us = atomic_load_explicit(&histogram->max_us, memory_order_relaxed);
+	stats->count = (count > INT_MAX) ? INT_MAX : count;
+	stats->min_us = (count == 0) ? 0 : (min_us > INT_MAX) ? INT_MAX : min_us;
+	stats->max_us = (max_us > INT_MAX) ? INT_MAX : max_us;
+	for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+		unsigned int bucket_count = atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+		stats->buckets[i] = (bucket_count > INT_MAX) ? INT_MAX : bucket_count;
+	}
+}
+
+void latency_reset(void) {
+	for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+		struct latency_histogram_t *histogram = &histograms[stage];
+		atomic_store_explicit(&histogram->count, 0, memory_order_relaxed);
+		atomic_store_explicit(&histogram->min_us, UINT_MAX, memory_order_relaxed);
+		atomic_store_explicit(&histogram->max_us, 0, memory_order_relaxed);
+		for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+			atomic_store_explicit(&histogram->buckets[i], 0, memory_order_relaxed);
+		}
+	}
+}
@@ -0,0 +1,63 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdbool.h>
+#include <time.h>
+
+/* Bucket 0 holds latencies below 1 µs, bucket i (i >= 1) latencies of
+ * [2^(i - 1), 2^i) µs. The last bucket is open-ended (i.e., >= 4.2s). */
+#define LATENCY_HISTOGRAM_BUCKETS		24
+
+enum latency_stage_t {
+	LATENCY_GPIO_WAKEUP,		/* Kernel edge timestamp to GPIO thread handling the event */
+	LATENCY_DEBOUNCER,			/* Kernel edge timestamp to debouncer dispatching it */
+	LATENCY_CALLBACK,			/* Debouncer dispatch to sled callback having returned */
+	LATENCY_SPI_SEND,			/* Duration of spi_send() itself */
+	LATENCY_EDGE_TO_SPI,		/* Kernel edge timestamp to spi_send() having completed */
+	LATENCY_STAGE_COUNT,
+};
+
+struct latency_stats_t {
+	int count;
+	int min_us;
+	int max_us;
+	int buckets[LATENCY_HISTOGRAM_BUCKETS];
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+const char *latency_stage_to_str(enum latency_stage_t stage);
+int latency_bucket_min_us(unsigned int bucket);
+void latency_timestamp(struct timespec *ts);
+void latency_record(enum latency_stage_t stage, const struct timespec *start, const struct timespec *end);
+void latency_record_since(enum latency_stage_t stage, const struct timespec *start);
+void latency_record_edge(enum latency_stage_t stage, const struct timespec *edge_ts);
+void latency_set_edge(const struct timespec *edge_ts);
+void latency_record_since_edge(enum latency_stage_t stage);
+void latency_get_stats(enum latency_stage_t stage, struct latency_stats_t *stats);
+void latency_reset(void);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
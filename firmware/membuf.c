@@ -92,6 +92,22 @@ bool membuf_write_to_file(const struct membuf_t *membuf, const char *filename) {
 	return true;
 }
 
+bool membuf_read_from_file(struct membuf_t *membuf, const char *filename) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		return false;
+	}
+	bool success = true;
+	uint8_t buffer[4096];
+	size_t length;
+	while (success && ((length = fread(buffer, 1, sizeof(buffer), f)) > 0)) {
+		success = membuf_append(membuf, buffer, length);
+	}
+	success = success && !ferror(f);
+	fclose(f);
+	return success;
+}
+
 void membuf_free(struct membuf_t *membuf) {
 	free(membuf->data);
 	membuf_init(membuf);
@@ -43,6 +43,7 @@ bool membuf_read(struct membuf_t *membuf, uint8_t *data, unsigned int length);
 bool membuf_seek(struct membuf_t *membuf, unsigned int offset);
 void membuf_rewind(struct membuf_t *membuf);
 bool membuf_write_to_file(const struct membuf_t *membuf, const char *filename);
+bool membuf_read_from_file(struct membuf_t *membuf, const char *filename);
 void membuf_free(struct membuf_t *membuf);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -28,12 +28,117 @@
 #include <string.h>
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <assert.h>
+#include <sys/mman.h>
 #include "pattern.h"
 #include "logging.h"
 
-struct pattern_t* pattern_new(unsigned int width, unsigned int height) {
-	if ((width > MAX_PATTERN_WIDTH) || (height > MAX_PATTERN_HEIGHT)) {
-		logmsg(LLVL_WARN, "Refusing to create %u x %u size pattern, maximum size is %u x %u.\n", width, height, MAX_PATTERN_WIDTH, MAX_PATTERN_HEIGHT);
+typedef uint8_t row_vector_t __attribute__((vector_size(16)));
+
+static struct pattern_storage_config_t storage_config = {
+	.max_height = DEFAULT_MAX_PATTERN_HEIGHT,
+	.directory = "/var/tmp",
+	.deduplicate_rows = true,
+};
+
+static void pattern_compose_row(const struct pattern_t *pattern, unsigned int y, uint8_t *row);
+
+void pattern_set_storage_config(const struct pattern_storage_config_t *config) {
+	storage_config = *config;
+}
+
+unsigned int pattern_get_max_height(void) {
+	return storage_config.max_height;
+}
+
+/* Creates a shared mapping of an unlinked temporary file. The mapping is
+ * created inaccessible and unlocked before it is made accessible: when all
+ * memory is locked in real-time mode, this prevents the whole file from being
+ * faulted in and pinned. Returns NULL on failure. */
+static void* pattern_map(size_t size) {
+	char filename[256];
+	snprintf(filename, sizeof(filename), "%s/knitpi_pattern_XXXXXX", storage_config.directory);
+	int fd = mkstemp(filename);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Failed to create pattern storage file %s: %s", filename, strerror(errno));
+		return NULL;
+	}
+	unlink(filename);
+	if (ftruncate(fd, size)) {
+		logmsg(LLVL_ERROR, "Failed to resize pattern storage file to %zu bytes: %s", size, strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	void *mapping = mmap(NULL, size, PROT_NONE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "Failed to map %zu bytes of pattern storage: %s", size, strerror(errno));
+		return NULL;
+	}
+	munlock(mapping, size);
+	if (mprotect(mapping, size, PROT_READ | PROT_WRITE)) {
+		logmsg(LLVL_ERROR, "Failed to make pattern storage accessible: %s", strerror(errno));
+		munmap(mapping, size);
+		return NULL;
+	}
+	return mapping;
+}
+
+static void pattern_storage_free(struct pattern_storage_t *storage) {
+	if (storage->mapped) {
+		munmap(storage->data, storage->size);
+	} else {
+		free(storage->data);
+	}
+	*storage = (struct pattern_storage_t) { 0 };
+}
+
+/* Resizes the storage, bytes that are added are zero. Storage is moved into a
+ * mapping if map is set or once it reaches PATTERN_MAPPED_STORAGE_THRESHOLD,
+ * and stays mapped from then on. Mapped storage is grown by copying it into a
+ * new mapping, so it must be grown geometrically. Returns false, with the
+ * storage unchanged, if memory could not be allocated. */
+static bool pattern_storage_resize(struct pattern_storage_t *storage, size_t new_size, bool map) {
+	if (new_size == storage->size) {
+		return true;
+	}
+	if (!new_size) {
+		pattern_storage_free(storage);
+		return true;
+	}
+	if (map || storage->mapped || (new_size >= PATTERN_MAPPED_STORAGE_THRESHOLD)) {
+		void *data = pattern_map(new_size);
+		if (!data) {
+			return false;
+		}
+		if (storage->size) {
+			memcpy(data, storage->data, (storage->size < new_size) ? storage->size : new_size);
+		}
+		pattern_storage_free(storage);
+		storage->data = data;
+		storage->mapped = true;
+	} else {
+		void *data = realloc(storage->data, new_size);
+		if (!data) {
+			return false;
+		}
+		if (new_size > storage->size) {
+			memset((uint8_t*)data + storage->size, 0, new_size - storage->size);
+		}
+		storage->data = data;
+	}
+	storage->size = new_size;
+	return true;
+}
+
+/* Allocates a pattern with row occupancy, but without pixel storage. The
+ * caller announces how many bytes of storage per row it is going to add, so
+ * that all per-row data of long patterns ends up in mapped storage. */
+static struct pattern_t* pattern_alloc(unsigned int width, unsigned int height, size_t storage_per_row) {
+	if ((width > MAX_PATTERN_WIDTH) || (height > storage_config.max_height)) {
+		logmsg(LLVL_WARN, "Refusing to create %u x %u size pattern, maximum size is %u x %u.\n", width, height, MAX_PATTERN_WIDTH, storage_config.max_height);
 		return NULL;
 	}
 
@@ -45,129 +150,932 @@ struct pattern_t* pattern_new(unsigned int width, unsigned int height) {
 
 	pattern->width = width;
 	pattern->height = height;
-	pattern->pixel_data = calloc(1, pattern->width * pattern->height);
 	pattern->min_x = width + 1;
 	pattern->min_y = height + 1;
-	if (!pattern->pixel_data) {
+	pattern->mask_words_per_row = (width + PATTERN_MASK_BITS - 1) / PATTERN_MASK_BITS;
+
+	size_t nonempty_size = ((height + PATTERN_MASK_BITS - 1) / PATTERN_MASK_BITS) * sizeof(uint64_t);
+	size_t row_size = height * sizeof(uint16_t);
+	pattern->mapped = (nonempty_size + (2 * row_size) + (height * storage_per_row)) >= PATTERN_MAPPED_STORAGE_THRESHOLD;
+	if (pattern->mapped) {
+		logmsg(LLVL_DEBUG, "Storing rows of %u x %u pattern in mapped files.", width, height);
+	}
+	if (!pattern_storage_resize(&pattern->nonempty_storage, nonempty_size, pattern->mapped) || !pattern_storage_resize(&pattern->row_min_x_storage, row_size, pattern->mapped) || !pattern_storage_resize(&pattern->row_max_x_storage, row_size, pattern->mapped)) {
+		fprintf(stderr, "Failed to allocate row occupancy for %d x %d pixel pattern: %s\n", pattern->width, pattern->height, strerror(errno));
+		pattern_free(pattern);
+		return NULL;
+	}
+	pattern->nonempty_rows = pattern->nonempty_storage.data;
+	pattern->row_min_x = pattern->row_min_x_storage.data;
+	pattern->row_max_x = pattern->row_max_x_storage.data;
+	return pattern;
+}
+
+static size_t pattern_mask_row_size(unsigned int width) {
+	return ((width + PATTERN_MASK_BITS - 1) / PATTERN_MASK_BITS) * sizeof(uint64_t);
+}
+
+/* Adds pixel data and stitch mask to a pattern created by pattern_alloc(),
+ * frees the pattern on failure. */
+static struct pattern_t* pattern_alloc_pixels(struct pattern_t *pattern) {
+	if (!pattern_storage_resize(&pattern->pixel_storage, (size_t)pattern->width * pattern->height, pattern->mapped)) {
 		fprintf(stderr, "Failed to allocate %d bytes for %d x %d pixel pattern: %s\n", pattern->width * pattern->height, pattern->width, pattern->height, strerror(errno));
 		pattern_free(pattern);
 		return NULL;
 	}
+	if (!pattern_storage_resize(&pattern->mask_storage, pattern_mask_row_size(pattern->width) * pattern->height, pattern->mapped)) {
+		fprintf(stderr, "Failed to allocate stitch mask for %d x %d pixel pattern: %s\n", pattern->width, pattern->height, strerror(errno));
+		pattern_free(pattern);
+		return NULL;
+	}
+	pattern->pixel_data = pattern->pixel_storage.data;
+	pattern->stitch_mask = pattern->mask_storage.data;
+	return pattern;
+}
 
+struct pattern_t* pattern_new(unsigned int width, unsigned int height) {
+	struct pattern_t *pattern = pattern_alloc(width, height, width + pattern_mask_row_size(width));
+	if (!pattern) {
+		return NULL;
+	}
+	return pattern_alloc_pixels(pattern);
+}
+
+/* Creates an empty composition with room for max_layers layers. Its pixel
+ * storage only caches flattened rows. */
+static struct pattern_t* pattern_new_composition(unsigned int width, unsigned int height, unsigned int max_layers) {
+	struct pattern_t *pattern = pattern_alloc(width, height, width + pattern_mask_row_size(width) + sizeof(atomic_bool));
+	if (!pattern || !pattern_alloc_pixels(pattern)) {
+		return NULL;
+	}
+	pattern->layers = calloc(max_layers, sizeof(struct pattern_composition_layer_t));
+	if (!pattern->layers || !pattern_storage_resize(&pattern->flattened_storage, height * sizeof(atomic_bool), pattern->mapped)) {
+		logmsg(LLVL_ERROR, "Failed to allocate %u layer composition of %u x %u pattern.", max_layers, width, height);
+		pattern_free(pattern);
+		return NULL;
+	}
+	pattern->row_flattened = pattern->flattened_storage.data;
+	for (unsigned int y = 0; y < height; y++) {
+		atomic_init(&pattern->row_flattened[y], false);
+	}
 	return pattern;
 }
 
+/* Rows of regular patterns are always flat. Rows of compositions are only
+ * once pattern_prepare_row() has published them. */
+static bool pattern_row_is_flat(const struct pattern_t *pattern, unsigned int y) {
+	return !pattern->layers || atomic_load_explicit(&pattern->row_flattened[y], memory_order_acquire);
+}
+
+static uint32_t pattern_hash_row(const uint8_t *row, unsigned int width) {
+	uint32_t hash = 0x811c9dc5;
+	for (unsigned int x = 0; x < width; x++) {
+		hash = (hash ^ row[x]) * 0x01000193;
+	}
+	return hash;
+}
+
+static void pattern_dict_decode_row(const struct pattern_row_dict_t *dict, uint32_t row_id, uint8_t *buffer) {
+	const struct pattern_unique_row_t *unique = &dict->unique_rows[row_id];
+	const struct pattern_run_t *run = dict->runs + unique->first_run;
+	for (unsigned int i = 0; i < unique->run_count; i++, run++) {
+		memset(buffer, run->color, run->length);
+		buffer += run->length;
+	}
+}
+
+static bool pattern_dict_row_equals(const struct pattern_row_dict_t *dict, uint32_t row_id, const uint8_t *row) {
+	const struct pattern_unique_row_t *unique = &dict->unique_rows[row_id];
+	const struct pattern_run_t *run = dict->runs + unique->first_run;
+	for (unsigned int i = 0; i < unique->run_count; i++, run++) {
+		for (unsigned int x = 0; x < run->length; x++) {
+			if (row[x] != run->color) {
+				return false;
+			}
+		}
+		row += run->length;
+	}
+	return true;
+}
+
+static bool pattern_dict_grow_runs(struct pattern_t *pattern) {
+	struct pattern_row_dict_t *dict = pattern->dict;
+	if (dict->run_count < dict->run_capacity) {
+		return true;
+	}
+	unsigned int new_capacity = dict->run_capacity ? (dict->run_capacity * 2) : 256;
+	if (!pattern_storage_resize(&dict->run_storage, new_capacity * sizeof(struct pattern_run_t), pattern->mapped)) {
+		return false;
+	}
+	dict->runs = dict->run_storage.data;
+	dict->run_capacity = new_capacity;
+	return true;
+}
+
+static bool pattern_dict_grow_unique_rows(struct pattern_t *pattern) {
+	struct pattern_row_dict_t *dict = pattern->dict;
+	if (dict->unique_count < dict->unique_capacity) {
+		return true;
+	}
+	unsigned int new_capacity = dict->unique_capacity ? (dict->unique_capacity * 2) : 16;
+	if (!pattern_storage_resize(&dict->unique_row_storage, new_capacity * sizeof(struct pattern_unique_row_t), pattern->mapped)) {
+		return false;
+	}
+	dict->unique_rows = dict->unique_row_storage.data;
+	if (!pattern_storage_resize(&dict->unique_mask_storage, (size_t)new_capacity * (pattern->mask_words_per_row ? pattern->mask_words_per_row : 1) * sizeof(uint64_t), pattern->mapped)) {
+		return false;
+	}
+	dict->unique_masks = dict->unique_mask_storage.data;
+	dict->unique_capacity = new_capacity;
+	return true;
+}
+
+static bool pattern_dict_rehash(struct pattern_t *pattern, unsigned int slot_count) {
+	struct pattern_row_dict_t *dict = pattern->dict;
+	struct pattern_storage_t hash_slot_storage = { 0 };
+	if (!pattern_storage_resize(&hash_slot_storage, slot_count * sizeof(uint32_t), pattern->mapped)) {
+		return false;
+	}
+	uint32_t *hash_slots = hash_slot_storage.data;
+	for (unsigned int row_id = 0; row_id < dict->unique_count; row_id++) {
+		unsigned int slot = dict->unique_rows[row_id].hash & (slot_count - 1);
+		while (hash_slots[slot]) {
+			slot = (slot + 1) & (slot_count - 1);
+		}
+		hash_slots[slot] = row_id + 1;
+	}
+	pattern_storage_free(&dict->hash_slot_storage);
+	dict->hash_slot_storage = hash_slot_storage;
+	dict->hash_slots = hash_slots;
+	dict->hash_slot_count = slot_count;
+	return true;
+}
+
+/* Returns the unique row ID of the given row of pattern->width stitches,
+ * adding it to the dictionary if it is not present yet. Returns -1 if the
+ * dictionary could not be grown. */
+static int pattern_intern_row(struct pattern_t *pattern, const uint8_t *row) {
+	struct pattern_row_dict_t *dict = pattern->dict;
+	uint32_t hash = pattern_hash_row(row, pattern->width);
+	unsigned int slot = hash & (dict->hash_slot_count - 1);
+	while (dict->hash_slots[slot]) {
+		uint32_t row_id = dict->hash_slots[slot] - 1;
+		if ((dict->unique_rows[row_id].hash == hash) && pattern_dict_row_equals(dict, row_id, row)) {
+			return row_id;
+		}
+		slot = (slot + 1) & (dict->hash_slot_count - 1);
+	}
+
+	if (!pattern_dict_grow_unique_rows(pattern)) {
+		return -1;
+	}
+
+	uint32_t row_id = dict->unique_count;
+	struct pattern_unique_row_t *unique = &dict->unique_rows[row_id];
+	*unique = (struct pattern_unique_row_t) {
+		.hash = hash,
+		.first_run = dict->run_count,
+		.empty = true,
+	};
+	for (unsigned int x = 0; x < pattern->width; ) {
+		unsigned int length = 1;
+		while ((x + length < pattern->width) && (row[x + length] == row[x]) && (length < UINT16_MAX)) {
+			length++;
+		}
+		if (!pattern_dict_grow_runs(pattern)) {
+			dict->run_count = unique->first_run;
+			return -1;
+		}
+		dict->runs[dict->run_count++] = (struct pattern_run_t) {
+			.length = length,
+			.color = row[x],
+		};
+		x += length;
+	}
+	unique->run_count = dict->run_count - unique->first_run;
+
+	uint64_t *mask_row = dict->unique_masks + ((size_t)pattern->mask_words_per_row * row_id);
+	memset(mask_row, 0, pattern->mask_words_per_row * sizeof(uint64_t));
+	for (unsigned int x = 0; x < pattern->width; x++) {
+		if (row[x]) {
+			mask_row[x / PATTERN_MASK_BITS] |= 1ULL << (x % PATTERN_MASK_BITS);
+			if (unique->empty) {
+				unique->min_x = x;
+				unique->empty = false;
+			}
+			unique->max_x = x;
+		}
+	}
+
+	dict->unique_count++;
+	dict->hash_slots[slot] = row_id + 1;
+	if ((dict->unique_count * 2 > dict->hash_slot_count) && !pattern_dict_rehash(pattern, dict->hash_slot_count * 2)) {
+		logmsg(LLVL_WARN, "Failed to grow row dictionary hash table beyond %u slots.", dict->hash_slot_count);
+	}
+	return row_id;
+}
+
+static void pattern_set_row_id(struct pattern_t *pattern, unsigned int y, uint32_t row_id) {
+	const struct pattern_unique_row_t *unique = &pattern->dict->unique_rows[row_id];
+	uint64_t bit = 1ULL << (y % PATTERN_MASK_BITS);
+	pattern->dict->row_ids[y] = row_id;
+	if (unique->empty) {
+		pattern->nonempty_rows[y / PATTERN_MASK_BITS] &= ~bit;
+	} else {
+		pattern->nonempty_rows[y / PATTERN_MASK_BITS] |= bit;
+		pattern->row_min_x[y] = unique->min_x;
+		pattern->row_max_x[y] = unique->max_x;
+	}
+}
+
+/* Replaces row y of a deduplicated pattern with the given row of
+ * pattern->width stitches. */
+static void pattern_store_row(struct pattern_t *pattern, unsigned int y, const uint8_t *row) {
+	int row_id = pattern_intern_row(pattern, row);
+	if (row_id == -1) {
+		logmsg(LLVL_ERROR, "Failed to grow row dictionary of %u x %u pattern, row %u is unchanged.", pattern->width, pattern->height, y);
+		return;
+	}
+	pattern_set_row_id(pattern, y, row_id);
+}
+
+static struct pattern_t* pattern_new_dict(unsigned int width, unsigned int height) {
+	struct pattern_t *pattern = pattern_alloc(width, height, sizeof(uint32_t));
+	if (!pattern) {
+		return NULL;
+	}
+	pattern->dict = calloc(1, sizeof(struct pattern_row_dict_t));
+	if (!pattern->dict) {
+		perror("calloc row dictionary");
+		pattern_free(pattern);
+		return NULL;
+	}
+	bool success = pattern_storage_resize(&pattern->dict->row_id_storage, height * sizeof(uint32_t), pattern->mapped);
+	pattern->dict->row_ids = pattern->dict->row_id_storage.data;
+	if (!success || !pattern_dict_rehash(pattern, 64)) {
+		fprintf(stderr, "Failed to allocate row dictionary for %d x %d pixel pattern: %s\n", pattern->width, pattern->height, strerror(errno));
+		pattern_free(pattern);
+		return NULL;
+	}
+
+	const uint8_t empty_row[MAX_PATTERN_WIDTH] = { 0 };
+	if (pattern_intern_row(pattern, empty_row) != PATTERN_EMPTY_ROW_ID) {
+		fprintf(stderr, "Failed to allocate row dictionary for %d x %d pixel pattern.\n", pattern->width, pattern->height);
+		pattern_free(pattern);
+		return NULL;
+	}
+	return pattern;
+}
+
+/* Creates a pattern in which identical rows share their storage, each unique
+ * row is stored run-length encoded. Its rows can only be modified through
+ * pattern_set_rgba(), pattern_set_rgba_row() and pattern_set_row(). If
+ * deduplication is disabled in the storage configuration, a regular pattern
+ * is returned instead. */
+struct pattern_t* pattern_new_deduplicated(unsigned int width, unsigned int height) {
+	if (!storage_config.deduplicate_rows) {
+		return pattern_new(width, height);
+	}
+	return pattern_new_dict(width, height);
+}
+
+/* Returns the unique row ID of row y of a deduplicated pattern; rows with the
+ * same ID are identical. Returns -1 for all other kinds of patterns. */
+int pattern_get_row_id(const struct pattern_t *pattern, unsigned int y) {
+	if (!pattern->dict || (y >= pattern->height)) {
+		return -1;
+	}
+	return pattern->dict->row_ids[y];
+}
+
+/* Number of unique rows (including the empty row) stored in deduplicated
+ * form for the pattern, its tile or its layers. */
+unsigned int pattern_unique_rows(const struct pattern_t *pattern) {
+	if (pattern->tile) {
+		return pattern_unique_rows(pattern->tile->pattern);
+	}
+	unsigned int unique_rows = pattern->dict ? pattern->dict->unique_count : 0;
+	for (unsigned int i = 0; i < pattern->layer_count; i++) {
+		unique_rows += pattern_unique_rows(pattern->layers[i].layer->pattern);
+	}
+	return unique_rows;
+}
+
+/* The topmost layer that has a stitch at (x, y) determines its color. */
+static uint8_t pattern_get_composed_color(const struct pattern_t *pattern, unsigned int x, unsigned int y) {
+	for (int i = pattern->layer_count - 1; i >= 0; i--) {
+		const struct pattern_composition_layer_t *entry = &pattern->layers[i];
+		if ((x >= entry->offsetx) && (y >= entry->offsety)) {
+			uint8_t color_index = pattern_get_color(entry->layer->pattern, x - entry->offsetx, y - entry->offsety);
+			if (color_index) {
+				return entry->color_map[color_index];
+			}
+		}
+	}
+	return 0;
+}
+
 uint8_t pattern_get_color(const struct pattern_t *pattern, unsigned int x, unsigned int y) {
 	if ((x >= pattern->width) || (y >= pattern->height)) {
 		return 0;
 	}
+	if (pattern->tile) {
+		const struct pattern_t *tile = pattern->tile->pattern;
+		return pattern_get_color(tile, (x + pattern->repeat.offset_x) % tile->width, (y + pattern->repeat.offset_y) % tile->height);
+	}
+	if (pattern->dict) {
+		const struct pattern_unique_row_t *unique = &pattern->dict->unique_rows[pattern->dict->row_ids[y]];
+		const struct pattern_run_t *run = pattern->dict->runs + unique->first_run;
+		while (x >= run->length) {
+			x -= run->length;
+			run++;
+		}
+		return run->color;
+	}
+	if (!pattern_row_is_flat(pattern, y)) {
+		return pattern_get_composed_color(pattern, x, y);
+	}
 	return pattern->pixel_data[(pattern->width * y) + x];
 }
 
+static const uint64_t* pattern_mask_row(const struct pattern_t *pattern, unsigned int y) {
+	if (pattern->dict) {
+		return pattern->dict->unique_masks + ((size_t)pattern->mask_words_per_row * pattern->dict->row_ids[y]);
+	}
+	return pattern->stitch_mask + ((size_t)pattern->mask_words_per_row * y);
+}
+
+static uint64_t pattern_get_mask_word(const uint64_t *mask_row, unsigned int mask_words, int word_index) {
+	if ((word_index < 0) || (word_index >= mask_words)) {
+		return 0;
+	}
+	return mask_row[word_index];
+}
+
+/* Returns a bitmask of PATTERN_MASK_BITS consecutive stitches of row y,
+ * starting at column x (which may be negative or exceed the pattern width).
+ * Bit n is set if stitch (x + n, y) has a color other than zero. */
+static uint64_t pattern_get_tiled_mask(const struct pattern_t *pattern, int x, unsigned int y) {
+	const struct pattern_t *tile = pattern->tile->pattern;
+	unsigned int tile_y = (y + pattern->repeat.offset_y) % tile->height;
+	uint64_t mask = 0;
+	unsigned int bit = (x < 0) ? -x : 0;
+	while (bit < PATTERN_MASK_BITS) {
+		unsigned int logical_x = x + bit;
+		if (logical_x >= pattern->width) {
+			break;
+		}
+		unsigned int tile_x = (logical_x + pattern->repeat.offset_x) % tile->width;
+		unsigned int length = tile->width - tile_x;
+		length = (length < pattern->width - logical_x) ? length : (pattern->width - logical_x);
+		length = (length < PATTERN_MASK_BITS - bit) ? length : (PATTERN_MASK_BITS - bit);
+		uint64_t segment = pattern_get_mask(tile, tile_x, tile_y);
+		if (length < PATTERN_MASK_BITS) {
+			segment &= (1ULL << length) - 1;
+		}
+		mask |= segment << bit;
+		bit += length;
+	}
+	return mask;
+}
+
+/* A stitch of a composition is set if it is set in any of its layers, so the
+ * mask of a row that is not flattened yet needs no blending. */
+static uint64_t pattern_get_composed_mask(const struct pattern_t *pattern, int x, unsigned int y) {
+	uint64_t mask = 0;
+	for (unsigned int i = 0; i < pattern->layer_count; i++) {
+		const struct pattern_composition_layer_t *entry = &pattern->layers[i];
+		if (y >= entry->offsety) {
+			mask |= pattern_get_mask(entry->layer->pattern, x - (int)entry->offsetx, y - entry->offsety);
+		}
+	}
+	return mask;
+}
+
+uint64_t pattern_get_mask(const struct pattern_t *pattern, int x, unsigned int y) {
+	if (y >= pattern->height) {
+		return 0;
+	}
+	if (pattern->tile) {
+		return (x > -PATTERN_MASK_BITS) ? pattern_get_tiled_mask(pattern, x, y) : 0;
+	}
+	if (!pattern_row_is_flat(pattern, y)) {
+		return pattern_get_composed_mask(pattern, x, y);
+	}
+	const uint64_t *mask_row = pattern_mask_row(pattern, y);
+	int word_index = (x >= 0) ? (x / PATTERN_MASK_BITS) : -((PATTERN_MASK_BITS - 1 - x) / PATTERN_MASK_BITS);
+	unsigned int shift = x - (word_index * PATTERN_MASK_BITS);
+	uint64_t mask = pattern_get_mask_word(mask_row, pattern->mask_words_per_row, word_index) >> shift;
+	if (shift) {
+		mask |= pattern_get_mask_word(mask_row, pattern->mask_words_per_row, word_index + 1) << (PATTERN_MASK_BITS - shift);
+	}
+	return mask;
+}
+
+bool pattern_row_is_empty(const struct pattern_t *pattern, unsigned int y) {
+	if (y >= pattern->height) {
+		return true;
+	}
+	return !(pattern->nonempty_rows[y / PATTERN_MASK_BITS] & (1ULL << (y % PATTERN_MASK_BITS)));
+}
+
+/* Recomputes the occupancy summary of row y from its stitch mask. */
+static void pattern_update_row_occupancy(struct pattern_t *pattern, unsigned int y) {
+	const uint64_t *mask_row = pattern->stitch_mask + (pattern->mask_words_per_row * y);
+	uint64_t bit = 1ULL << (y % PATTERN_MASK_BITS);
+	pattern->nonempty_rows[y / PATTERN_MASK_BITS] &= ~bit;
+	for (int i = 0; i < pattern->mask_words_per_row; i++) {
+		if (mask_row[i]) {
+			pattern->row_min_x[y] = (i * PATTERN_MASK_BITS) + __builtin_ctzll(mask_row[i]);
+			pattern->nonempty_rows[y / PATTERN_MASK_BITS] |= bit;
+			break;
+		}
+	}
+	for (int i = pattern->mask_words_per_row - 1; i >= 0; i--) {
+		if (mask_row[i]) {
+			pattern->row_max_x[y] = (i * PATTERN_MASK_BITS) + (PATTERN_MASK_BITS - 1 - __builtin_clzll(mask_row[i]));
+			break;
+		}
+	}
+}
+
 static void pattern_set_color(struct pattern_t *pattern, unsigned int x, unsigned int y, uint8_t color_index) {
+	if (pattern->dict) {
+		uint8_t row[pattern->width];
+		pattern_dict_decode_row(pattern->dict, pattern->dict->row_ids[y], row);
+		if (row[x] != color_index) {
+			row[x] = color_index;
+			pattern_store_row(pattern, y, row);
+		}
+		return;
+	}
 	pattern->pixel_data[(pattern->width * y) + x] = color_index;
+	uint64_t *mask_word = &pattern->stitch_mask[(pattern->mask_words_per_row * y) + (x / PATTERN_MASK_BITS)];
+	uint64_t bit = 1ULL << (x % PATTERN_MASK_BITS);
+	if (color_index) {
+		*mask_word |= bit;
+		if (pattern_row_is_empty(pattern, y)) {
+			pattern->nonempty_rows[y / PATTERN_MASK_BITS] |= 1ULL << (y % PATTERN_MASK_BITS);
+			pattern->row_min_x[y] = x;
+			pattern->row_max_x[y] = x;
+		} else {
+			pattern->row_min_x[y] = (x < pattern->row_min_x[y]) ? x : pattern->row_min_x[y];
+			pattern->row_max_x[y] = (x > pattern->row_max_x[y]) ? x : pattern->row_max_x[y];
+		}
+	} else {
+		*mask_word &= ~bit;
+		if (!pattern_row_is_empty(pattern, y) && ((x == pattern->row_min_x[y]) || (x == pattern->row_max_x[y]))) {
+			pattern_update_row_occupancy(pattern, y);
+		}
+	}
 }
 
-void pattern_set_rgba(struct pattern_t *pattern, unsigned int x, unsigned int y, uint32_t rgba) {
-	uint8_t color_index;
+static unsigned int palette_hash_slot(uint32_t rgb) {
+	return (rgb * 0x9e3779b1) >> (32 - PATTERN_PALETTE_HASH_BITS);
+}
+
+/* Returns the palette index of the given color, which is added to the palette
+ * if necessary. Completely white or transparent pixels map to zero. */
+uint8_t pattern_rgba_to_color_index(struct pattern_t *pattern, uint32_t rgba) {
 	if ((PIXEL_COLOR_IS_WHITE(rgba)) || (PIXEL_GET_ALPHA(rgba) == 0)) {
 		/* Completely white or completely transparent */
-		color_index = 0;
+		return 0;
+	}
+
+	uint32_t rgb = PIXEL_GET_RGB(rgba);
+	unsigned int slot = palette_hash_slot(rgb);
+	while (pattern->palette_hash[slot]) {
+		uint8_t color_index = pattern->palette_hash[slot];
+		if (pattern->rgb_palette[color_index - 1] == rgb) {
+			return color_index;
+		}
+		slot = (slot + 1) % PATTERN_PALETTE_HASH_SIZE;
+	}
+
+	/* Color not found in palette, add if possible */
+	if (pattern->used_colors >= 255) {
+		logmsg(LLVL_WARN, "Cannot add more than 255 colors to pattern.");
+		return 0;
+	}
+	pattern->used_colors++;
+	pattern->rgb_palette[pattern->used_colors - 1] = rgb;
+	pattern->palette_hash[slot] = pattern->used_colors;
+	return pattern->used_colors;
+}
+
+void pattern_set_rgba(struct pattern_t *pattern, unsigned int x, unsigned int y, uint32_t rgba) {
+	pattern_set_color(pattern, x, y, pattern_rgba_to_color_index(pattern, rgba));
+}
+
+/* Converts count RGBA pixels into row y, starting at column x. Runs of the
+ * same color (the common case in knitting patterns) only incur a single
+ * palette lookup. */
+void pattern_set_rgba_row(struct pattern_t *pattern, unsigned int x, unsigned int y, const uint32_t *rgba, unsigned int count) {
+	if ((y >= pattern->height) || (x >= pattern->width)) {
+		return;
+	}
+	if (count > pattern->width - x) {
+		count = pattern->width - x;
+	}
+
+	uint8_t dict_row[pattern->dict ? pattern->width : 1];
+	uint8_t *row;
+	if (pattern->dict) {
+		row = dict_row;
+		pattern_dict_decode_row(pattern->dict, pattern->dict->row_ids[y], row);
 	} else {
-		bool found = false;
-		uint32_t rgb = PIXEL_GET_RGB(rgba);
-		for (int i = 0; i < pattern->used_colors; i++) {
-			if (pattern->rgb_palette[i] == rgb) {
-				color_index = i + 1;
-				found = true;
-				break;
+		row = pattern_row_rw(pattern, y);
+	}
+	uint32_t last_rgba = 0;
+	uint8_t last_color_index = 0;
+	bool last_valid = false;
+	for (unsigned int i = 0; i < count; i++) {
+		if (!last_valid || (rgba[i] != last_rgba)) {
+			last_rgba = rgba[i];
+			last_color_index = pattern_rgba_to_color_index(pattern, last_rgba);
+			last_valid = true;
+		}
+		row[x + i] = last_color_index;
+	}
+	if (pattern->dict) {
+		pattern_store_row(pattern, y, row);
+	} else {
+		pattern_sync_row(pattern, y);
+	}
+}
+
+/* Replaces row y of a regular or deduplicated pattern with the given row of
+ * pattern->width palette indices. */
+void pattern_set_row(struct pattern_t *pattern, unsigned int y, const uint8_t *row) {
+	if (y >= pattern->height) {
+		return;
+	}
+	if (pattern->dict) {
+		pattern_store_row(pattern, y, row);
+	} else {
+		memcpy(pattern_row_rw(pattern, y), row, pattern->width);
+		pattern_sync_row(pattern, y);
+	}
+}
+
+/* Replaces the palette of a pattern whose rows have not been set through
+ * RGBA values yet. Colors must be distinct and not white. */
+void pattern_set_palette(struct pattern_t *pattern, const uint32_t *rgb_palette, unsigned int used_colors) {
+	pattern->used_colors = 0;
+	memset(pattern->palette_hash, 0, sizeof(pattern->palette_hash));
+	for (unsigned int i = 0; (i < used_colors) && (i < 255); i++) {
+		uint32_t rgb = PIXEL_GET_RGB(rgb_palette[i]);
+		unsigned int slot = palette_hash_slot(rgb);
+		while (pattern->palette_hash[slot]) {
+			slot = (slot + 1) % PATTERN_PALETTE_HASH_SIZE;
+		}
+		pattern->rgb_palette[i] = rgb;
+		pattern->palette_hash[slot] = i + 1;
+		pattern->used_colors = i + 1;
+	}
+}
+
+/* Renumbers the colors of a regular or deduplicated pattern in order of their
+ * first appearance, row by row. This is the order in which they are assigned
+ * when rows are set from top to bottom, which is not the case when decoding
+ * interlaced images. Returns false if the pattern could not be updated. */
+bool pattern_renumber_colors(struct pattern_t *pattern) {
+	uint8_t color_map[256] = { 0 };
+	unsigned int next_color = 1;
+	uint8_t buffer[pattern->width];
+	for (unsigned int y = 0; (y < pattern->height) && (next_color <= pattern->used_colors); y++) {
+		if (pattern_row_is_empty(pattern, y)) {
+			continue;
+		}
+		const uint8_t *row = pattern_get_row(pattern, y, buffer);
+		for (unsigned int x = 0; x < pattern->width; x++) {
+			if (row[x] && !color_map[row[x]]) {
+				color_map[row[x]] = next_color++;
 			}
 		}
-		if (!found) {
-			/* Color not found in palette, add if possible */
-			if (pattern->used_colors < 255) {
-				pattern->used_colors++;
-				color_index = pattern->used_colors;
-				pattern->rgb_palette[pattern->used_colors - 1] = rgb;
-			} else {
-				logmsg(LLVL_WARN, "Cannot add more than 255 colors to pattern.");
-				color_index = 0;
+	}
+
+	bool identity = true;
+	for (unsigned int color_index = 1; color_index <= pattern->used_colors; color_index++) {
+		if (!color_map[color_index]) {
+			color_map[color_index] = next_color++;
+		}
+		identity = identity && (color_map[color_index] == color_index);
+	}
+	if (identity) {
+		return true;
+	}
+
+	if (pattern->dict) {
+		struct pattern_row_dict_t *dict = pattern->dict;
+		for (unsigned int i = 0; i < dict->run_count; i++) {
+			dict->runs[i].color = color_map[dict->runs[i].color];
+		}
+		for (unsigned int row_id = 0; row_id < dict->unique_count; row_id++) {
+			pattern_dict_decode_row(dict, row_id, buffer);
+			dict->unique_rows[row_id].hash = pattern_hash_row(buffer, pattern->width);
+		}
+		if (!pattern_dict_rehash(pattern, dict->hash_slot_count)) {
+			return false;
+		}
+	} else {
+		/* Stitch masks and occupancy are unaffected */
+		for (unsigned int y = 0; y < pattern->height; y++) {
+			if (!pattern_row_is_empty(pattern, y)) {
+				uint8_t *row = pattern_row_rw(pattern, y);
+				for (unsigned int x = 0; x < pattern->width; x++) {
+					row[x] = color_map[row[x]];
+				}
 			}
 		}
 	}
-	pattern_set_color(pattern, x, y, color_index);
-}
 
+	uint32_t rgb_palette[255];
+	for (unsigned int color_index = 1; color_index <= pattern->used_colors; color_index++) {
+		rgb_palette[color_map[color_index] - 1] = pattern->rgb_palette[color_index - 1];
+	}
+	pattern_set_palette(pattern, rgb_palette, pattern->used_colors);
+	return true;
+}
 
 uint8_t* pattern_row_rw(const struct pattern_t *pattern, unsigned int y) {
 	return pattern->pixel_data + (pattern->width * y);
 }
 
+/* Not available for tiled or deduplicated patterns or for compositions, use
+ * pattern_get_row() where those may occur. */
 const uint8_t* pattern_row(const struct pattern_t *pattern, unsigned int y) {
 	return pattern_row_rw(pattern, y);
 }
 
+/* Returns row y of any kind of pattern. Tiled and deduplicated patterns and
+ * rows of compositions that are not flattened yet have no row storage, their
+ * rows are assembled in the given buffer of pattern->width bytes. */
+const uint8_t* pattern_get_row(const struct pattern_t *pattern, unsigned int y, uint8_t *buffer) {
+	if (pattern->dict) {
+		pattern_dict_decode_row(pattern->dict, pattern->dict->row_ids[y], buffer);
+		return buffer;
+	}
+	if (!pattern_row_is_flat(pattern, y)) {
+		pattern_compose_row(pattern, y, buffer);
+		return buffer;
+	}
+	if (!pattern->tile) {
+		return pattern_row(pattern, y);
+	}
+	const struct pattern_t *tile = pattern->tile->pattern;
+	const uint8_t *tile_row = pattern_row(tile, (y + pattern->repeat.offset_y) % tile->height);
+	unsigned int tile_x = pattern->repeat.offset_x % tile->width;
+	for (unsigned int x = 0; x < pattern->width; ) {
+		unsigned int length = tile->width - tile_x;
+		length = (length < pattern->width - x) ? length : (pattern->width - x);
+		memcpy(buffer + x, tile_row + tile_x, length);
+		x += length;
+		tile_x = 0;
+	}
+	return buffer;
+}
+
+static void pattern_sync_row_mask(const struct pattern_t *pattern, unsigned int y) {
+	const uint8_t *row = pattern_row_rw(pattern, y);
+	uint64_t *mask_row = pattern->stitch_mask + (pattern->mask_words_per_row * y);
+	memset(mask_row, 0, pattern->mask_words_per_row * sizeof(uint64_t));
+	for (unsigned int x = 0; x < pattern->width; x++) {
+		if (row[x]) {
+			mask_row[x / PATTERN_MASK_BITS] |= 1ULL << (x % PATTERN_MASK_BITS);
+		}
+	}
+}
+
+/* Needs to be called after a row has been modified through pattern_row_rw()
+ * to bring the stitch mask back in sync with the pixel data. */
+void pattern_sync_row(struct pattern_t *pattern, unsigned int y) {
+	pattern_sync_row_mask(pattern, y);
+	pattern_update_row_occupancy(pattern, y);
+}
+
+/* Flattens row y of a composition into its pixel data and stitch mask, so
+ * that later accesses to the row no longer blend the layers. Readers never
+ * lock: they only see the flattened row once it is complete, and a row is
+ * never modified after that. Therefore, only a single thread (the actuation
+ * table compiler, ahead of the carriage) may flatten rows of a published
+ * composition. No-op for all other patterns. */
+void pattern_prepare_row(const struct pattern_t *pattern, unsigned int y) {
+	if ((y >= pattern->height) || pattern_row_is_flat(pattern, y)) {
+		return;
+	}
+	if (!pattern_row_is_empty(pattern, y)) {
+		pattern_compose_row(pattern, y, pattern_row_rw(pattern, y));
+		pattern_sync_row_mask(pattern, y);
+	}
+	atomic_store_explicit(&((struct pattern_t*)pattern)->row_flattened[y], true, memory_order_release);
+}
+
 void pattern_dump_row(const struct pattern_t *pattern, unsigned int y) {
-	const uint8_t *row = pattern_row(pattern, y);
+	uint8_t buffer[pattern->width];
+	const uint8_t *row = pattern_get_row(pattern, y, buffer);
 	for (int x = 0; x < pattern->width; x++) {
 		printf("%s", row[x] ? " " : "•");
 	}
 	printf("\n");
 }
 
-void pattern_update_min_max(struct pattern_t *pattern) {
-	/* Need to increment minimum values by 1 to get correct result even with
-	 * 0x0 sized pattern */
-	pattern->min_x = pattern->width + 1;
-	pattern->min_y = pattern->height + 1;
-	pattern->max_x = 0;
-	pattern->max_y = 0;
-	for (int y = 0; y < pattern->height; y++) {
-		for (int x = 0; x < pattern->width; x++) {
-			uint8_t color = pattern_get_color(pattern, x, y);
-			if (color) {
-				pattern->min_x = (x < pattern->min_x) ? x : pattern->min_x;
-				pattern->min_y = (y < pattern->min_y) ? y : pattern->min_y;
-				pattern->max_x = (x > pattern->max_x) ? x : pattern->max_x;
-				pattern->max_y = (y > pattern->max_y) ? y : pattern->max_y;
-			}
+static void pattern_advise_range(const struct pattern_storage_t *storage, size_t begin, size_t end, bool resident) {
+	if (!storage->mapped || (end <= begin)) {
+		return;
+	}
+	long page_size = sysconf(_SC_PAGESIZE);
+	uintptr_t first = ((uintptr_t)storage->data + begin) & ~(uintptr_t)(page_size - 1);
+	uintptr_t last = (uintptr_t)storage->data + end;
+	if (storage_config.lock_resident_rows) {
+		if (resident) {
+			mlock((void*)first, last - first);
+		} else {
+			munlock((void*)first, last - first);
 		}
+	} else if (resident) {
+		posix_madvise((void*)first, last - first, POSIX_MADV_WILLNEED);
 	}
 }
 
-struct pattern_t* pattern_merge(const struct pattern_t *old_pattern, const struct pattern_t *new_pattern) {
-	struct pattern_t *merge = pattern_new((old_pattern->width > new_pattern->width) ? old_pattern->width : new_pattern->width, (old_pattern->height > new_pattern->height) ? old_pattern->height : new_pattern->height);
-	if (!merge) {
-		return NULL;
+/* Covers everything that is needed to actuate the given rows: their
+ * occupancy, stitch masks and pixel data or, for deduplicated patterns, their
+ * row IDs and the unique rows they refer to. */
+static void pattern_advise_rows(const struct pattern_t *pattern, unsigned int first_row, unsigned int row_count, bool resident) {
+	if (!row_count) {
+		return;
 	}
-	for (unsigned int y = 0; y < merge->height; y++) {
-		for (unsigned int x = 0; x < merge->width; x++) {
-			uint8_t pixel = pattern_get_color(new_pattern, x, y);
-			if (!pixel) {
-				pixel = pattern_get_color(old_pattern, x, y);
-			}
-			pattern_set_color(merge, x, y, pixel);
+	unsigned int end_row = first_row + row_count;
+	pattern_advise_range(&pattern->nonempty_storage, (first_row / PATTERN_MASK_BITS) * sizeof(uint64_t), ((end_row + PATTERN_MASK_BITS - 1) / PATTERN_MASK_BITS) * sizeof(uint64_t), resident);
+	pattern_advise_range(&pattern->row_min_x_storage, first_row * sizeof(uint16_t), end_row * sizeof(uint16_t), resident);
+	pattern_advise_range(&pattern->row_max_x_storage, first_row * sizeof(uint16_t), end_row * sizeof(uint16_t), resident);
+
+	size_t mask_row_size = pattern->mask_words_per_row * sizeof(uint64_t);
+	if (pattern->dict) {
+		const struct pattern_row_dict_t *dict = pattern->dict;
+		pattern_advise_range(&dict->row_id_storage, first_row * sizeof(uint32_t), end_row * sizeof(uint32_t), resident);
+		for (unsigned int y = first_row; y < end_row; y++) {
+			uint32_t row_id = dict->row_ids[y];
+			const struct pattern_unique_row_t *unique = &dict->unique_rows[row_id];
+			pattern_advise_range(&dict->unique_row_storage, row_id * sizeof(struct pattern_unique_row_t), (row_id + 1) * sizeof(struct pattern_unique_row_t), resident);
+			pattern_advise_range(&dict->unique_mask_storage, row_id * mask_row_size, (row_id + 1) * mask_row_size, resident);
+			pattern_advise_range(&dict->run_storage, unique->first_run * sizeof(struct pattern_run_t), (unique->first_run + unique->run_count) * sizeof(struct pattern_run_t), resident);
 		}
+	} else {
+		pattern_advise_range(&pattern->pixel_storage, (size_t)pattern->width * first_row, (size_t)pattern->width * end_row, resident);
+		pattern_advise_range(&pattern->mask_storage, mask_row_size * first_row, mask_row_size * end_row, resident);
+		pattern_advise_range(&pattern->flattened_storage, first_row * sizeof(atomic_bool), end_row * sizeof(atomic_bool), resident);
 	}
+}
 
-	return merge;
+static bool pattern_is_mapped(const struct pattern_t *pattern) {
+	if (pattern->mapped) {
+		return true;
+	}
+	const struct pattern_row_dict_t *dict = pattern->dict;
+	return dict && (dict->unique_row_storage.mapped || dict->unique_mask_storage.mapped || dict->run_storage.mapped);
 }
 
-struct pattern_t* pattern_trim(struct pattern_t *pattern) {
-	pattern_update_min_max(pattern);
-	if ((pattern->min_x > pattern->max_x) || (pattern->min_y > pattern->max_y)) {
+/* Hint that row y is about to be knitted: for patterns with mapped storage
+ * (and the tiles of tiled patterns and layers of compositions), a window of PATTERN_RESIDENT_ROWS around
+ * it is read ahead or, in real-time mode, locked in memory. The window only
+ * moves once y gets close to one of its edges. May need system calls and page
+ * faults, so it must not be called from the actuation path, and must not be
+ * called concurrently for the same pattern. */
+void pattern_set_resident_rows(const struct pattern_t *pattern, unsigned int y) {
+	if (pattern->tile) {
+		const struct pattern_t *tile = pattern->tile->pattern;
+		pattern_set_resident_rows(tile, (y + pattern->repeat.offset_y) % tile->height);
+	}
+	for (unsigned int i = 0; i < pattern->layer_count; i++) {
+		/* The same image may have been placed more than once, its window
+		 * follows the lowest placement */
+		const struct pattern_composition_layer_t *entry = &pattern->layers[i];
+		bool placed_before = false;
+		for (unsigned int j = 0; j < i; j++) {
+			placed_before = placed_before || (pattern->layers[j].layer == entry->layer);
+		}
+		if (!placed_before) {
+			pattern_set_resident_rows(entry->layer->pattern, (y > entry->offsety) ? (y - entry->offsety) : 0);
+		}
+	}
+	if (!pattern_is_mapped(pattern)) {
+		return;
+	}
+
+	struct pattern_t *rw_pattern = (struct pattern_t*)pattern;
+	unsigned int margin = PATTERN_RESIDENT_ROWS / 4;
+	if (pattern->resident_row_count && (y >= pattern->resident_first_row + margin) && (y + margin < pattern->resident_first_row + pattern->resident_row_count)) {
+		return;
+	}
+	if ((pattern->resident_row_count == pattern->height) && pattern->height) {
+		return;
+	}
+
+	unsigned int first_row = (y > PATTERN_RESIDENT_ROWS / 2) ? (y - PATTERN_RESIDENT_ROWS / 2) : 0;
+	if (first_row >= pattern->height) {
+		first_row = (pattern->height > PATTERN_RESIDENT_ROWS) ? (pattern->height - PATTERN_RESIDENT_ROWS) : 0;
+	}
+	unsigned int row_count = (pattern->height - first_row < PATTERN_RESIDENT_ROWS) ? (pattern->height - first_row) : PATTERN_RESIDENT_ROWS;
+	pattern_advise_rows(pattern, pattern->resident_first_row, pattern->resident_row_count, false);
+	pattern_advise_rows(pattern, first_row, row_count, true);
+	rw_pattern->resident_first_row = first_row;
+	rw_pattern->resident_row_count = row_count;
+}
+
+/* Determines the bounding box of all set stitches without modifying the
+ * pattern, which may therefore already be published. */
+static void pattern_find_min_max(const struct pattern_t *pattern, unsigned int *min_x, unsigned int *max_x, unsigned int *min_y, unsigned int *max_y) {
+	/* Need to increment minimum values by 1 to get correct result even with
+	 * 0x0 sized pattern */
+	*min_x = pattern->width + 1;
+	*min_y = pattern->height + 1;
+	*max_x = 0;
+	*max_y = 0;
+	unsigned int row_words = (pattern->height + PATTERN_MASK_BITS - 1) / PATTERN_MASK_BITS;
+	for (unsigned int i = 0; i < row_words; i++) {
+		uint64_t nonempty = pattern->nonempty_rows[i];
+		while (nonempty) {
+			unsigned int y = (i * PATTERN_MASK_BITS) + __builtin_ctzll(nonempty);
+			nonempty &= nonempty - 1;
+			*min_x = (pattern->row_min_x[y] < *min_x) ? pattern->row_min_x[y] : *min_x;
+			*max_x = (pattern->row_max_x[y] > *max_x) ? pattern->row_max_x[y] : *max_x;
+			*min_y = (y < *min_y) ? y : *min_y;
+			*max_y = y;
+		}
+	}
+}
+
+void pattern_update_min_max(struct pattern_t *pattern) {
+	unsigned int min_x, max_x, min_y, max_y;
+	pattern_find_min_max(pattern, &min_x, &max_x, &min_y, &max_y);
+	pattern->min_x = min_x;
+	pattern->max_x = max_x;
+	pattern->min_y = min_y;
+	pattern->max_y = max_y;
+}
+
+/* dst[x] = top[x] ? top[x] : bottom[x] for length stitches. dst may be
+ * identical to either top or bottom. */
+static void blend_row(uint8_t *dst, const uint8_t *top, const uint8_t *bottom, unsigned int length) {
+	unsigned int x = 0;
+	for (; x + sizeof(row_vector_t) <= length; x += sizeof(row_vector_t)) {
+		row_vector_t top_vec, bottom_vec;
+		memcpy(&top_vec, top + x, sizeof(row_vector_t));
+		memcpy(&bottom_vec, bottom + x, sizeof(row_vector_t));
+		row_vector_t result = top_vec | (bottom_vec & (row_vector_t)(top_vec == 0));
+		memcpy(dst + x, &result, sizeof(row_vector_t));
+	}
+	for (; x < length; x++) {
+		dst[x] = top[x] ? top[x] : bottom[x];
+	}
+}
+
+/* Does not modify the pattern, which may therefore be the published one. */
+struct pattern_t* pattern_trim(const struct pattern_t *pattern) {
+	unsigned int min_x, max_x, min_y, max_y;
+	pattern_find_min_max(pattern, &min_x, &max_x, &min_y, &max_y);
+	if ((min_x > max_x) || (min_y > max_y)) {
 		/* Either width or height is zero. */
 		return pattern_new(0, 0);
 	}
 
-	struct pattern_t *trimmed = pattern_new(pattern->max_x - pattern->min_x + 1, pattern->max_y - pattern->min_y + 1);
+	struct pattern_t *trimmed = pattern->dict ? pattern_new_deduplicated(max_x - min_x + 1, max_y - min_y + 1) : pattern_new(max_x - min_x + 1, max_y - min_y + 1);
 	if (!trimmed) {
 		return NULL;
 	}
-	for (unsigned int y = 0; y < trimmed->height; y++) {
-		for (unsigned int x = 0; x < trimmed->width; x++) {
-			uint8_t pixel = pattern_get_color(pattern, x + pattern->min_x, y + pattern->min_y);
-			pattern_set_color(trimmed, x, y, pixel);
+	uint8_t buffer[pattern->width];
+	if (pattern->dict && trimmed->dict) {
+		/* Each unique row is trimmed only once */
+		uint32_t *trimmed_ids = calloc(pattern->dict->unique_count, sizeof(uint32_t));
+		if (!trimmed_ids) {
+			perror("calloc trimmed row IDs");
+			pattern_free(trimmed);
+			return NULL;
+		}
+		for (unsigned int y = 0; y < trimmed->height; y++) {
+			uint32_t row_id = pattern->dict->row_ids[y + min_y];
+			if (!trimmed_ids[row_id]) {
+				pattern_dict_decode_row(pattern->dict, row_id, buffer);
+				int trimmed_id = pattern_intern_row(trimmed, buffer + min_x);
+				if (trimmed_id == -1) {
+					logmsg(LLVL_ERROR, "Failed to grow row dictionary while trimming %u x %u pattern.", pattern->width, pattern->height);
+					free(trimmed_ids);
+					pattern_free(trimmed);
+					return NULL;
+				}
+				trimmed_ids[row_id] = trimmed_id + 1;
+			}
+			pattern_set_row_id(trimmed, y, trimmed_ids[row_id] - 1);
+		}
+		free(trimmed_ids);
+	} else {
+		for (unsigned int y = 0; y < trimmed->height; y++) {
+			if (pattern_row_is_empty(pattern, y + min_y)) {
+				continue;
+			}
+			memcpy(pattern_row_rw(trimmed, y), pattern_get_row(pattern, y + min_y, buffer) + min_x, trimmed->width);
+			pattern_sync_row(trimmed, y);
 		}
 	}
 	trimmed->min_x = 0;
@@ -177,6 +1085,374 @@ struct pattern_t* pattern_trim(struct pattern_t *pattern) {
 	return trimmed;
 }
 
+/* Returns a regular pattern with the same content, i.e., materializes a tiled
+ * or deduplicated pattern or fully flattens a composition. */
+struct pattern_t* pattern_flatten(const struct pattern_t *pattern) {
+	struct pattern_t *flat = pattern_new(pattern->width, pattern->height);
+	if (!flat) {
+		return NULL;
+	}
+	if (pattern->layers) {
+		/* Layers are merged straight into the result, one after the other */
+		for (unsigned int i = 0; i < pattern->layer_count; i++) {
+			pattern_merge_inplace(flat, &pattern->layers[i]);
+		}
+	} else {
+		for (unsigned int y = 0; y < flat->height; y++) {
+			if (pattern_row_is_empty(pattern, y)) {
+				continue;
+			}
+			uint8_t *row = pattern_row_rw(flat, y);
+			const uint8_t *source_row = pattern_get_row(pattern, y, row);
+			if (source_row != row) {
+				memcpy(row, source_row, flat->width);
+			}
+			pattern_sync_row(flat, y);
+		}
+	}
+	flat->used_colors = pattern->used_colors;
+	memcpy(flat->rgb_palette, pattern->rgb_palette, sizeof(flat->rgb_palette));
+	memcpy(flat->palette_hash, pattern->palette_hash, sizeof(flat->palette_hash));
+	pattern_update_min_max(flat);
+	return flat;
+}
+
+/* Returns a deduplicated copy of any pattern, regardless of whether
+ * deduplication is enabled in the storage configuration. Tiled patterns are copied with all their repetitions. */
+struct pattern_t* pattern_deduplicate(const struct pattern_t *pattern) {
+	struct pattern_t *deduplicated = pattern_new_dict(pattern->width, pattern->height);
+	if (!deduplicated) {
+		return NULL;
+	}
+	uint8_t buffer[pattern->width];
+	for (unsigned int y = 0; y < pattern->height; y++) {
+		if (!pattern_row_is_empty(pattern, y)) {
+			pattern_store_row(deduplicated, y, pattern_get_row(pattern, y, buffer));
+		}
+	}
+	deduplicated->used_colors = pattern->used_colors;
+	memcpy(deduplicated->rgb_palette, pattern->rgb_palette, sizeof(deduplicated->rgb_palette));
+	memcpy(deduplicated->palette_hash, pattern->palette_hash, sizeof(deduplicated->palette_hash));
+	pattern_update_min_max(deduplicated);
+	return deduplicated;
+}
+
+/* Creates a layer with a reference count of one, ownership of the pattern is
+ * transferred to the layer (also on failure). */
+struct pattern_layer_t* pattern_layer_new(struct pattern_t *pattern) {
+	struct pattern_layer_t *layer = calloc(1, sizeof(struct pattern_layer_t));
+	if (!layer) {
+		perror("calloc layer");
+		pattern_free(pattern);
+		return NULL;
+	}
+	atomic_init(&layer->refcnt, 1);
+	layer->pattern = pattern;
+	return layer;
+}
+
+struct pattern_layer_t* pattern_layer_get(struct pattern_layer_t *layer) {
+	atomic_fetch_add(&layer->refcnt, 1);
+	return layer;
+}
+
+void pattern_layer_put(struct pattern_layer_t *layer) {
+	if (layer && (atomic_fetch_sub(&layer->refcnt, 1) == 1)) {
+		pattern_free(layer->pattern);
+		free(layer);
+	}
+}
+
+/* Blends row y of the composition layer onto the given row of the
+ * composition, translating its colors into the palette of the composition. */
+static void pattern_blend_layer_row(uint8_t *row, const struct pattern_composition_layer_t *entry, unsigned int y) {
+	const struct pattern_t *source = entry->layer->pattern;
+	if ((y < entry->offsety) || pattern_row_is_empty(source, y - entry->offsety)) {
+		return;
+	}
+	uint8_t buffer[source->width];
+	const uint8_t *source_row = pattern_get_row(source, y - entry->offsety, buffer);
+	if (!entry->identity_colors) {
+		for (unsigned int x = 0; x < source->width; x++) {
+			buffer[x] = entry->color_map[source_row[x]];
+		}
+		source_row = buffer;
+	}
+	blend_row(row + entry->offsetx, source_row, row + entry->offsetx, source->width);
+}
+
+/* Merges a layer into a regular pattern in place, i.e., without allocating a
+ * third pattern: stitches that are set in the layer replace those of the
+ * target. Only possible if the target is a regular pattern that can hold the
+ * layer at its offset, returns false otherwise and leaves the target
+ * untouched. */
+bool pattern_merge_inplace(struct pattern_t *target, const struct pattern_composition_layer_t *entry) {
+	const struct pattern_t *source = entry->layer->pattern;
+	if (target->dict || target->tile || target->layers || (entry->offsetx + source->width > target->width) || (entry->offsety + source->height > target->height)) {
+		return false;
+	}
+	for (unsigned int y = entry->offsety; y < entry->offsety + source->height; y++) {
+		if (!pattern_row_is_empty(source, y - entry->offsety)) {
+			pattern_blend_layer_row(pattern_row_rw(target, y), entry, y);
+			pattern_sync_row(target, y);
+		}
+	}
+	return true;
+}
+
+static void pattern_compose_row(const struct pattern_t *pattern, unsigned int y, uint8_t *row) {
+	memset(row, 0, pattern->width);
+	if (pattern_row_is_empty(pattern, y)) {
+		return;
+	}
+	for (unsigned int i = 0; i < pattern->layer_count; i++) {
+		pattern_blend_layer_row(row, &pattern->layers[i], y);
+	}
+}
+
+static void pattern_add_layer_occupancy(struct pattern_t *pattern, const struct pattern_composition_layer_t *entry) {
+	const struct pattern_t *source = entry->layer->pattern;
+	for (unsigned int source_y = 0; source_y < source->height; source_y++) {
+		if (pattern_row_is_empty(source, source_y)) {
+			continue;
+		}
+		unsigned int y = source_y + entry->offsety;
+		unsigned int min_x = source->row_min_x[source_y] + entry->offsetx;
+		unsigned int max_x = source->row_max_x[source_y] + entry->offsetx;
+		if (pattern_row_is_empty(pattern, y)) {
+			pattern->nonempty_rows[y / PATTERN_MASK_BITS] |= 1ULL << (y % PATTERN_MASK_BITS);
+			pattern->row_min_x[y] = min_x;
+			pattern->row_max_x[y] = max_x;
+		} else {
+			pattern->row_min_x[y] = (min_x < pattern->row_min_x[y]) ? min_x : pattern->row_min_x[y];
+			pattern->row_max_x[y] = (max_x > pattern->row_max_x[y]) ? max_x : pattern->row_max_x[y];
+		}
+	}
+}
+
+/* Palette index of the color closest to rgb, for palettes that are full. */
+static uint8_t pattern_nearest_color_index(const struct pattern_t *pattern, uint32_t rgb) {
+	uint8_t nearest_index = 1;
+	unsigned int nearest_distance = ~0U;
+	for (unsigned int color_index = 1; color_index <= pattern->used_colors; color_index++) {
+		uint32_t candidate = pattern->rgb_palette[color_index - 1];
+		int dr = PIXEL_GET_RED(candidate) - PIXEL_GET_RED(rgb);
+		int dg = PIXEL_GET_GREEN(candidate) - PIXEL_GET_GREEN(rgb);
+		int db = PIXEL_GET_BLUE(candidate) - PIXEL_GET_BLUE(rgb);
+		unsigned int distance = (dr * dr) + (dg * dg) + (db * db);
+		if (distance < nearest_distance) {
+			nearest_distance = distance;
+			nearest_index = color_index;
+		}
+	}
+	return nearest_index;
+}
+
+/* Adds a layer on top of a composition. Its colors are added to the palette
+ * of the composition; once that is full, they are approximated by the
+ * closest color instead, so that no stitch of the layer is lost. Takes a new
+ * reference to the layer. */
+static void pattern_add_layer(struct pattern_t *pattern, struct pattern_layer_t *layer, unsigned int offsetx, unsigned int offsety) {
+	const struct pattern_t *source = layer->pattern;
+	struct pattern_composition_layer_t *entry = &pattern->layers[pattern->layer_count];
+	*entry = (struct pattern_composition_layer_t) {
+		.offsetx = offsetx,
+		.offsety = offsety,
+		.identity_colors = true,
+	};
+	unsigned int approximated_colors = 0;
+	for (unsigned int color_index = 1; color_index <= source->used_colors; color_index++) {
+		uint32_t rgb = source->rgb_palette[color_index - 1];
+		uint8_t mapped_index;
+		if (pattern->used_colors < 255) {
+			mapped_index = pattern_rgba_to_color_index(pattern, rgb | MK_RGBA(0, 0, 0, 0xff));
+		} else {
+			mapped_index = pattern_nearest_color_index(pattern, rgb);
+			approximated_colors += (pattern->rgb_palette[mapped_index - 1] != rgb);
+		}
+		entry->color_map[color_index] = mapped_index;
+		entry->identity_colors = entry->identity_colors && (mapped_index == color_index);
+	}
+	if (approximated_colors) {
+		logmsg(LLVL_WARN, "Palette of %u x %u composition is full, approximated %u color(s) of the new layer.", pattern->width, pattern->height, approximated_colors);
+	}
+	entry->layer = pattern_layer_get(layer);
+	pattern->layer_count++;
+	pattern_add_layer_occupancy(pattern, entry);
+}
+
+/* Creates a new composition that places the given layer at offset (offsetx,
+ * offsety) on top of the layers of the pattern below (which may be NULL). The
+ * palette of the pattern below is extended by the colors of the new layer.
+ * Layers are shared with the pattern below; so are rows that it has already
+ * flattened and that the new layer does not touch. Compositions that have
+ * reached MAX_PATTERN_LAYERS are flattened into a single layer first, any
+ * other pattern below becomes the bottom layer as it is. */
+struct pattern_t* pattern_compose(struct pattern_layer_t *below, struct pattern_layer_t *layer, unsigned int offsetx, unsigned int offsety) {
+	const struct pattern_t *source = layer->pattern;
+	/* Offsets are validated when the upload is received, rows are blended
+	 * into buffers that are sized by the composition */
+	assert(offsetx + source->width <= MAX_PATTERN_WIDTH);
+	assert(offsety + source->height <= pattern_get_max_height());
+
+	struct pattern_layer_t *base_layer = below ? pattern_layer_get(below) : NULL;
+	if (below && below->pattern->layers && (below->pattern->layer_count >= MAX_PATTERN_LAYERS)) {
+		pattern_layer_put(base_layer);
+		base_layer = pattern_layer_new(pattern_flatten(below->pattern));
+		if (!base_layer || !base_layer->pattern) {
+			pattern_layer_put(base_layer);
+			return NULL;
+		}
+	}
+	const struct pattern_t *base = base_layer ? base_layer->pattern : NULL;
+
+	unsigned int width = source->width + offsetx;
+	unsigned int height = source->height + offsety;
+	if (base) {
+		width = (base->width > width) ? base->width : width;
+		height = (base->height > height) ? base->height : height;
+	}
+	unsigned int base_layers = !base ? 0 : (base->layers ? base->layer_count : 1);
+	struct pattern_t *pattern = pattern_new_composition(width, height, base_layers + 1);
+	if (!pattern) {
+		pattern_layer_put(base_layer);
+		return NULL;
+	}
+
+	if (base) {
+		pattern->used_colors = base->used_colors;
+		memcpy(pattern->rgb_palette, base->rgb_palette, sizeof(pattern->rgb_palette));
+		memcpy(pattern->palette_hash, base->palette_hash, sizeof(pattern->palette_hash));
+		memcpy(pattern->nonempty_rows, base->nonempty_rows, base->nonempty_storage.size);
+		memcpy(pattern->row_min_x, base->row_min_x, base->height * sizeof(uint16_t));
+		memcpy(pattern->row_max_x, base->row_max_x, base->height * sizeof(uint16_t));
+		if (base->layers) {
+			for (unsigned int i = 0; i < base->layer_count; i++) {
+				pattern->layers[i] = base->layers[i];
+				pattern_layer_get(pattern->layers[i].layer);
+				pattern->layer_count++;
+			}
+		} else {
+			pattern->layers[0] = (struct pattern_composition_layer_t) {
+				.layer = pattern_layer_get(base_layer),
+				.identity_colors = true,
+			};
+			for (unsigned int color_index = 0; color_index < 256; color_index++) {
+				pattern->layers[0].color_map[color_index] = color_index;
+			}
+			pattern->layer_count++;
+		}
+	}
+	pattern_add_layer(pattern, layer, offsetx, offsety);
+
+	if (base && base->layers) {
+		/* Carry over rows that are already flattened below and not touched by
+		 * the new layer */
+		for (unsigned int y = 0; y < base->height; y++) {
+			bool touched = (y >= offsety) && !pattern_row_is_empty(source, y - offsety);
+			if (!touched && pattern_row_is_flat(base, y)) {
+				memcpy(pattern_row_rw(pattern, y), pattern_row_rw(base, y), base->width);
+				pattern_sync_row_mask(pattern, y);
+				atomic_store_explicit(&pattern->row_flattened[y], true, memory_order_relaxed);
+			}
+		}
+	}
+	pattern_layer_put(base_layer);
+	return pattern;
+}
+
+/* Creates a pattern that repeats a tile without materializing the repetitions.
+ * The tile is the tile of the source pattern if that is tiled already (i.e.,
+ * the repeat is replaced), otherwise a flattened copy of the source. */
+struct pattern_t* pattern_new_tiled(const struct pattern_t *source, const struct pattern_repeat_t *repeat) {
+	struct pattern_layer_t *tile_layer;
+	if (source->tile) {
+		tile_layer = pattern_layer_get(source->tile);
+	} else {
+		struct pattern_t *flat = pattern_flatten(source);
+		if (!flat) {
+			return NULL;
+		}
+		tile_layer = pattern_layer_new(flat);
+		if (!tile_layer) {
+			return NULL;
+		}
+	}
+
+	const struct pattern_t *tile = tile_layer->pattern;
+	if (!tile->width || !tile->height || !repeat->repeat_x || !repeat->repeat_y || (repeat->repeat_x > MAX_PATTERN_WIDTH) || (repeat->repeat_y > storage_config.max_height)) {
+		logmsg(LLVL_WARN, "Refusing to repeat %u x %u tile %u x %u times.", tile->width, tile->height, repeat->repeat_x, repeat->repeat_y);
+		pattern_layer_put(tile_layer);
+		return NULL;
+	}
+	struct pattern_t *pattern = pattern_alloc(tile->width * repeat->repeat_x, tile->height * repeat->repeat_y, 0);
+	if (!pattern) {
+		pattern_layer_put(tile_layer);
+		return NULL;
+	}
+	pattern->tile = tile_layer;
+	pattern->repeat = (struct pattern_repeat_t) {
+		.repeat_x = repeat->repeat_x,
+		.repeat_y = repeat->repeat_y,
+		.offset_x = repeat->offset_x % tile->width,
+		.offset_y = repeat->offset_y % tile->height,
+	};
+	pattern->used_colors = tile->used_colors;
+	memcpy(pattern->rgb_palette, tile->rgb_palette, sizeof(pattern->rgb_palette));
+	memcpy(pattern->palette_hash, tile->palette_hash, sizeof(pattern->palette_hash));
+
+	/* Row occupancy: stitch x of the tile appears first at logical column
+	 * (x - offset_x) mod tile width */
+	for (unsigned int tile_y = 0; tile_y < tile->height; tile_y++) {
+		if (pattern_row_is_empty(tile, tile_y)) {
+			continue;
+		}
+		unsigned int first_x = tile->width, last_x = 0;
+		for (unsigned int word = 0; word < tile->mask_words_per_row; word++) {
+			uint64_t mask = pattern_get_mask(tile, word * PATTERN_MASK_BITS, tile_y);
+			while (mask) {
+				unsigned int x = (word * PATTERN_MASK_BITS) + __builtin_ctzll(mask);
+				unsigned int logical_x = (x + tile->width - pattern->repeat.offset_x) % tile->width;
+				first_x = (logical_x < first_x) ? logical_x : first_x;
+				last_x = (logical_x > last_x) ? logical_x : last_x;
+				mask &= mask - 1;
+			}
+		}
+		last_x += (pattern->repeat.repeat_x - 1) * tile->width;
+		unsigned int first_y = (tile_y + tile->height - pattern->repeat.offset_y) % tile->height;
+		for (unsigned int y = first_y; y < pattern->height; y += tile->height) {
+			pattern->nonempty_rows[y / PATTERN_MASK_BITS] |= 1ULL << (y % PATTERN_MASK_BITS);
+			pattern->row_min_x[y] = first_x;
+			pattern->row_max_x[y] = last_x;
+		}
+	}
+	pattern_update_min_max(pattern);
+	return pattern;
+}
+
+unsigned int pattern_tile_width(const struct pattern_t *pattern) {
+	return pattern->tile ? pattern->tile->pattern->width : pattern->width;
+}
+
+unsigned int pattern_tile_height(const struct pattern_t *pattern) {
+	return pattern->tile ? pattern->tile->pattern->height : pattern->height;
+}
+
+/* Estimated heap and mapped storage of the pattern itself, excluding storage
+ * shared with other patterns through layers or tiles. */
+size_t pattern_memory_size(const struct pattern_t *pattern) {
+	size_t size = sizeof(struct pattern_t);
+	size += pattern->nonempty_storage.size + pattern->row_min_x_storage.size + pattern->row_max_x_storage.size;
+	size += pattern->pixel_storage.size + pattern->mask_storage.size;
+	size += (pattern->layer_count * sizeof(struct pattern_composition_layer_t)) + pattern->flattened_storage.size;
+	if (pattern->dict) {
+		const struct pattern_row_dict_t *dict = pattern->dict;
+		size += sizeof(struct pattern_row_dict_t);
+		size += dict->row_id_storage.size + dict->unique_row_storage.size + dict->unique_mask_storage.size + dict->run_storage.size + dict->hash_slot_storage.size;
+	}
+	return size;
+}
+
 void pattern_dump(const struct pattern_t *pattern) {
 	for (int y = 0; y < pattern->height; y++) {
 		pattern_dump_row(pattern, y);
@@ -185,7 +1461,25 @@ void pattern_dump(const struct pattern_t *pattern) {
 
 void pattern_free(struct pattern_t *pattern) {
 	if (pattern) {
-		free(pattern->pixel_data);
+		pattern_storage_free(&pattern->pixel_storage);
+		pattern_storage_free(&pattern->mask_storage);
+		pattern_storage_free(&pattern->nonempty_storage);
+		pattern_storage_free(&pattern->row_min_x_storage);
+		pattern_storage_free(&pattern->row_max_x_storage);
+		pattern_storage_free(&pattern->flattened_storage);
+		pattern_layer_put(pattern->tile);
+		for (unsigned int i = 0; i < pattern->layer_count; i++) {
+			pattern_layer_put(pattern->layers[i].layer);
+		}
+		free(pattern->layers);
+		if (pattern->dict) {
+			pattern_storage_free(&pattern->dict->row_id_storage);
+			pattern_storage_free(&pattern->dict->unique_row_storage);
+			pattern_storage_free(&pattern->dict->unique_mask_storage);
+			pattern_storage_free(&pattern->dict->run_storage);
+			pattern_storage_free(&pattern->dict->hash_slot_storage);
+			free(pattern->dict);
+		}
 		free(pattern);
 	}
 }
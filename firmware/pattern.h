@@ -24,10 +24,36 @@
 #ifndef __PATTERN_H__
 #define __PATTERN_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 
-#define MAX_PATTERN_WIDTH	400
-#define MAX_PATTERN_HEIGHT	1000
+#define MAX_PATTERN_WIDTH			400
+#define DEFAULT_MAX_PATTERN_HEIGHT	1000
+#define MAX_PATTERN_HEIGHT_LIMIT	1000000
+#define PATTERN_MASK_BITS			64
+
+/* Patterns whose per-row data exceeds this size, and any of their other
+ * arrays that grows beyond it, are stored in memory mapped files instead of on
+ * the heap */
+#define PATTERN_MAPPED_STORAGE_THRESHOLD	(256 * 1024)
+
+/* Number of rows of mapped patterns that are kept resident around the row
+ * that is currently being knitted */
+#define PATTERN_RESIDENT_ROWS		64
+
+/* When a composition would exceed this many layers, the existing layers are
+ * flattened into a single one first */
+#define MAX_PATTERN_LAYERS			32
+
+/* Open addressing hash table for RGB to palette index lookup, must be a power
+ * of two and sufficiently larger than the 255 possible colors */
+#define PATTERN_PALETTE_HASH_BITS	9
+#define PATTERN_PALETTE_HASH_SIZE	(1 << PATTERN_PALETTE_HASH_BITS)
+
+/* Unique row ID that every row of a deduplicated pattern initially refers to */
+#define PATTERN_EMPTY_ROW_ID		0
 
 #define UINT8(x)						((uint32_t)((x) & 0xff))
 #define MK_RGBA(r, g, b, a)				((UINT8(a) << 24) | (UINT8(b) << 16) | (UINT8(g) << 8) | (UINT8(r) << 0))
@@ -35,31 +61,160 @@
 #define MK_GRAY(grayval)				MK_RGB((grayval), (grayval), (grayval))
 
 #define PIXEL_GET_RGB(pixel)			((pixel) & 0xffffff)
+#define PIXEL_GET_RED(pixel)			UINT8((pixel) >> 0)
+#define PIXEL_GET_GREEN(pixel)			UINT8((pixel) >> 8)
+#define PIXEL_GET_BLUE(pixel)			UINT8((pixel) >> 16)
 #define PIXEL_GET_ALPHA(pixel)			UINT8((pixel) >> 24)
 
 #define PIXEL_FULLY_TRANSPARENT			MK_RGBA(0xff, 0xff, 0xff, 0)
 #define PIXEL_COLOR_IS_WHITE(pixel)		(PIXEL_GET_RGB(pixel) == 0xffffff)
 #define PIXEL_COLOR_IS_BLACK(pixel)		(PIXEL_GET_RGB(pixel) == 0)
 
+/* An immutable pattern that is shared (e.g., by the pattern cache, the
+ * published snapshot and tiled patterns) by reference counting. Where it is
+ * placed is up to whoever uses it. */
+struct pattern_layer_t {
+	atomic_uint refcnt;
+	struct pattern_t *pattern;
+};
+
+/* A layer placed within a composition. Its palette indices are translated
+ * into those of the composition through the color map. */
+struct pattern_composition_layer_t {
+	struct pattern_layer_t *layer;
+	unsigned int offsetx, offsety;
+	uint8_t color_map[256];
+	bool identity_colors;
+};
+
+/* Logical stitch (x, y) of a tiled pattern is stitch ((x + offset_x) mod
+ * tile width, (y + offset_y) mod tile height) of its tile */
+struct pattern_repeat_t {
+	unsigned int repeat_x, repeat_y;
+	unsigned int offset_x, offset_y;
+};
+
+/* Backing of an array whose size depends on the height or on the number of
+ * unique rows of a pattern: either heap memory or a shared mapping of an
+ * unlinked temporary file, so that the kernel can write back and evict the
+ * parts that are not currently needed. */
+struct pattern_storage_t {
+	void *data;
+	size_t size;
+	bool mapped;
+};
+
+struct pattern_storage_config_t {
+	unsigned int max_height;
+	const char *directory;
+	bool lock_resident_rows;			/* Pin resident rows of mapped patterns (real-time mode) */
+	bool deduplicate_rows;				/* Decode uploaded patterns into deduplicated storage */
+};
+
+/* Run of identical stitches within a run-length encoded row */
+struct pattern_run_t {
+	uint16_t length;
+	uint8_t color;
+};
+
+struct pattern_unique_row_t {
+	uint32_t hash;
+	unsigned int first_run, run_count;
+	uint16_t min_x, max_x;				/* Only valid if the row is not empty */
+	bool empty;
+};
+
+/* Deduplicated pattern storage: every row refers to one of the unique rows,
+ * which are kept run-length encoded along with their stitch mask. */
+struct pattern_row_dict_t {
+	uint32_t *row_ids;
+	struct pattern_unique_row_t *unique_rows;
+	uint64_t *unique_masks;				/* mask_words_per_row words per unique row */
+	unsigned int unique_count, unique_capacity;
+	struct pattern_run_t *runs;
+	unsigned int run_count, run_capacity;
+	uint32_t *hash_slots;				/* Unique row ID + 1, zero for empty slots */
+	unsigned int hash_slot_count;
+	struct pattern_storage_t row_id_storage, unique_row_storage, unique_mask_storage, run_storage, hash_slot_storage;
+};
+
 struct pattern_t {
 	unsigned int width, height;
 	uint8_t *pixel_data;
+	uint64_t *stitch_mask;				/* One bit per stitch set to any non-zero color, LSB first */
+	unsigned int mask_words_per_row;
+	uint64_t *nonempty_rows;			/* One bit per row that has any stitch set, LSB first */
+	uint16_t *row_min_x, *row_max_x;	/* First and last set stitch per row, only valid for non-empty rows */
 	unsigned int used_colors;
 	uint32_t rgb_palette[255];
+	uint8_t palette_hash[PATTERN_PALETTE_HASH_SIZE];	/* Palette index (1-based), zero for empty slots */
 	unsigned int min_x, max_x;
 	unsigned int min_y, max_y;
+
+	/* Backing of the arrays above. If mapped is set, all per-row data of the
+	 * pattern (including the row IDs and unique rows of a row dictionary) is
+	 * kept in mapped storage, of which only a window of rows around the one
+	 * being knitted is resident. */
+	bool mapped;
+	struct pattern_storage_t pixel_storage, mask_storage, nonempty_storage, row_min_x_storage, row_max_x_storage;
+	unsigned int resident_first_row, resident_row_count;
+
+	/* Only for compositions: layers from bottom to top, from which the row
+	 * occupancy is computed eagerly. Pixel data and stitch mask only hold
+	 * rows that have been flattened ahead of time by pattern_prepare_row(),
+	 * all other rows are blended from the layers on access. */
+	struct pattern_composition_layer_t *layers;
+	unsigned int layer_count;
+	atomic_bool *row_flattened;
+	struct pattern_storage_t flattened_storage;
+
+	/* Only for tiled patterns, which have no pixel storage of their own:
+	 * width and height are the logical dimensions, stitches are resolved
+	 * from the tile. */
+	struct pattern_layer_t *tile;
+	struct pattern_repeat_t repeat;
+
+	/* Only for deduplicated patterns, which have no pixel data or stitch mask
+	 * of their own. Rows must not be accessed through pattern_row(). */
+	struct pattern_row_dict_t *dict;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void pattern_set_storage_config(const struct pattern_storage_config_t *config);
+unsigned int pattern_get_max_height(void);
 struct pattern_t* pattern_new(unsigned int width, unsigned int height);
+struct pattern_t* pattern_new_deduplicated(unsigned int width, unsigned int height);
+int pattern_get_row_id(const struct pattern_t *pattern, unsigned int y);
+unsigned int pattern_unique_rows(const struct pattern_t *pattern);
 uint8_t pattern_get_color(const struct pattern_t *pattern, unsigned int x, unsigned int y);
+uint64_t pattern_get_mask(const struct pattern_t *pattern, int x, unsigned int y);
+bool pattern_row_is_empty(const struct pattern_t *pattern, unsigned int y);
+uint8_t pattern_rgba_to_color_index(struct pattern_t *pattern, uint32_t rgba);
 void pattern_set_rgba(struct pattern_t *pattern, unsigned int x, unsigned int y, uint32_t rgba);
+void pattern_set_rgba_row(struct pattern_t *pattern, unsigned int x, unsigned int y, const uint32_t *rgba, unsigned int count);
+void pattern_set_row(struct pattern_t *pattern, unsigned int y, const uint8_t *row);
+void pattern_set_palette(struct pattern_t *pattern, const uint32_t *rgb_palette, unsigned int used_colors);
+bool pattern_renumber_colors(struct pattern_t *pattern);
 uint8_t* pattern_row_rw(const struct pattern_t *pattern, unsigned int y);
 const uint8_t* pattern_row(const struct pattern_t *pattern, unsigned int y);
+const uint8_t* pattern_get_row(const struct pattern_t *pattern, unsigned int y, uint8_t *buffer);
+void pattern_sync_row(struct pattern_t *pattern, unsigned int y);
+void pattern_prepare_row(const struct pattern_t *pattern, unsigned int y);
 void pattern_dump_row(const struct pattern_t *pattern, unsigned int y);
+void pattern_set_resident_rows(const struct pattern_t *pattern, unsigned int y);
 void pattern_update_min_max(struct pattern_t *pattern);
-struct pattern_t* pattern_merge(const struct pattern_t *old_pattern, const struct pattern_t *new_pattern);
-struct pattern_t* pattern_trim(struct pattern_t *pattern);
+struct pattern_t* pattern_trim(const struct pattern_t *pattern);
+struct pattern_t* pattern_flatten(const struct pattern_t *pattern);
+struct pattern_t* pattern_deduplicate(const struct pattern_t *pattern);
+struct pattern_layer_t* pattern_layer_new(struct pattern_t *pattern);
+struct pattern_layer_t* pattern_layer_get(struct pattern_layer_t *layer);
+void pattern_layer_put(struct pattern_layer_t *layer);
+bool pattern_merge_inplace(struct pattern_t *target, const struct pattern_composition_layer_t *entry);
+struct pattern_t* pattern_compose(struct pattern_layer_t *below, struct pattern_layer_t *layer, unsigned int offsetx, unsigned int offsety);
+struct pattern_t* pattern_new_tiled(const struct pattern_t *source, const struct pattern_repeat_t *repeat);
+unsigned int pattern_tile_width(const struct pattern_t *pattern);
+unsigned int pattern_tile_height(const struct pattern_t *pattern);
+size_t pattern_memory_size(const struct pattern_t *pattern);
 void pattern_dump(const struct pattern_t *pattern);
 void pattern_free(struct pattern_t *pattern);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
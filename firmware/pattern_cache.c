@@ -0,0 +1,141 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pattern_cache.h"
+#include "logging.h"
+
+uint64_t pattern_cache_hash(const struct membuf_t *bindata) {
+	uint64_t hash = 0xcbf29ce484222325;
+	for (unsigned int i = 0; i < bindata->length; i++) {
+		hash = (hash ^ bindata->data[i]) * 0x100000001b3;
+	}
+	return hash;
+}
+
+static void pattern_cache_unlink(struct pattern_cache_t *cache, struct pattern_cache_entry_t *entry) {
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		cache->head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		cache->tail = entry->prev;
+	}
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+static void pattern_cache_push_front(struct pattern_cache_t *cache, struct pattern_cache_entry_t *entry) {
+	entry->next = cache->head;
+	if (cache->head) {
+		cache->head->prev = entry;
+	} else {
+		cache->tail = entry;
+	}
+	cache->head = entry;
+}
+
+static void pattern_cache_evict(struct pattern_cache_t *cache, struct pattern_cache_entry_t *entry) {
+	pattern_cache_unlink(cache, entry);
+	cache->entry_count--;
+	cache->memory_used -= entry->memory_size;
+	pattern_layer_put(entry->layer);
+	free(entry->bindata);
+	free(entry);
+}
+
+/* Returns a new reference to the cached layer or NULL on a miss. */
+struct pattern_layer_t* pattern_cache_lookup(struct pattern_cache_t *cache, const struct membuf_t *bindata, uint64_t hash) {
+	struct pattern_layer_t *layer = NULL;
+	pthread_mutex_lock(&cache->lock);
+	if (cache->memory_budget) {
+		for (struct pattern_cache_entry_t *entry = cache->head; entry; entry = entry->next) {
+			if ((entry->hash == hash) && (entry->bindata_length == bindata->length) && !memcmp(entry->bindata, bindata->data, bindata->length)) {
+				pattern_cache_unlink(cache, entry);
+				pattern_cache_push_front(cache, entry);
+				layer = pattern_layer_get(entry->layer);
+				break;
+			}
+		}
+		atomic_fetch_add(layer ? &cache->hit_cnt : &cache->miss_cnt, 1);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return layer;
+}
+
+/* Adds a layer that was decoded from bindata to the cache, which takes its own
+ * reference. Layers that alone exceed the budget are not cached. */
+void pattern_cache_insert(struct pattern_cache_t *cache, const struct membuf_t *bindata, uint64_t hash, struct pattern_layer_t *layer) {
+	size_t memory_size = sizeof(struct pattern_cache_entry_t) + bindata->length + pattern_memory_size(layer->pattern);
+	if (memory_size > cache->memory_budget) {
+		logmsg(LLVL_DEBUG, "Not caching %zu bytes pattern, cache budget is %zu bytes.", memory_size, cache->memory_budget);
+		return;
+	}
+
+	struct pattern_cache_entry_t *entry = calloc(1, sizeof(struct pattern_cache_entry_t));
+	if (!entry) {
+		perror("calloc pattern cache entry");
+		return;
+	}
+	entry->bindata = malloc(bindata->length);
+	if (!entry->bindata && bindata->length) {
+		perror("malloc pattern cache bindata");
+		free(entry);
+		return;
+	}
+	memcpy(entry->bindata, bindata->data, bindata->length);
+	entry->hash = hash;
+	entry->bindata_length = bindata->length;
+	entry->memory_size = memory_size;
+	entry->layer = pattern_layer_get(layer);
+
+	pthread_mutex_lock(&cache->lock);
+	while (cache->tail && (cache->memory_used + memory_size > cache->memory_budget)) {
+		pattern_cache_evict(cache, cache->tail);
+	}
+	pattern_cache_push_front(cache, entry);
+	cache->entry_count++;
+	cache->memory_used += memory_size;
+	logmsg(LLVL_TRACE, "Pattern cache holds %u entries, %zu of %zu bytes used.", cache->entry_count, cache->memory_used, cache->memory_budget);
+	pthread_mutex_unlock(&cache->lock);
+}
+
+size_t pattern_cache_memory_used(struct pattern_cache_t *cache) {
+	pthread_mutex_lock(&cache->lock);
+	size_t memory_used = cache->memory_used;
+	pthread_mutex_unlock(&cache->lock);
+	return memory_used;
+}
+
+void pattern_cache_clear(struct pattern_cache_t *cache) {
+	pthread_mutex_lock(&cache->lock);
+	while (cache->head) {
+		pattern_cache_evict(cache, cache->head);
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,71 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __PATTERN_CACHE_H__
+#define __PATTERN_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pattern.h"
+#include "membuf.h"
+
+#define DEFAULT_PATTERN_CACHE_KIB		4096
+
+struct pattern_cache_entry_t {
+	struct pattern_cache_entry_t *prev, *next;
+	uint64_t hash;
+	uint8_t *bindata;					/* Copy of the encoded image, compared on lookup */
+	unsigned int bindata_length;
+	size_t memory_size;
+	struct pattern_layer_t *layer;
+};
+
+/* Decoded uploads by content: maps the encoded image to the layer that was
+ * decoded from it, so that repeated uploads of the same image skip decoding
+ * regardless of where they are placed. Entries are evicted least recently used first once their
+ * estimated memory footprint exceeds the budget. A budget of zero disables
+ * the cache. */
+struct pattern_cache_t {
+	pthread_mutex_t lock;
+	struct pattern_cache_entry_t *head, *tail;	/* Most recently used first */
+	unsigned int entry_count;
+	size_t memory_budget, memory_used;
+	atomic_uint hit_cnt;
+	atomic_uint miss_cnt;
+};
+
+#define PATTERN_CACHE_INITIALIZER		{	\
+	.lock = PTHREAD_MUTEX_INITIALIZER,		\
+}
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+uint64_t pattern_cache_hash(const struct membuf_t *bindata);
+struct pattern_layer_t* pattern_cache_lookup(struct pattern_cache_t *cache, const struct membuf_t *bindata, uint64_t hash);
+void pattern_cache_insert(struct pattern_cache_t *cache, const struct membuf_t *bindata, uint64_t hash, struct pattern_layer_t *layer);
+size_t pattern_cache_memory_used(struct pattern_cache_t *cache);
+void pattern_cache_clear(struct pattern_cache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
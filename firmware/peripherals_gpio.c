@@ -27,6 +27,7 @@
 #include <errno.h>
 #include <gpiod.h>
 #include "tools.h"
+#include "latency.h"
 #include "peripherals_gpio.h"
 
 #define GPIO_CHIP_FILENAME	 "/dev/gpiochip0"
@@ -222,6 +223,7 @@ bool gpio_wait_for_input_change(gpio_irq_callback_t callback, unsigned int timeo
 		enum gpio_t gpio_id = get_gpio_for_offset(gpiod_line_offset(event_lines.lines[i]));
 		gpio_ids[i] = gpio_id;
 		gpiod_line_event_read(event_lines.lines[i], &events[i]);
+		latency_record_edge(LATENCY_GPIO_WAKEUP, &events[i].ts);
 		if (events[i].event_type == GPIOD_LINE_EVENT_RISING_EDGE) {
 			gpio_runtime_data[gpio_id].last_value = true;
 		} else if (events[i].event_type == GPIOD_LINE_EVENT_FALLING_EDGE) {
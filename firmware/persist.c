@@ -0,0 +1,413 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "persist.h"
+#include "logging.h"
+
+struct checksum_writer_t {
+	FILE *f;
+	uint32_t checksum;
+	bool success;
+};
+
+static uint32_t persist_checksum(uint32_t checksum, const void *vdata, size_t length) {
+	const uint8_t *data = (const uint8_t*)vdata;
+	for (size_t i = 0; i < length; i++) {
+		checksum = (checksum ^ data[i]) * 0x01000193;
+	}
+	return checksum;
+}
+
+static uint32_t persist_record_checksum(const struct persist_record_t *record) {
+	return persist_checksum(0x811c9dc5, record, offsetof(struct persist_record_t, checksum));
+}
+
+static void checksum_write(struct checksum_writer_t *writer, const void *data, size_t length) {
+	if (writer->success && length && (fwrite(data, length, 1, writer->f) != 1)) {
+		writer->success = false;
+	}
+	writer->checksum = persist_checksum(writer->checksum, data, length);
+}
+
+static void checksum_write_u32(struct checksum_writer_t *writer, uint32_t value) {
+	checksum_write(writer, &value, sizeof(value));
+}
+
+static const struct persist_record_t* persist_latest_record(const struct persist_t *persist) {
+	const struct persist_record_t *latest = NULL;
+	for (int i = 0; i < 2; i++) {
+		const struct persist_record_t *record = &persist->state_file->records[i];
+		if (record->sequence && (record->checksum == persist_record_checksum(record)) && (!latest || (record->sequence > latest->sequence))) {
+			latest = record;
+		}
+	}
+	return latest;
+}
+
+/* Maps the state file, creating it if it does not exist. The pattern is
+ * persisted next to it, with ".pattern" appended to the filename. */
+struct persist_t* persist_open(const char *filename) {
+	struct persist_t *persist = calloc(1, sizeof(struct persist_t));
+	if (!persist) {
+		perror("calloc persist");
+		return NULL;
+	}
+	persist->pattern_filename = malloc(strlen(filename) + 9);
+	if (!persist->pattern_filename) {
+		perror("malloc pattern filename");
+		persist_close(persist);
+		return NULL;
+	}
+	sprintf(persist->pattern_filename, "%s.pattern", filename);
+
+	int fd = open(filename, O_RDWR | O_CREAT, 0644);
+	if (fd == -1) {
+		logmsg(LLVL_ERROR, "Failed to open state file %s: %s", filename, strerror(errno));
+		persist_close(persist);
+		return NULL;
+	}
+	struct stat statbuf;
+	if (fstat(fd, &statbuf) || ((statbuf.st_size < sizeof(struct persist_state_file_t)) && ftruncate(fd, sizeof(struct persist_state_file_t)))) {
+		logmsg(LLVL_ERROR, "Failed to resize state file %s: %s", filename, strerror(errno));
+		close(fd);
+		persist_close(persist);
+		return NULL;
+	}
+	void *mapping = mmap(NULL, sizeof(struct persist_state_file_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		logmsg(LLVL_ERROR, "Failed to map state file %s: %s", filename, strerror(errno));
+		persist_close(persist);
+		return NULL;
+	}
+	persist->state_file = (struct persist_state_file_t*)mapping;
+
+	if ((persist->state_file->magic != PERSIST_STATE_MAGIC) || (persist->state_file->version != PERSIST_VERSION)) {
+		logmsg(LLVL_INFO, "Initializing state file %s.", filename);
+		memset(persist->state_file, 0, sizeof(struct persist_state_file_t));
+		persist->state_file->magic = PERSIST_STATE_MAGIC;
+		persist->state_file->version = PERSIST_VERSION;
+		msync(persist->state_file, sizeof(struct persist_state_file_t), MS_SYNC);
+	}
+
+	const struct persist_record_t *latest = persist_latest_record(persist);
+	if (latest) {
+		persist->sequence = latest->sequence;
+		persist->pattern_serial = latest->pattern_serial;
+	}
+	return persist;
+}
+
+/* The record is written into the inactive slot of the mapped state file and
+ * written back asynchronously. */
+void persist_write_state(struct persist_t *persist, const struct persist_state_t *state) {
+	persist->sequence++;
+	struct persist_record_t *record = &persist->state_file->records[persist->sequence % 2];
+	*record = (struct persist_record_t) {
+		.sequence = persist->sequence,
+		.pattern_serial = persist->pattern_serial,
+		.pattern_row = state->pattern_row,
+		.pattern_offset = state->pattern_offset,
+		.repeat_mode = state->repeat_mode,
+		.even_rows_left_to_right = state->even_rows_left_to_right,
+		.knitting_mode = state->knitting_mode,
+	};
+	record->checksum = persist_record_checksum(record);
+	msync(persist->state_file, sizeof(struct persist_state_file_t), MS_ASYNC);
+}
+
+static bool persist_sync_directory(const char *filename) {
+	char directory[strlen(filename) + 2];
+	strcpy(directory, filename);
+	char *separator = strrchr(directory, '/');
+	if (separator) {
+		separator[1] = 0;
+	} else {
+		strcpy(directory, ".");
+	}
+	int fd = open(directory, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+	bool success = (fsync(fd) == 0);
+	close(fd);
+	return success;
+}
+
+static bool persist_write_pattern_file(const char *filename, const struct pattern_t *pattern, const struct pattern_repeat_t *repeat, uint32_t serial, int32_t pattern_offset) {
+	const struct pattern_row_dict_t *dict = pattern->dict;
+	struct persist_pattern_header_t header = {
+		.magic = PERSIST_PATTERN_MAGIC,
+		.version = PERSIST_VERSION,
+		.serial = serial,
+		.width = pattern->width,
+		.height = pattern->height,
+		.repeat_x = repeat ? repeat->repeat_x : 0,
+		.repeat_y = repeat ? repeat->repeat_y : 0,
+		.offset_x = repeat ? repeat->offset_x : 0,
+		.offset_y = repeat ? repeat->offset_y : 0,
+		.used_colors = pattern->used_colors,
+		.unique_rows = dict->unique_count,
+		.pattern_offset = pattern_offset,
+	};
+	for (unsigned int i = 0; i < dict->unique_count; i++) {
+		header.run_count += dict->unique_rows[i].run_count;
+	}
+
+	FILE *f = fopen(filename, "w");
+	if (!f) {
+		logmsg(LLVL_ERROR, "Failed to create pattern file %s: %s", filename, strerror(errno));
+		return false;
+	}
+	struct checksum_writer_t writer = {
+		.f = f,
+		.success = (fwrite(&header, sizeof(header), 1, f) == 1),
+		.checksum = 0x811c9dc5,
+	};
+	checksum_write(&writer, pattern->rgb_palette, pattern->used_colors * sizeof(uint32_t));
+	checksum_write(&writer, dict->row_ids, pattern->height * sizeof(uint32_t));
+	for (unsigned int i = 0; i < dict->unique_count; i++) {
+		checksum_write_u32(&writer, dict->unique_rows[i].run_count);
+	}
+	for (unsigned int i = 0; i < dict->unique_count; i++) {
+		const struct pattern_unique_row_t *unique = &dict->unique_rows[i];
+		for (unsigned int j = 0; j < unique->run_count; j++) {
+			const struct pattern_run_t *run = &dict->runs[unique->first_run + j];
+			const uint8_t encoded_run[3] = { run->length & 0xff, run->length >> 8, run->color };
+			checksum_write(&writer, encoded_run, sizeof(encoded_run));
+		}
+	}
+	header.payload_checksum = writer.checksum;
+	bool success = writer.success && !fseek(f, 0, SEEK_SET) && (fwrite(&header, sizeof(header), 1, f) == 1) && !fflush(f) && !fsync(fileno(f));
+	if (fclose(f)) {
+		success = false;
+	}
+	if (!success) {
+		logmsg(LLVL_ERROR, "Failed to write pattern file %s: %s", filename, strerror(errno));
+	}
+	return success;
+}
+
+/* Atomically replaces the persisted pattern (or removes it if pattern is
+ * NULL). Compositions are flattened and all patterns are stored with
+ * deduplicated rows. */
+bool persist_write_pattern(struct persist_t *persist, const struct pattern_t *pattern, int32_t pattern_offset) {
+	uint32_t serial = persist->pattern_serial + 1;
+
+	bool success = true;
+	if (!pattern) {
+		if (unlink(persist->pattern_filename) && (errno != ENOENT)) {
+			logmsg(LLVL_ERROR, "Failed to remove pattern file %s: %s", persist->pattern_filename, strerror(errno));
+			success = false;
+		}
+	} else {
+		const struct pattern_t *source = pattern->tile ? pattern->tile->pattern : pattern;
+		struct pattern_t *deduplicated = source->dict ? NULL : pattern_deduplicate(source);
+		if (!source->dict && !deduplicated) {
+			return false;
+		}
+
+		char tmp_filename[strlen(persist->pattern_filename) + 5];
+		sprintf(tmp_filename, "%s.tmp", persist->pattern_filename);
+		success = persist_write_pattern_file(tmp_filename, deduplicated ? deduplicated : source, pattern->tile ? &pattern->repeat : NULL, serial, pattern_offset);
+		pattern_free(deduplicated);
+		if (success && rename(tmp_filename, persist->pattern_filename)) {
+			logmsg(LLVL_ERROR, "Failed to replace pattern file %s: %s", persist->pattern_filename, strerror(errno));
+			success = false;
+		}
+		if (!success) {
+			unlink(tmp_filename);
+		}
+	}
+	if (success) {
+		persist_sync_directory(persist->pattern_filename);
+		persist->pattern_serial = serial;
+	}
+	return success;
+}
+
+static struct pattern_t* persist_decode_pattern(const struct persist_pattern_header_t *header, const uint8_t *payload) {
+	const uint32_t *palette = (const uint32_t*)payload;
+	const uint32_t *row_ids = palette + header->used_colors;
+	const uint32_t *run_counts = row_ids + header->height;
+	const uint8_t *runs = (const uint8_t*)(run_counts + header->unique_rows);
+
+	unsigned int *first_runs = calloc(header->unique_rows, sizeof(unsigned int));
+	if (!first_runs) {
+		perror("calloc first runs");
+		return NULL;
+	}
+	bool valid = true;
+	unsigned int run_index = 0;
+	for (unsigned int i = 0; valid && (i < header->unique_rows); i++) {
+		first_runs[i] = run_index;
+		unsigned int length = 0;
+		for (unsigned int j = 0; valid && (j < run_counts[i]); j++, run_index++) {
+			const uint8_t *run = runs + (3 * run_index);
+			valid = (run_index < header->run_count) && (run[2] <= header->used_colors);
+			length += valid ? (run[0] | (run[1] << 8)) : 0;
+			valid = valid && (length <= header->width);
+		}
+		valid = valid && (length == header->width);
+	}
+
+	struct pattern_t *pattern = valid ? pattern_new_deduplicated(header->width, header->height) : NULL;
+	if (pattern) {
+		pattern_set_palette(pattern, palette, header->used_colors);
+		uint8_t row[header->width];
+		for (unsigned int y = 0; y < header->height; y++) {
+			if (row_ids[y] >= header->unique_rows) {
+				valid = false;
+				break;
+			}
+			uint8_t *position = row;
+			bool empty = true;
+			for (unsigned int j = 0; j < run_counts[row_ids[y]]; j++) {
+				const uint8_t *run = runs + (3 * (first_runs[row_ids[y]] + j));
+				unsigned int length = run[0] | (run[1] << 8);
+				memset(position, run[2], length);
+				position += length;
+				empty = empty && !run[2];
+			}
+			if (!empty) {
+				pattern_set_row(pattern, y, row);
+			}
+		}
+		pattern_update_min_max(pattern);
+	}
+	free(first_runs);
+	if (!valid) {
+		logmsg(LLVL_ERROR, "Persisted pattern is inconsistent, ignoring it.");
+		pattern_free(pattern);
+		return NULL;
+	}
+	return pattern;
+}
+
+static struct pattern_t* persist_load_pattern(const char *filename, struct persist_pattern_header_t *header) {
+	FILE *f = fopen(filename, "r");
+	if (!f) {
+		if (errno != ENOENT) {
+			logmsg(LLVL_ERROR, "Failed to open pattern file %s: %s", filename, strerror(errno));
+		}
+		return NULL;
+	}
+	if ((fread(header, sizeof(*header), 1, f) != 1) || (header->magic != PERSIST_PATTERN_MAGIC) || (header->version != PERSIST_VERSION)) {
+		logmsg(LLVL_ERROR, "Pattern file %s has an invalid header.", filename);
+		fclose(f);
+		return NULL;
+	}
+	if ((header->width > MAX_PATTERN_WIDTH) || (header->height > pattern_get_max_height()) || (header->used_colors > 255) || (header->unique_rows < 1) || (header->unique_rows > header->height + 1) || (header->run_count > (uint64_t)header->unique_rows * header->width)) {
+		logmsg(LLVL_ERROR, "Pattern file %s describes an unsupported %u x %u pattern.", filename, header->width, header->height);
+		fclose(f);
+		return NULL;
+	}
+
+	size_t payload_size = ((header->used_colors + header->height + header->unique_rows) * sizeof(uint32_t)) + (3 * header->run_count);
+	uint8_t *payload = malloc(payload_size);
+	if (!payload) {
+		logmsg(LLVL_ERROR, "Failed to allocate %zu bytes for persisted pattern.", payload_size);
+		fclose(f);
+		return NULL;
+	}
+	bool valid = (fread(payload, payload_size, 1, f) == 1) && (persist_checksum(0x811c9dc5, payload, payload_size) == header->payload_checksum);
+	fclose(f);
+	if (!valid) {
+		logmsg(LLVL_ERROR, "Pattern file %s is truncated or corrupt.", filename);
+		free(payload);
+		return NULL;
+	}
+
+	struct pattern_t *pattern = persist_decode_pattern(header, payload);
+	free(payload);
+	if (pattern && header->repeat_x && header->repeat_y) {
+		const struct pattern_repeat_t repeat = {
+			.repeat_x = header->repeat_x,
+			.repeat_y = header->repeat_y,
+			.offset_x = header->offset_x,
+			.offset_y = header->offset_y,
+		};
+		struct pattern_t *tiled = pattern_new_tiled(pattern, &repeat);
+		pattern_free(pattern);
+		pattern = tiled;
+	}
+	return pattern;
+}
+
+/* Loads the persisted pattern (NULL if there is none) and knitting state.
+ * Returns false if no valid state was persisted. The state is only taken
+ * from the state file if it refers to the persisted pattern; otherwise, the
+ * pattern is restored at its first row with knitting disabled. */
+bool persist_load(struct persist_t *persist, struct pattern_t **pattern, struct persist_state_t *state) {
+	*pattern = NULL;
+	const struct persist_record_t *latest = persist_latest_record(persist);
+	if (!latest) {
+		return false;
+	}
+	*state = (struct persist_state_t) {
+		.pattern_row = latest->pattern_row,
+		.pattern_offset = latest->pattern_offset,
+		.repeat_mode = latest->repeat_mode,
+		.even_rows_left_to_right = latest->even_rows_left_to_right,
+		.knitting_mode = latest->knitting_mode,
+	};
+
+	struct persist_pattern_header_t header;
+	*pattern = persist_load_pattern(persist->pattern_filename, &header);
+	if (!*pattern) {
+		state->pattern_row = 0;
+		state->knitting_mode = false;
+		return true;
+	}
+	if (header.serial != latest->pattern_serial) {
+		logmsg(LLVL_WARN, "Persisted knitting state refers to pattern %u, but pattern %u was persisted. Restarting pattern.", latest->pattern_serial, header.serial);
+		state->pattern_row = 0;
+		state->pattern_offset = header.pattern_offset;
+		state->knitting_mode = false;
+	}
+	if ((state->pattern_row < 0) || (state->pattern_row >= (*pattern)->height)) {
+		state->pattern_row = 0;
+	}
+	persist->pattern_serial = header.serial;
+	return true;
+}
+
+void persist_close(struct persist_t *persist) {
+	if (persist) {
+		if (persist->state_file) {
+			msync(persist->state_file, sizeof(struct persist_state_file_t), MS_SYNC);
+			munmap(persist->state_file, sizeof(struct persist_state_file_t));
+		}
+		free(persist->pattern_filename);
+		free(persist);
+	}
+}
@@ -0,0 +1,103 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __PERSIST_H__
+#define __PERSIST_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pattern.h"
+
+#define PERSIST_STATE_MAGIC			0x5453504b		/* "KPST" */
+#define PERSIST_PATTERN_MAGIC		0x5450504b		/* "KPPT" */
+#define PERSIST_VERSION				1
+
+/* Knitting progress as it is persisted whenever it changes */
+struct persist_state_t {
+	int32_t pattern_row;
+	int32_t pattern_offset;
+	uint8_t repeat_mode;
+	bool even_rows_left_to_right;
+	bool knitting_mode;
+};
+
+/* The state file holds two records that are written alternately, so that a
+ * torn write can only ever destroy the older one. On load, the valid record
+ * with the highest sequence number wins. pattern_serial refers to the pattern
+ * file that was current when the record was written. */
+struct persist_record_t {
+	uint32_t sequence;
+	uint32_t pattern_serial;
+	int32_t pattern_row;
+	int32_t pattern_offset;
+	uint8_t repeat_mode;
+	uint8_t even_rows_left_to_right;
+	uint8_t knitting_mode;
+	uint8_t reserved;
+	uint32_t checksum;
+};
+
+struct persist_state_file_t {
+	uint32_t magic;
+	uint32_t version;
+	struct persist_record_t records[2];
+};
+
+/* The pattern file is replaced atomically whenever the pattern changes. The
+ * header is followed by the palette (used_colors words), the unique row ID of
+ * every row (height words), the run count of every unique row (unique_rows
+ * words) and all runs (run_count entries of a 16 bit length and an 8 bit
+ * color). Tiled patterns store their tile and a repeat_x/repeat_y other than
+ * zero. */
+struct persist_pattern_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t serial;
+	uint32_t width, height;
+	uint32_t repeat_x, repeat_y;
+	uint32_t offset_x, offset_y;
+	uint32_t used_colors;
+	uint32_t unique_rows;
+	uint32_t run_count;
+	int32_t pattern_offset;
+	uint32_t payload_checksum;
+};
+
+/* Not thread safe: once the server runs, only the persistence thread writes
+ * state and pattern. */
+struct persist_t {
+	char *pattern_filename;
+	struct persist_state_file_t *state_file;
+	uint32_t sequence;
+	uint32_t pattern_serial;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+struct persist_t* persist_open(const char *filename);
+void persist_write_state(struct persist_t *persist, const struct persist_state_t *state);
+bool persist_write_pattern(struct persist_t *persist, const struct pattern_t *pattern, int32_t pattern_offset);
+bool persist_load(struct persist_t *persist, struct pattern_t **pattern, struct persist_state_t *state);
+void persist_close(struct persist_t *persist);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
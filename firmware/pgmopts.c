@@ -21,13 +21,23 @@
  *	Johannes Bauer <JohannesBauer@gmx.de>
  */
 
+#include <stdio.h>
 #include <stdbool.h>
 #include "pgmopts.h"
 #include "argparse.h"
+#include "tools.h"
+#include "sled.h"
+#include "pattern.h"
+#include "pattern_cache.h"
 
 static struct pgmopts_t pgm_opts_rw = {
 	.loglevel = LLVL_ERROR,
 	.max_bindata_recv_bytes = 256 * 1024,
+	.realtime_cpu = 3,
+	.realtime_priority = 80,
+	.max_pattern_height = DEFAULT_MAX_PATTERN_HEIGHT,
+	.pattern_storage_dir = "/var/tmp",
+	.pattern_cache_kib = DEFAULT_PATTERN_CACHE_KIB,
 };
 const struct pgmopts_t *pgm_opts = &pgm_opts_rw;
 
@@ -37,6 +47,64 @@ static bool knitserver_pgmopts(enum argparse_option_t option, const char *value)
 			pgm_opts_rw.no_hardware = true;
 			break;
 
+		case ARG_REALTIME:
+			pgm_opts_rw.realtime = true;
+			break;
+
+		case ARG_RT_CPU:
+			if (!safe_atoi(value, &pgm_opts_rw.realtime_cpu) || (pgm_opts_rw.realtime_cpu < 0)) {
+				fprintf(stderr, "error: invalid CPU core given: %s\n", value);
+				return false;
+			}
+			break;
+
+		case ARG_RT_PRIORITY:
+			if (!safe_atoi(value, &pgm_opts_rw.realtime_priority)) {
+				fprintf(stderr, "error: invalid priority given: %s\n", value);
+				return false;
+			}
+			break;
+
+		case ARG_PREDICT_LEAD:
+			if (!safe_atoi(value, &pgm_opts_rw.predict_lead_us) || (pgm_opts_rw.predict_lead_us < 0)) {
+				fprintf(stderr, "error: invalid prediction lead time given: %s\n", value);
+				return false;
+			}
+			break;
+
+		case ARG_LATCH_PHASE:
+			if (!safe_atoi(value, &pgm_opts_rw.latch_phase) || (pgm_opts_rw.latch_phase < 0) || (pgm_opts_rw.latch_phase >= SLED_STEPS_PER_POSITION)) {
+				fprintf(stderr, "error: invalid latch phase given, must be between 0 and %d: %s\n", SLED_STEPS_PER_POSITION - 1, value);
+				return false;
+			}
+			break;
+
+		case ARG_MAX_HEIGHT:
+			if (!safe_atoi(value, &pgm_opts_rw.max_pattern_height) || (pgm_opts_rw.max_pattern_height < 1) || (pgm_opts_rw.max_pattern_height > MAX_PATTERN_HEIGHT_LIMIT)) {
+				fprintf(stderr, "error: invalid maximum pattern height given, must be between 1 and %d: %s\n", MAX_PATTERN_HEIGHT_LIMIT, value);
+				return false;
+			}
+			break;
+
+		case ARG_PATTERN_STORAGE:
+			pgm_opts_rw.pattern_storage_dir = value;
+			break;
+
+		case ARG_STATE_FILE:
+			pgm_opts_rw.state_file = value;
+			break;
+
+		case ARG_PATTERN_CACHE:
+			if (!safe_atoi(value, &pgm_opts_rw.pattern_cache_kib) || (pgm_opts_rw.pattern_cache_kib < 0)) {
+				fprintf(stderr, "error: invalid pattern cache size given: %s\n", value);
+				return false;
+			}
+			break;
+
+		case ARG_NO_ROW_DEDUP:
+			pgm_opts_rw.no_row_dedup = true;
+			break;
+
 		case ARG_FORCE:
 			pgm_opts_rw.force = true;
 			break;
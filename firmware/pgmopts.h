@@ -31,6 +31,16 @@ struct pgmopts_t {
 	bool quit_after_single_connection;
 	bool force;
 	bool no_hardware;
+	bool realtime;
+	int realtime_cpu;
+	int realtime_priority;
+	int predict_lead_us;
+	int latch_phase;
+	int max_pattern_height;
+	const char *pattern_storage_dir;
+	int pattern_cache_kib;
+	const char *state_file;
+	bool no_row_dedup;
 	enum loglvl_t loglevel;
 	const char *unix_socket;
 	int max_bindata_recv_bytes;
@@ -0,0 +1,65 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "membuf.h"
+#include "pattern.h"
+#include "png_reader.h"
+#include "kpat.h"
+
+/* Converts PNG patterns to the native kpat format offline, so that the
+ * server can load them without decoding them first. */
+int main(int argc, char **argv) {
+	if (argc != 3) {
+		fprintf(stderr, "%s [input PNG] [output kpat]\n", argv[0]);
+		fprintf(stderr, "\n");
+		fprintf(stderr, "Converts a PNG pattern file to the native kpat pattern format.\n");
+		return 1;
+	}
+
+	struct membuf_t png_data = MEMBUF_INITIALIZER;
+	if (!membuf_read_from_file(&png_data, argv[1])) {
+		perror(argv[1]);
+		membuf_free(&png_data);
+		return 1;
+	}
+	struct pattern_t *pattern = png_read_pattern(&png_data, 0, 0);
+	if (!pattern) {
+		fprintf(stderr, "%s: unable to read PNG pattern\n", argv[1]);
+		membuf_free(&png_data);
+		return 1;
+	}
+
+	struct membuf_t kpat_data = MEMBUF_INITIALIZER;
+	bool success = kpat_write_pattern_mem(pattern, &kpat_data) && membuf_write_to_file(&kpat_data, argv[2]);
+	if (success) {
+		printf("%s: %u x %u pattern with %u colors, %u unique rows, %u bytes PNG -> %u bytes kpat\n", argv[2], pattern->width, pattern->height, pattern->used_colors, pattern_unique_rows(pattern), png_data.length, kpat_data.length);
+	} else {
+		perror(argv[2]);
+	}
+	pattern_free(pattern);
+	membuf_free(&kpat_data);
+	membuf_free(&png_data);
+	return success ? 0 : 1;
+}
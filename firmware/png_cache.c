@@ -0,0 +1,84 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "png_cache.h"
+#include "logging.h"
+
+/* Appends the cached PNG to membuf if one was encoded from the given pattern
+ * version. */
+bool png_cache_lookup(struct png_cache_t *cache, enum png_cache_variant_t variant, enum png_encoder_profile_t profile, uint32_t pattern_version, struct membuf_t *membuf) {
+	bool hit = false;
+	pthread_mutex_lock(&cache->lock);
+	struct png_cache_entry_t *entry = &cache->entry[variant][profile];
+	if (entry->pattern_version == pattern_version) {
+		hit = membuf_append(membuf, entry->png.data, entry->png.length);
+	}
+	pthread_mutex_unlock(&cache->lock);
+	atomic_fetch_add(hit ? &cache->hit_cnt : &cache->miss_cnt, 1);
+	return hit;
+}
+
+/* Remembers the PNG that was encoded from the given pattern version. An entry
+ * of a newer version, stored by a concurrent request, is never replaced by an
+ * older one. */
+void png_cache_insert(struct png_cache_t *cache, enum png_cache_variant_t variant, enum png_encoder_profile_t profile, uint32_t pattern_version, const struct membuf_t *png) {
+	pthread_mutex_lock(&cache->lock);
+	struct png_cache_entry_t *entry = &cache->entry[variant][profile];
+	if (pattern_version > entry->pattern_version) {
+		entry->pattern_version = 0;
+		entry->png.length = 0;
+		if (membuf_append(&entry->png, png->data, png->length)) {
+			entry->pattern_version = pattern_version;
+		} else {
+			logmsg(LLVL_WARN, "Unable to cache %u bytes encoded PNG.", png->length);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
+
+size_t png_cache_memory_used(struct png_cache_t *cache) {
+	size_t memory_used = 0;
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < PNG_CACHE_VARIANT_COUNT; i++) {
+		for (unsigned int j = 0; j < PNG_PROFILE_COUNT; j++) {
+			memory_used += cache->entry[i][j].png.length;
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+	return memory_used;
+}
+
+/* Discards all cached PNGs, needs to be called when the pattern is replaced. */
+void png_cache_clear(struct png_cache_t *cache) {
+	pthread_mutex_lock(&cache->lock);
+	for (unsigned int i = 0; i < PNG_CACHE_VARIANT_COUNT; i++) {
+		for (unsigned int j = 0; j < PNG_PROFILE_COUNT; j++) {
+			cache->entry[i][j].pattern_version = 0;
+			membuf_free(&cache->entry[i][j].png);
+		}
+	}
+	pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,67 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __PNG_CACHE_H__
+#define __PNG_CACHE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "membuf.h"
+#include "png_writer.h"
+
+enum png_cache_variant_t {
+	PNG_CACHE_PRETTY,
+	PNG_CACHE_RAW,
+	PNG_CACHE_VARIANT_COUNT,
+};
+
+struct png_cache_entry_t {
+	uint32_t pattern_version;			/* Zero if the entry is empty */
+	struct membuf_t png;
+};
+
+/* Encoded PNG renditions of the current pattern, one per variant and encoder
+ * profile. Published
+ * patterns are immutable, so an entry stays valid for as long as the pattern
+ * version it was encoded from is current. */
+struct png_cache_t {
+	pthread_mutex_t lock;
+	struct png_cache_entry_t entry[PNG_CACHE_VARIANT_COUNT][PNG_PROFILE_COUNT];
+	atomic_uint hit_cnt;
+	atomic_uint miss_cnt;
+};
+
+#define PNG_CACHE_INITIALIZER		{	\
+	.lock = PTHREAD_MUTEX_INITIALIZER,	\
+}
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool png_cache_lookup(struct png_cache_t *cache, enum png_cache_variant_t variant, enum png_encoder_profile_t profile, uint32_t pattern_version, struct membuf_t *membuf);
+void png_cache_insert(struct png_cache_t *cache, enum png_cache_variant_t variant, enum png_encoder_profile_t profile, uint32_t pattern_version, const struct membuf_t *png);
+size_t png_cache_memory_used(struct png_cache_t *cache);
+void png_cache_clear(struct png_cache_t *cache);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
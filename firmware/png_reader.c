@@ -50,43 +50,10 @@ static const char* png_color_type_to_str(uint8_t color_type) {
 	return "Unknown";
 }
 
-struct pattern_t* png_read_pattern(struct membuf_t *membuf, unsigned int offsetx, unsigned int offsety) {
-	struct pattern_t *pattern = NULL;
-
-	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (!png_ptr) {
-		perror("png_create_read_struct");
-		return NULL;
-	}
-
-	png_infop info_ptr = png_create_info_struct(png_ptr);
-	if (!info_ptr) {
-		png_destroy_read_struct(&png_ptr, NULL, NULL);
-		perror("png_create_info_struct");
-		return NULL;
-	}
-
-	uint32_t *pixel_data = NULL;
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		free(pixel_data);
-		return pattern;
-	}
-
-	membuf_rewind(membuf);
-	png_set_read_fn(png_ptr, membuf, membuf_read_data_fn);
-	png_read_info(png_ptr, info_ptr);
-
+static bool png_read_rgba_rows(png_structp png_ptr, png_infop info_ptr, struct pattern_t *pattern, struct pattern_t *scratch, unsigned int offsetx, unsigned int offsety) {
 	uint32_t width = png_get_image_width(png_ptr, info_ptr);
 	uint32_t height = png_get_image_height(png_ptr, info_ptr);
 	uint8_t color_type = png_get_color_type(png_ptr, info_ptr);
-	logmsg(LLVL_DEBUG, "PNG decoded: %u x %u pixels", width, height);
-
-	pattern = pattern_new(width + offsetx, height + offsety);
-	if (!pattern) {
-		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		return NULL;
-	}
 
 	if (png_get_bit_depth(png_ptr, info_ptr) == 16) {
 		logmsg(LLVL_TRACE, "PNG stripped from 16 bits to 8.");
@@ -111,38 +78,209 @@ struct pattern_t* png_read_pattern(struct membuf_t *membuf, unsigned int offsetx
 		png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
 	}
 
+	int passes = png_set_interlace_handling(png_ptr);
 	png_read_update_info(png_ptr, info_ptr);
 	color_type = png_get_color_type(png_ptr, info_ptr);
 
 	if ((color_type != PNG_COLOR_TYPE_RGBA) || (png_get_bit_depth(png_ptr, info_ptr) != 8)) {
 		logmsg(LLVL_WARN, "Resulting PNG image not RGBA8: color_type = %s (0x%x), bit_depth = %d", png_color_type_to_str(color_type), color_type, png_get_bit_depth(png_ptr, info_ptr));
+		return false;
+	}
+
+	/* Rows are decoded one at a time and converted into the pattern right
+	 * away. Passes of interlaced images only fill in some pixels of the row
+	 * buffer, the others are restored from the previous passes' results.
+	 * These intermediate rows are assembled in the plain scratch pattern, so
+	 * that only the final rows are stored in the (deduplicated) pattern. */
+	struct pattern_t *target = (passes > 1) ? scratch : pattern;
+	if (!target) {
+		logmsg(LLVL_WARN, "No scratch pattern to decode interlaced PNG image into.");
+		return false;
+	}
+	uint32_t png_row[width];
+	uint8_t pattern_row_buffer[pattern->width];
+	for (int pass = 0; pass < passes; pass++) {
+		for (uint32_t y = 0; y < height; y++) {
+			if ((pass == 0) && (passes > 1)) {
+				for (uint32_t x = 0; x < width; x++) {
+					png_row[x] = MK_RGB(0xff, 0xff, 0xff);
+				}
+			} else if (pass > 0) {
+				const uint8_t *previous = pattern_get_row(target, y + offsety, pattern_row_buffer) + offsetx;
+				for (uint32_t x = 0; x < width; x++) {
+					png_row[x] = previous[x] ? (target->rgb_palette[previous[x] - 1] | MK_RGBA(0, 0, 0, 0xff)) : MK_RGB(0xff, 0xff, 0xff);
+				}
+			}
+			png_read_row(png_ptr, (uint8_t*)png_row, NULL);
+			pattern_set_rgba_row(target, offsetx, y + offsety, png_row, width);
+		}
+	}
+	if (target == pattern) {
+		return true;
+	}
+
+	if (!pattern_renumber_colors(scratch)) {
+		logmsg(LLVL_WARN, "Unable to renumber colors of interlaced PNG image.");
+		return false;
+	}
+	pattern_set_palette(pattern, scratch->rgb_palette, scratch->used_colors);
+	for (uint32_t y = 0; y < height; y++) {
+		if (!pattern_row_is_empty(scratch, y + offsety)) {
+			pattern_set_row(pattern, y + offsety, pattern_get_row(scratch, y + offsety, pattern_row_buffer));
+		}
+	}
+	return true;
+}
+
+/* Palette images and grayscale images of up to 8 bits per sample that are not
+ * interlaced are read without conversion to RGBA: their samples are
+ * translated to pattern color indices directly. */
+static bool png_has_native_samples(png_structp png_ptr, png_infop info_ptr) {
+	if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+		return false;
+	}
+	uint8_t color_type = png_get_color_type(png_ptr, info_ptr);
+	return (color_type == PNG_COLOR_TYPE_PALETTE) || ((color_type == PNG_COLOR_TYPE_GRAY) && (png_get_bit_depth(png_ptr, info_ptr) <= 8));
+}
+
+/* Maps every possible sample value to its RGBA color, exactly like the RGBA
+ * conversion does: tRNS applies to palettes, but not to grayscale images, and
+ * palette indices without PLTE entry are opaque black. */
+static void png_build_sample_colors(png_structp png_ptr, png_infop info_ptr, uint32_t sample_colors[static 256]) {
+	for (int i = 0; i < 256; i++) {
+		sample_colors[i] = MK_RGB(0, 0, 0);
+	}
+	if (png_get_color_type(png_ptr, info_ptr) == PNG_COLOR_TYPE_PALETTE) {
+		png_colorp palette = NULL;
+		int num_palette = 0;
+		png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette);
+		png_bytep trans_alpha = NULL;
+		int num_trans = 0;
+		if (!png_get_tRNS(png_ptr, info_ptr, &trans_alpha, &num_trans, NULL)) {
+			num_trans = 0;
+		}
+		for (int i = 0; (i < num_palette) && (i < 256); i++) {
+			sample_colors[i] = MK_RGBA(palette[i].red, palette[i].green, palette[i].blue, (i < num_trans) ? trans_alpha[i] : 0xff);
+		}
+	} else {
+		unsigned int max_sample = (1 << png_get_bit_depth(png_ptr, info_ptr)) - 1;
+		for (unsigned int i = 0; i <= max_sample; i++) {
+			sample_colors[i] = MK_GRAY(i * 255 / max_sample);
+		}
+	}
+}
+
+static bool png_read_native_rows(png_structp png_ptr, png_infop info_ptr, struct pattern_t *pattern, unsigned int offsetx, unsigned int offsety) {
+	uint32_t width = png_get_image_width(png_ptr, info_ptr);
+	uint32_t height = png_get_image_height(png_ptr, info_ptr);
+	logmsg(LLVL_TRACE, "PNG %s samples with %d bits translated natively.", png_color_type_to_str(png_get_color_type(png_ptr, info_ptr)), png_get_bit_depth(png_ptr, info_ptr));
+
+	/* Color indices are only resolved once a sample value is first seen, so
+	 * that the pattern palette is in order of appearance (and only contains
+	 * colors that are actually used), just like with RGBA conversion */
+	uint32_t sample_colors[256];
+	png_build_sample_colors(png_ptr, info_ptr, sample_colors);
+	uint8_t color_index[256];
+	bool color_index_valid[256] = { false };
+
+	png_set_packing(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+	if ((png_get_bit_depth(png_ptr, info_ptr) != 8) || (png_get_channels(png_ptr, info_ptr) != 1)) {
+		logmsg(LLVL_WARN, "Unpacked PNG image does not have one 8 bit sample per pixel: channels = %d, bit_depth = %d", png_get_channels(png_ptr, info_ptr), png_get_bit_depth(png_ptr, info_ptr));
+		return false;
+	}
+
+	uint8_t samples[width];
+	uint8_t row[pattern->width];
+	memset(row, 0, sizeof(row));
+	for (uint32_t y = 0; y < height; y++) {
+		png_read_row(png_ptr, samples, NULL);
+		for (uint32_t x = 0; x < width; x++) {
+			uint8_t sample = samples[x];
+			if (!color_index_valid[sample]) {
+				color_index[sample] = pattern_rgba_to_color_index(pattern, sample_colors[sample]);
+				color_index_valid[sample] = true;
+			}
+			row[offsetx + x] = color_index[sample];
+		}
+		pattern_set_row(pattern, y + offsety, row);
+	}
+	return true;
+}
+
+struct pattern_t* png_read_pattern(struct membuf_t *membuf, unsigned int offsetx, unsigned int offsety) {
+	/* Modified after setjmp(), therefore must not be cached in a register */
+	struct pattern_t * volatile pattern = NULL;
+	struct pattern_t * volatile scratch = NULL;
+
+	png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		perror("png_create_read_struct");
+		return NULL;
+	}
+
+	png_infop info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, NULL, NULL);
+		perror("png_create_info_struct");
+		return NULL;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		/* Rows are decoded as they are read, so an error in the middle of the
+		 * image (e.g., truncated data) leaves a partial pattern behind */
+		logmsg(LLVL_WARN, "PNG data could not be decoded completely, discarding pattern.");
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		pattern_free(scratch);
 		pattern_free(pattern);
 		return NULL;
 	}
 
-	pixel_data = malloc(width * height * 4);
-	if (!pixel_data) {
-		logmsg(LLVL_ERROR, "Failed to allocate %d bytes for pixel data of PNG image.", width * height * 4);
+	/* Let libpng refuse oversized images while parsing the header already */
+	png_set_user_limits(png_ptr, MAX_PATTERN_WIDTH, pattern_get_max_height());
+
+	membuf_rewind(membuf);
+	png_set_read_fn(png_ptr, membuf, membuf_read_data_fn);
+	png_read_info(png_ptr, info_ptr);
+
+	uint32_t width = png_get_image_width(png_ptr, info_ptr);
+	uint32_t height = png_get_image_height(png_ptr, info_ptr);
+	logmsg(LLVL_DEBUG, "PNG decoded: %u x %u pixels", width, height);
+	if ((width + offsetx > MAX_PATTERN_WIDTH) || (height + offsety > pattern_get_max_height())) {
+		logmsg(LLVL_WARN, "Refusing to decode %u x %u PNG image at offset %u, %u, maximum pattern size is %u x %u.", width, height, offsetx, offsety, MAX_PATTERN_WIDTH, pattern_get_max_height());
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
-		pattern_free(pattern);
 		return NULL;
 	}
 
-	uint32_t *row_pointers[height];
-	for (int y = 0; y < height; y++) {
-		row_pointers[y] = pixel_data + (y * width);
+	pattern = pattern_new_deduplicated(width + offsetx, height + offsety);
+	if (!pattern) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		return NULL;
 	}
-	png_read_image(png_ptr, (uint8_t**)row_pointers);
 
-	for (int y = 0; y < height; y++) {
-		for (int x = 0; x < width; x++) {
-			uint32_t pixel_rgba = row_pointers[y][x];
-			pattern_set_rgba(pattern, x + offsetx, y + offsety, pixel_rgba);
+	if (png_get_interlace_type(png_ptr, info_ptr) != PNG_INTERLACE_NONE) {
+		scratch = pattern_new(width + offsetx, height + offsety);
+		if (!scratch) {
+			png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+			pattern_free(pattern);
+			return NULL;
 		}
 	}
 
-	free(pixel_data);
+	bool success;
+	if (png_has_native_samples(png_ptr, info_ptr)) {
+		success = png_read_native_rows(png_ptr, info_ptr, pattern, offsetx, offsety);
+	} else {
+		success = png_read_rgba_rows(png_ptr, info_ptr, pattern, scratch, offsetx, offsety);
+	}
+	pattern_free(scratch);
+	scratch = NULL;
+	if (!success) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		pattern_free(pattern);
+		return NULL;
+	}
+	png_read_end(png_ptr, NULL);
 
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 	return pattern;
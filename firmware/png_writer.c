@@ -28,8 +28,11 @@
 #include <string.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
+#include <zlib.h>
 #include <libpng16/png.h>
 #include "png_writer.h"
+#include "logging.h"
 
 static const uint32_t lookup_colors[] = {
 	MK_RGB(0x27, 0xae, 0x60),
@@ -41,6 +44,40 @@ static const uint32_t lookup_colors[] = {
 
 typedef uint32_t (*color_lookup_fnc)(const struct pattern_t *color, uint8_t color_index);
 
+struct png_encoder_settings_t {
+	const char *name;
+	bool libpng_defaults;
+	int compression_level;
+	int memory_level;
+	int strategy;
+	int filters;
+};
+
+/* Z_RLE is not used for "fast": pretty images repeat at a distance of one row
+ * or one stitch, which run length matching misses, making output many times
+ * larger and not even faster. Palette images are never filtered, as
+ * recommended by the PNG specification. */
+static const struct png_encoder_settings_t encoder_profiles[PNG_PROFILE_COUNT] = {
+	[PNG_PROFILE_DEFAULT] = {
+		.name = "default",
+		.libpng_defaults = true,
+	},
+	[PNG_PROFILE_FAST] = {
+		.name = "fast",
+		.compression_level = 1,
+		.memory_level = 8,
+		.strategy = Z_DEFAULT_STRATEGY,
+		.filters = PNG_FILTER_NONE,
+	},
+	[PNG_PROFILE_SMALL] = {
+		.name = "small",
+		.compression_level = 9,
+		.memory_level = 9,
+		.strategy = Z_DEFAULT_STRATEGY,
+		.filters = PNG_ALL_FILTERS,
+	},
+};
+
 struct png_write_file_ctx_t {
 	FILE *f;
 };
@@ -99,6 +136,35 @@ static color_lookup_fnc get_lookup_function(enum colorscheme_t colscheme) {
 }
 
 
+const struct png_write_options_t* png_write_default_options(void) {
+	return &default_write_options;
+}
+
+bool png_encoder_profile_parse(const char *name, enum png_encoder_profile_t *profile) {
+	for (unsigned int i = 0; i < PNG_PROFILE_COUNT; i++) {
+		if (!strcasecmp(encoder_profiles[i].name, name)) {
+			*profile = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+const char* png_encoder_profile_name(enum png_encoder_profile_t profile) {
+	return (profile < PNG_PROFILE_COUNT) ? encoder_profiles[profile].name : "?";
+}
+
+static void apply_encoder_settings(png_structp png_ptr, enum png_encoder_profile_t profile, bool indexed) {
+	const struct png_encoder_settings_t *settings = &encoder_profiles[(profile < PNG_PROFILE_COUNT) ? profile : PNG_PROFILE_DEFAULT];
+	if (settings->libpng_defaults) {
+		return;
+	}
+	png_set_compression_level(png_ptr, settings->compression_level);
+	png_set_compression_mem_level(png_ptr, settings->memory_level);
+	png_set_compression_strategy(png_ptr, settings->strategy);
+	png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, indexed ? PNG_FILTER_NONE : settings->filters);
+}
+
 static bool init_file_io(struct png_write_ctx_t *ctx, png_structp png_ptr) {
 	png_init_io(png_ptr, ctx->custom.file.f);
 	return true;
@@ -123,10 +189,134 @@ static bool init_mem_io(struct png_write_ctx_t *ctx, png_structp png_ptr) {
 	return true;
 }
 
-static bool png_write_pattern_generic(const struct pattern_t *pattern, struct png_write_ctx_t *ctx, const struct png_write_options_t *options) {
+/* Pattern colors mapped to the entries of a PNG palette. Colors that the color
+ * scheme renders identically share one entry. */
+struct png_palette_t {
+	unsigned int size;
+	png_color colors[256];
+	uint8_t alpha[256];
+	uint8_t entry[256];					/* Palette entry by pattern color index */
+	uint8_t grid_entry;
+};
+
+static int png_palette_find_or_add(struct png_palette_t *palette, uint32_t rgba) {
+	for (unsigned int i = 0; i < palette->size; i++) {
+		if ((palette->colors[i].red == PIXEL_GET_RED(rgba)) && (palette->colors[i].green == PIXEL_GET_GREEN(rgba)) && (palette->colors[i].blue == PIXEL_GET_BLUE(rgba)) && (palette->alpha[i] == PIXEL_GET_ALPHA(rgba))) {
+			return i;
+		}
+	}
+	if (palette->size == 256) {
+		return -1;
+	}
+	palette->colors[palette->size] = (png_color) {
+		.red = PIXEL_GET_RED(rgba),
+		.green = PIXEL_GET_GREEN(rgba),
+		.blue = PIXEL_GET_BLUE(rgba),
+	};
+	palette->alpha[palette->size] = PIXEL_GET_ALPHA(rgba);
+	return palette->size++;
+}
+
+/* Returns false if the pattern needs more than 256 palette entries with the
+ * chosen options, in which case it needs to be written as RGBA. */
+static bool png_build_palette(const struct pattern_t *pattern, const struct png_write_options_t *options, struct png_palette_t *palette) {
+	color_lookup_fnc color_lookup = get_lookup_function(options->color_scheme);
+	palette->size = 0;
+	palette->grid_entry = 0;
+	for (unsigned int color_index = 0; color_index <= pattern->used_colors; color_index++) {
+		int entry = png_palette_find_or_add(palette, color_lookup(pattern, color_index));
+		if (entry == -1) {
+			return false;
+		}
+		palette->entry[color_index] = entry;
+	}
+	if (options->grid_width) {
+		int entry = png_palette_find_or_add(palette, options->grid_color);
+		if (entry == -1) {
+			return false;
+		}
+		palette->grid_entry = entry;
+	}
+	return true;
+}
+
+static unsigned int png_palette_bit_depth(const struct png_palette_t *palette) {
+	unsigned int bit_depth = 1;
+	while ((1u << bit_depth) < palette->size) {
+		bit_depth *= 2;
+	}
+	return bit_depth;
+}
+
+/* Only tRNS entries up to the last translucent one need to be written */
+static unsigned int png_palette_trns_count(const struct png_palette_t *palette) {
+	unsigned int count = palette->size;
+	while ((count > 0) && (palette->alpha[count - 1] == 0xff)) {
+		count--;
+	}
+	return count;
+}
+
+static void render_index_row(const uint8_t *ptrn_row, const struct png_write_region_t *region, const struct png_write_options_t *options, const struct png_palette_t *palette, uint8_t *png_row) {
+	unsigned int png_x = 0;
+	for (unsigned int x = region->x; x < region->x + region->width; x++) {
+		if (x > 0) {
+			memset(png_row + png_x, palette->grid_entry, options->grid_width);
+			png_x += options->grid_width;
+		}
+		memset(png_row + png_x, palette->entry[ptrn_row[x]], options->pixel_width);
+		png_x += options->pixel_width;
+	}
+}
+
+/* Packs a row of one byte per pixel to bit_depth bits per pixel in place, the
+ * leftmost pixel in the most significant bits. */
+static void pack_index_row(uint8_t *row, unsigned int width, unsigned int bit_depth) {
+	if (bit_depth == 8) {
+		return;
+	}
+	unsigned int pixels_per_byte = 8 / bit_depth;
+	unsigned int packed_length = (width + pixels_per_byte - 1) / pixels_per_byte;
+	for (unsigned int i = 0; i < packed_length; i++) {
+		uint8_t packed = 0;
+		for (unsigned int j = 0; j < pixels_per_byte; j++) {
+			unsigned int x = (i * pixels_per_byte) + j;
+			packed = (packed << bit_depth) | ((x < width) ? row[x] : 0);
+		}
+		row[i] = packed;
+	}
+}
+
+static void render_rgba_row(const uint8_t *ptrn_row, const struct png_write_region_t *region, const struct png_write_options_t *options, const uint32_t rgba[static 256], uint32_t *png_row) {
+	unsigned int png_x = 0;
+	for (unsigned int x = region->x; x < region->x + region->width; x++) {
+		if (x > 0) {
+			for (unsigned int rptx = 0; rptx < options->grid_width; rptx++) {
+				png_row[png_x++] = options->grid_color;
+			}
+		}
+		uint32_t color = rgba[ptrn_row[x]];
+		for (unsigned int rptx = 0; rptx < options->pixel_width; rptx++) {
+			png_row[png_x++] = color;
+		}
+	}
+}
+
+static bool png_write_pattern_generic(const struct pattern_t *pattern, struct png_write_ctx_t *ctx, const struct png_write_options_t *options, const struct png_write_region_t *region) {
 	if (options == NULL) {
 		options = &default_write_options;
 	}
+	const struct png_write_region_t full_region = {
+		.width = pattern->width,
+		.height = pattern->height,
+	};
+	if (region == NULL) {
+		region = &full_region;
+	}
+	if ((region->width == 0) || (region->height == 0) || (region->x + region->width > pattern->width) || (region->y + region->height > pattern->height)) {
+		logmsg(LLVL_WARN, "Cannot write %u x %u region at %u, %u of %u x %u pattern.", region->width, region->height, region->x, region->y, pattern->width, pattern->height);
+		return false;
+	}
 
 	png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	if (!png_ptr) {
@@ -148,49 +338,72 @@ static bool png_write_pattern_generic(const struct pattern_t *pattern, struct pn
 		return false;
 	}
 
-	int width = (pattern->width * options->pixel_width) + ((pattern->width - 1) * options->grid_width);
-	int height = (pattern->height * options->pixel_height) + ((pattern->height - 1) * options->grid_width);
-	png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	/* Colors are looked up once per pattern color, not per pixel. Output is
+	 * indexed unless the color scheme yields more than 256 distinct colors. */
+	struct png_palette_t palette;
+	uint32_t rgba[256];
+	bool indexed = png_build_palette(pattern, options, &palette);
+	if (!indexed) {
+		color_lookup_fnc color_lookup = get_lookup_function(options->color_scheme);
+		for (unsigned int color_index = 0; color_index <= pattern->used_colors; color_index++) {
+			rgba[color_index] = color_lookup(pattern, color_index);
+		}
+	}
+
+	int width = (region->width * options->pixel_width) + ((region->width - 1) * options->grid_width) + ((region->x > 0) ? options->grid_width : 0);
+	int height = (region->height * options->pixel_height) + ((region->height - 1) * options->grid_width) + ((region->y > 0) ? options->grid_width : 0);
+	if (indexed) {
+		png_set_IHDR(png_ptr, info_ptr, width, height, png_palette_bit_depth(&palette), PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+		png_set_PLTE(png_ptr, info_ptr, palette.colors, palette.size);
+		unsigned int trns_count = png_palette_trns_count(&palette);
+		if (trns_count) {
+			png_set_tRNS(png_ptr, info_ptr, palette.alpha, trns_count, NULL);
+		}
+	} else {
+		png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	}
+	apply_encoder_settings(png_ptr, options->profile, indexed);
 	png_write_info(png_ptr, info_ptr);
 	png_destroy_info_struct(png_ptr, &info_ptr);
 
-	color_lookup_fnc color_lookup = get_lookup_function(options->color_scheme);
-	for (int y = 0; y < pattern->height; y++) {
-		uint32_t png_row[width];
-		memset(png_row, 0, sizeof(png_row));
-
-		const uint8_t *ptrn_row = pattern_row(pattern, y);
-
-		/* Write rows of pixels */
-		for (int rpty = 0; rpty < options->pixel_height; rpty++) {
-			/* Write color pixels */
-			for (int x = 0; x < pattern->width; x++) {
-				uint8_t pixel = ptrn_row[x];
-				uint32_t color = color_lookup(pattern, pixel);
-				for (int rptx = 0; rptx < options->pixel_width; rptx++) {
-					png_row[(x * options->pixel_width) + (x * options->grid_width) + rptx] = color;
-				}
-			}
-			/* Write grid pixels */
-			for (int x = 1; x < pattern->width; x++) {
-				for (int rptx = 0; rptx < options->grid_width; rptx++) {
-					png_row[(x * options->pixel_width) + ((x - 1) * options->grid_width) + rptx] = options->grid_color;
-				}
-
+	unsigned int bytes_per_pixel = indexed ? 1 : 4;
+	uint32_t png_row[((width * bytes_per_pixel) + 3) / 4];
+	uint32_t grid_row[((width * bytes_per_pixel) + 3) / 4];
+	if (indexed) {
+		memset(grid_row, palette.grid_entry, width);
+		pack_index_row((uint8_t*)grid_row, width, png_palette_bit_depth(&palette));
+	} else {
+		for (int x = 0; x < width; x++) {
+			grid_row[x] = options->grid_color;
+		}
+	}
+	uint8_t row_buffer[pattern->width];
+	int previous_row_id = -1;
+	for (unsigned int y = region->y; y < region->y + region->height; y++) {
+		/* Write grid rows */
+		if (y > 0) {
+			for (int rpty = 0; rpty < options->grid_width; rpty++) {
+				png_write_row(png_ptr, (uint8_t*)grid_row);
 			}
-			png_write_row(png_ptr, (uint8_t*)png_row);
 		}
 
-		/* Write grid row */
-		if (y != (pattern->height - 1)) {
-			/* Write grid rows */
-			for (int x = 0; x < width; x++) {
-				png_row[x] = options->grid_color;
+		/* Rows of deduplicated patterns that are identical to their
+		 * predecessor do not need to be rendered again */
+		int row_id = pattern_get_row_id(pattern, y);
+		if ((row_id == -1) || (row_id != previous_row_id)) {
+			const uint8_t *ptrn_row = pattern_get_row(pattern, y, row_buffer);
+			if (indexed) {
+				render_index_row(ptrn_row, region, options, &palette, (uint8_t*)png_row);
+				pack_index_row((uint8_t*)png_row, width, png_palette_bit_depth(&palette));
+			} else {
+				render_rgba_row(ptrn_row, region, options, rgba, png_row);
 			}
+			previous_row_id = row_id;
+		}
 
-			for (int rpty = 0; rpty < options->grid_width; rpty++) {
-				png_write_row(png_ptr, (uint8_t*)png_row);
-			}
+		/* Write rows of pixels */
+		for (int rpty = 0; rpty < options->pixel_height; rpty++) {
+			png_write_row(png_ptr, (uint8_t*)png_row);
 		}
 	}
 	png_write_end(png_ptr, NULL);
@@ -210,13 +423,15 @@ bool png_write_pattern(const struct pattern_t *pattern, const char *filename, co
 		return false;
 	}
 
-	bool success = png_write_pattern_generic(pattern, &ctx, options);
+	bool success = png_write_pattern_generic(pattern, &ctx, options, NULL);
 
 	fclose(ctx.custom.file.f);
 	return success;
 }
 
-bool png_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *membuf, const struct png_write_options_t *options) {
+/* Writes only the given region of the pattern. Images of adjacent regions can
+ * be put together to form the image of the whole pattern. */
+bool png_write_pattern_region_mem(const struct pattern_t *pattern, struct membuf_t *membuf, const struct png_write_options_t *options, const struct png_write_region_t *region) {
 	struct png_write_ctx_t ctx = {
 		.init_io_callback = init_mem_io,
 		.custom.mem = {
@@ -225,7 +440,11 @@ bool png_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *mem
 		},
 	};
 
-	bool success = png_write_pattern_generic(pattern, &ctx, options);
+	bool success = png_write_pattern_generic(pattern, &ctx, options, region);
 
 	return success && ctx.custom.mem.success;
 }
+
+bool png_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *membuf, const struct png_write_options_t *options) {
+	return png_write_pattern_region_mem(pattern, membuf, options, NULL);
+}
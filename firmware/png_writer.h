@@ -34,15 +34,36 @@ enum colorscheme_t {
 	COLSCHEME_PRETTY,
 };
 
+/* Trade-off between encoding time and size: "fast" for previews that only
+ * travel over the local socket, "small" for downloads. */
+enum png_encoder_profile_t {
+	PNG_PROFILE_DEFAULT,
+	PNG_PROFILE_FAST,
+	PNG_PROFILE_SMALL,
+	PNG_PROFILE_COUNT,
+};
+
 struct png_write_options_t {
 	unsigned int pixel_width, pixel_height;
 	unsigned int grid_width;
 	uint32_t grid_color;
 	enum colorscheme_t color_scheme;
+	enum png_encoder_profile_t profile;
+};
+
+/* Part of a pattern, in stitches. Regions that do not start at the pattern
+ * origin include the grid line left of and above their first stitch. */
+struct png_write_region_t {
+	unsigned int x, y;
+	unsigned int width, height;
 };
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
+const struct png_write_options_t* png_write_default_options(void);
+bool png_encoder_profile_parse(const char *name, enum png_encoder_profile_t *profile);
+const char* png_encoder_profile_name(enum png_encoder_profile_t profile);
 bool png_write_pattern(const struct pattern_t *pattern, const char *filename, const struct png_write_options_t *options);
+bool png_write_pattern_region_mem(const struct pattern_t *pattern, struct membuf_t *membuf, const struct png_write_options_t *options, const struct png_write_region_t *region);
 bool png_write_pattern_mem(const struct pattern_t *pattern, struct membuf_t *membuf, const struct png_write_options_t *options);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -0,0 +1,323 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include "preview.h"
+#include "png_writer.h"
+#include "logging.h"
+
+struct preview_zoom_level_t {
+	unsigned int pixel_size;
+	unsigned int grid_width;
+	unsigned int tile_stitches;			/* Tiles are square */
+};
+
+/* Tiles are roughly 256 pixels wide at every zoom level; level 2 corresponds
+ * to the pretty image of the whole pattern. */
+static const struct preview_zoom_level_t zoom_levels[PREVIEW_ZOOM_LEVELS] = {
+	{ .pixel_size = 1, .grid_width = 0, .tile_stitches = 256 },
+	{ .pixel_size = 2, .grid_width = 0, .tile_stitches = 128 },
+	{ .pixel_size = 4, .grid_width = 1, .tile_stitches = 64 },
+	{ .pixel_size = 8, .grid_width = 1, .tile_stitches = 32 },
+};
+
+struct preview_render_job_t {
+	const struct pattern_t *pattern;
+	struct png_write_options_t options;
+	unsigned int tile_stitches;
+	struct preview_tile_t **tiles;
+	bool *rendered;
+	unsigned int tile_count;
+	atomic_uint next_tile;
+};
+
+unsigned int preview_tile_stitches(unsigned int zoom) {
+	return (zoom < PREVIEW_ZOOM_LEVELS) ? zoom_levels[zoom].tile_stitches : 0;
+}
+
+/* Distance in pixels between the left edges of adjacent stitches. Tiles
+ * other than the first one in a row or column start with the grid line that
+ * separates them from their predecessor, so that they can be placed next to
+ * each other without a gap. */
+unsigned int preview_stitch_pitch(unsigned int zoom) {
+	return (zoom < PREVIEW_ZOOM_LEVELS) ? (zoom_levels[zoom].pixel_size + zoom_levels[zoom].grid_width) : 0;
+}
+
+unsigned int preview_grid_width(unsigned int zoom) {
+	return (zoom < PREVIEW_ZOOM_LEVELS) ? zoom_levels[zoom].grid_width : 0;
+}
+
+bool preview_tile_exists(const struct pattern_t *pattern, unsigned int zoom, unsigned int tile_x, unsigned int tile_y) {
+	if (zoom >= PREVIEW_ZOOM_LEVELS) {
+		return false;
+	}
+	unsigned int tile_stitches = zoom_levels[zoom].tile_stitches;
+	return (tile_x < (pattern->width + tile_stitches - 1) / tile_stitches) && (tile_y < (pattern->height + tile_stitches - 1) / tile_stitches);
+}
+
+static size_t preview_tile_memory_size(const struct preview_tile_t *tile) {
+	return sizeof(struct preview_tile_t) + tile->png.length;
+}
+
+static void preview_unlink(struct preview_t *preview, struct preview_tile_t *tile) {
+	if (tile->prev) {
+		tile->prev->next = tile->next;
+	} else {
+		preview->head = tile->next;
+	}
+	if (tile->next) {
+		tile->next->prev = tile->prev;
+	} else {
+		preview->tail = tile->prev;
+	}
+	tile->prev = NULL;
+	tile->next = NULL;
+}
+
+static void preview_push_front(struct preview_t *preview, struct preview_tile_t *tile) {
+	tile->next = preview->head;
+	if (preview->head) {
+		preview->head->prev = tile;
+	} else {
+		preview->tail = tile;
+	}
+	preview->head = tile;
+}
+
+static void preview_free_tile(struct preview_tile_t *tile) {
+	membuf_free(&tile->png);
+	free(tile);
+}
+
+static void preview_evict(struct preview_t *preview, struct preview_tile_t *tile) {
+	struct preview_level_t *level = &preview->level[tile->zoom];
+	preview_unlink(preview, tile);
+	level->tiles[(tile->tile_y * level->tiles_x) + tile->tile_x] = NULL;
+	preview->memory_used -= preview_tile_memory_size(tile);
+	preview_free_tile(tile);
+}
+
+/* Discards all rendered tiles. Tiles that are still being rendered belong to
+ * whoever renders them and are dropped once they are done. */
+static void preview_reset(struct preview_t *preview, uint32_t pattern_version) {
+	while (preview->head) {
+		preview_evict(preview, preview->head);
+	}
+	for (unsigned int i = 0; i < PREVIEW_ZOOM_LEVELS; i++) {
+		free(preview->level[i].tiles);
+		memset(&preview->level[i], 0, sizeof(struct preview_level_t));
+	}
+	preview->pattern_version = pattern_version;
+}
+
+static bool preview_alloc_level(const struct pattern_t *pattern, unsigned int zoom, struct preview_level_t *level) {
+	if (level->tiles) {
+		return true;
+	}
+	const struct preview_zoom_level_t *zoom_level = &zoom_levels[zoom];
+	unsigned int tiles_x = (pattern->width + zoom_level->tile_stitches - 1) / zoom_level->tile_stitches;
+	unsigned int tiles_y = (pattern->height + zoom_level->tile_stitches - 1) / zoom_level->tile_stitches;
+	level->tiles = calloc(tiles_x * tiles_y, sizeof(struct preview_tile_t*));
+	if (!level->tiles) {
+		logmsg(LLVL_ERROR, "Unable to allocate %u x %u preview tiles.", tiles_x, tiles_y);
+		return false;
+	}
+	level->tiles_x = tiles_x;
+	level->tiles_y = tiles_y;
+	return true;
+}
+
+/* Marks a tile that is not cached as being rendered by the caller. */
+static struct preview_tile_t* preview_claim_tile(struct preview_level_t *level, unsigned int zoom, unsigned int tile_x, unsigned int tile_y) {
+	struct preview_tile_t *tile = calloc(1, sizeof(struct preview_tile_t));
+	if (!tile) {
+		perror("calloc preview tile");
+		return NULL;
+	}
+	tile->zoom = zoom;
+	tile->tile_x = tile_x;
+	tile->tile_y = tile_y;
+	level->tiles[(tile_y * level->tiles_x) + tile_x] = tile;
+	return tile;
+}
+
+/* Workers take the next tile that nobody works on until all are done */
+static void* preview_render_thread(void *vjob) {
+	struct preview_render_job_t *job = (struct preview_render_job_t*)vjob;
+	unsigned int i;
+	while ((i = atomic_fetch_add(&job->next_tile, 1)) < job->tile_count) {
+		const struct preview_tile_t *tile = job->tiles[i];
+		struct png_write_region_t region = {
+			.x = tile->tile_x * job->tile_stitches,
+			.y = tile->tile_y * job->tile_stitches,
+		};
+		region.width = ((region.x + job->tile_stitches) <= job->pattern->width) ? job->tile_stitches : (job->pattern->width - region.x);
+		region.height = ((region.y + job->tile_stitches) <= job->pattern->height) ? job->tile_stitches : (job->pattern->height - region.y);
+		job->rendered[i] = png_write_pattern_region_mem(job->pattern, &job->tiles[i]->png, &job->options, &region);
+	}
+	return NULL;
+}
+
+static void preview_render_tiles(const struct pattern_t *pattern, unsigned int zoom, struct preview_tile_t **tiles, bool *rendered, unsigned int tile_count) {
+	const struct preview_zoom_level_t *zoom_level = &zoom_levels[zoom];
+	struct preview_render_job_t job = {
+		.pattern = pattern,
+		.options = *png_write_default_options(),
+		.tile_stitches = zoom_level->tile_stitches,
+		.tiles = tiles,
+		.rendered = rendered,
+		.tile_count = tile_count,
+	};
+	job.options.pixel_width = zoom_level->pixel_size;
+	job.options.pixel_height = zoom_level->pixel_size;
+	job.options.grid_width = zoom_level->grid_width;
+	job.options.profile = PNG_PROFILE_FAST;
+
+	/* The calling thread is one of the workers */
+	long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned int thread_count = (cpu_count > 1) ? cpu_count : 1;
+	if (thread_count > tile_count) {
+		thread_count = tile_count;
+	}
+	pthread_t threads[thread_count];
+	unsigned int started_threads = 0;
+	pthread_attr_t attrs;
+	if (pthread_attr_init(&attrs)) {
+		perror("pthread_attr_init");
+	} else {
+		if (pthread_attr_setstacksize(&attrs, PREVIEW_RENDER_THREAD_STACK_SIZE)) {
+			perror("pthread_attr_setstacksize");
+			thread_count = 1;
+		}
+		for (unsigned int i = 1; i < thread_count; i++) {
+			if (pthread_create(&threads[started_threads], &attrs, preview_render_thread, &job)) {
+				logmsg(LLVL_WARN, "Unable to start preview render thread, rendering with %u thread(s).", started_threads + 1);
+				break;
+			}
+			started_threads++;
+		}
+		pthread_attr_destroy(&attrs);
+	}
+	preview_render_thread(&job);
+	for (unsigned int i = 0; i < started_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	logmsg(LLVL_TRACE, "Rendered %u preview tile(s) at zoom level %u with %u thread(s).", tile_count, zoom, started_threads + 1);
+}
+
+/* Appends the given tile of the pattern, which must be the one of the given
+ * pattern version and must remain valid during the call; callers hold a
+ * reference to it instead of staying in the snapshot read section. The tile
+ * must exist. Unless it is cached, it is rendered along with the neighbors
+ * that are not cached either, without holding the lock so that other tiles
+ * can be served meanwhile. */
+bool preview_get_tile(struct preview_t *preview, const struct pattern_t *pattern, uint32_t pattern_version, unsigned int zoom, unsigned int tile_x, unsigned int tile_y, struct membuf_t *membuf) {
+	const int radius = PREVIEW_PREFETCH_RADIUS;
+	struct preview_tile_t *claimed[(2 * radius + 1) * (2 * radius + 1)];
+	bool rendered[(2 * radius + 1) * (2 * radius + 1)];
+	bool success;
+
+	pthread_mutex_lock(&preview->lock);
+	while (true) {
+		if (preview->pattern_version != pattern_version) {
+			preview_reset(preview, pattern_version);
+		}
+		struct preview_level_t *level = &preview->level[zoom];
+		if (!preview_alloc_level(pattern, zoom, level)) {
+			success = false;
+			break;
+		}
+
+		struct preview_tile_t *tile = level->tiles[(tile_y * level->tiles_x) + tile_x];
+		if (tile && tile->rendered) {
+			preview_unlink(preview, tile);
+			preview_push_front(preview, tile);
+			success = membuf_append(membuf, tile->png.data, tile->png.length);
+			break;
+		} else if (tile) {
+			/* Another client is rendering it right now, wait for it */
+			pthread_cond_wait(&preview->tile_rendered, &preview->lock);
+			continue;
+		}
+
+		/* The requested tile comes first so that it is rendered first */
+		unsigned int claim_count = 0;
+		claimed[claim_count] = preview_claim_tile(level, zoom, tile_x, tile_y);
+		if (!claimed[claim_count]) {
+			success = false;
+			break;
+		}
+		claim_count++;
+		for (int dy = -radius; dy <= radius; dy++) {
+			for (int dx = -radius; dx <= radius; dx++) {
+				int x = (int)tile_x + dx;
+				int y = (int)tile_y + dy;
+				if ((x < 0) || (y < 0) || (x >= (int)level->tiles_x) || (y >= (int)level->tiles_y) || level->tiles[(y * level->tiles_x) + x]) {
+					continue;
+				}
+				if ((claimed[claim_count] = preview_claim_tile(level, zoom, x, y))) {
+					claim_count++;
+				}
+			}
+		}
+		pthread_mutex_unlock(&preview->lock);
+		preview_render_tiles(pattern, zoom, claimed, rendered, claim_count);
+		pthread_mutex_lock(&preview->lock);
+
+		success = rendered[0] && membuf_append(membuf, claimed[0]->png.data, claimed[0]->png.length);
+
+		/* Tiles are only kept if the pattern has not been replaced meanwhile */
+		for (unsigned int i = 0; i < claim_count; i++) {
+			tile = claimed[i];
+			struct preview_tile_t **slot = ((preview->pattern_version == pattern_version) && level->tiles) ? &level->tiles[(tile->tile_y * level->tiles_x) + tile->tile_x] : NULL;
+			if (slot && (*slot == tile) && rendered[i]) {
+				tile->rendered = true;
+				preview_push_front(preview, tile);
+				preview->memory_used += preview_tile_memory_size(tile);
+			} else {
+				if (slot && (*slot == tile)) {
+					*slot = NULL;
+				}
+				preview_free_tile(tile);
+			}
+		}
+		while (preview->tail && (preview->memory_used > preview->memory_budget)) {
+			preview_evict(preview, preview->tail);
+		}
+		pthread_cond_broadcast(&preview->tile_rendered);
+		break;
+	}
+	pthread_mutex_unlock(&preview->lock);
+	return success;
+}
+
+/* Discards all tiles, needs to be called when the pattern is replaced. */
+void preview_clear(struct preview_t *preview) {
+	pthread_mutex_lock(&preview->lock);
+	preview_reset(preview, 0);
+	pthread_mutex_unlock(&preview->lock);
+}
@@ -0,0 +1,88 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __PREVIEW_H__
+#define __PREVIEW_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "pattern.h"
+#include "membuf.h"
+
+#define PREVIEW_ZOOM_LEVELS			4
+
+/* Render threads only need room for a few tile rows on their stack; with
+ * mlockall() in real-time mode, their whole stack would otherwise be pinned */
+#define PREVIEW_RENDER_THREAD_STACK_SIZE	(256 * 1024)
+
+/* Memory budget for encoded tiles across all zoom levels */
+#define PREVIEW_CACHE_BYTES			(8 * 1024 * 1024)
+
+/* Tiles up to this many tiles away from a requested one are rendered along
+ * with it, in anticipation of the client scrolling there next */
+#define PREVIEW_PREFETCH_RADIUS		1
+
+struct preview_tile_t {
+	struct preview_tile_t *prev, *next;	/* Only linked once rendered */
+	unsigned int zoom, tile_x, tile_y;
+	bool rendered;						/* Otherwise still being rendered */
+	struct membuf_t png;
+};
+
+struct preview_level_t {
+	unsigned int tiles_x, tiles_y;
+	struct preview_tile_t **tiles;		/* Row by row, NULL if not cached */
+};
+
+/* Pretty renditions of the current pattern at several zoom levels, split into
+ * tiles so that clients can fetch only the part of a large pattern they show.
+ * Tiles are rendered on demand, together with their neighbors, with the work
+ * spread across all processor cores. They are kept for as long as the pattern
+ * version they were rendered from is current and are evicted least recently
+ * used first once they exceed the memory budget. */
+struct preview_t {
+	pthread_mutex_t lock;
+	pthread_cond_t tile_rendered;
+	uint32_t pattern_version;
+	struct preview_level_t level[PREVIEW_ZOOM_LEVELS];
+	struct preview_tile_t *head, *tail;	/* Most recently used first */
+	size_t memory_budget, memory_used;
+};
+
+#define PREVIEW_INITIALIZER			{			\
+	.lock = PTHREAD_MUTEX_INITIALIZER,			\
+	.tile_rendered = PTHREAD_COND_INITIALIZER,	\
+	.memory_budget = PREVIEW_CACHE_BYTES,		\
+}
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+unsigned int preview_tile_stitches(unsigned int zoom);
+unsigned int preview_stitch_pitch(unsigned int zoom);
+unsigned int preview_grid_width(unsigned int zoom);
+bool preview_tile_exists(const struct pattern_t *pattern, unsigned int zoom, unsigned int tile_x, unsigned int tile_y);
+bool preview_get_tile(struct preview_t *preview, const struct pattern_t *pattern, uint32_t pattern_version, unsigned int zoom, unsigned int tile_x, unsigned int tile_y, struct membuf_t *membuf);
+void preview_clear(struct preview_t *preview);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
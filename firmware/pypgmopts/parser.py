@@ -3,5 +3,15 @@ parser = argparse.ArgumentParser(prog = "knitserver", description = "Brother KH-
 parser.add_argument("--quit", action = "store_true", help = "Quit after handling a single connection.")
 parser.add_argument("-f", "--force", action = "store_true", help = "Erase the socket if it already exists.")
 parser.add_argument("--no-hardware", action = "store_true", help = "Do not initialize actual hardware. Used for debugging purposes only.")
+parser.add_argument("--realtime", action = "store_true", help = "Run GPIO and actuation threads with SCHED_FIFO priority pinned to a dedicated CPU core and lock all memory. Requires CAP_SYS_NICE and CAP_IPC_LOCK.")
+parser.add_argument("--rt-cpu", metavar = "cpu", type = int, default = 3, help = "CPU core that real-time threads are pinned to. Defaults to %(default)d.")
+parser.add_argument("--rt-priority", metavar = "prio", type = int, default = 80, help = "SCHED_FIFO priority of real-time threads. Defaults to %(default)d.")
+parser.add_argument("--predict-lead", metavar = "us", type = int, default = 0, help = "Latch the solenoid word for the next needle position this many microseconds before the carriage is predicted to arrive there. Compensates for SPI and scheduling latency. Disabled by default.")
+parser.add_argument("--latch-phase", metavar = "steps", type = int, default = 0, help = "Latch the solenoid word for the next needle position this many quadrature steps (0-3) before the carriage reaches it. Defaults to %(default)d, i.e., latch only once the needle position is reached.")
+parser.add_argument("--max-height", metavar = "rows", type = int, default = 1000, help = "Maximum height of patterns in rows. Defaults to %(default)d.")
+parser.add_argument("--pattern-storage", metavar = "path", type = str, default = "/var/tmp", help = "Directory in which the row storage of large patterns is memory mapped. Should not be on a RAM-backed file system. Defaults to %(default)s.")
+parser.add_argument("--state-file", metavar = "path", type = str, help = "Persist pattern and knitting progress in this file (and the pattern next to it) and restore them on startup, so that knitting can resume after a restart. Disabled by default.")
+parser.add_argument("--pattern-cache", metavar = "kib", type = int, default = 4096, help = "Memory budget in kiB for keeping decoded patterns of recent uploads, so that uploading the same image again does not decode it again. 0 disables the cache. Defaults to %(default)d kiB.")
+parser.add_argument("--no-row-dedup", action = "store_true", help = "Store uploaded patterns with one row of pixel data per pattern row instead of deduplicating identical rows.")
 parser.add_argument("-v", "--verbose", action = "count", default = 0, help = "Increase verbosity. Can be specified multiple times.")
 parser.add_argument("unix_socket", metavar = "socket", type = str, help = "UNIX socket that the KnitPi knitting server listens on.")
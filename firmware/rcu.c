@@ -0,0 +1,71 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "rcu.h"
+
+/* Slot of the outermost read-side section of this thread. Nested sections
+ * (also of other RCU instances) are counted in the same slot, so that they
+ * are balanced regardless of epoch flips in between. */
+static _Thread_local unsigned int read_depth;
+static _Thread_local unsigned int read_slot;
+
+void rcu_read_lock(struct rcu_t *rcu) {
+	if (read_depth++ == 0) {
+		read_slot = atomic_load(&rcu->epoch) & 1;
+	}
+	atomic_fetch_add(&rcu->readers[read_slot], 1);
+}
+
+void rcu_read_unlock(struct rcu_t *rcu) {
+	atomic_fetch_sub(&rcu->readers[read_slot], 1);
+	read_depth--;
+}
+
+void rcu_write_lock(struct rcu_t *rcu) {
+	pthread_mutex_lock(&rcu->writer_mutex);
+}
+
+void rcu_write_unlock(struct rcu_t *rcu) {
+	pthread_mutex_unlock(&rcu->writer_mutex);
+}
+
+void rcu_synchronize(struct rcu_t *rcu) {
+	/* Any reader that could still see the old pointer must have entered its
+	 * read-side section before the new pointer was published. After flipping
+	 * the epoch, new readers are counted in the other slot, so only those that
+	 * were already active need to drain. A reader that sampled the epoch just
+	 * before the flip may still enter the old slot afterwards; flipping twice
+	 * and waiting for both slots catches it. Read sections are short, so
+	 * spinning politely is fine. */
+	pthread_mutex_lock(&rcu->synchronize_mutex);
+	for (unsigned int i = 0; i < 2; i++) {
+		unsigned int old_slot = atomic_fetch_xor(&rcu->epoch, 1) & 1;
+		while (atomic_load(&rcu->readers[old_slot]) != 0) {
+			sched_yield();
+		}
+	}
+	pthread_mutex_unlock(&rcu->synchronize_mutex);
+}
@@ -0,0 +1,58 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __RCU_H__
+#define __RCU_H__
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Minimal read-copy-update primitive: readers announce themselves with a
+ * single atomic increment of the counter of the current epoch and never block.
+ * Writers are serialized by a mutex and, after publishing a new pointer, wait
+ * for a grace period (i.e., until all readers that were active at the time of
+ * publishing are done) before reclaiming the old data. Readers that start
+ * later are counted in the other epoch and do not delay the writer. */
+struct rcu_t {
+	atomic_uint epoch;
+	atomic_uint readers[2];
+	pthread_mutex_t writer_mutex;
+	pthread_mutex_t synchronize_mutex;
+};
+
+#define RCU_INITIALIZER		{							\
+	.epoch = ATOMIC_VAR_INIT(0),						\
+	.readers = { ATOMIC_VAR_INIT(0), ATOMIC_VAR_INIT(0) },	\
+	.writer_mutex = PTHREAD_MUTEX_INITIALIZER,			\
+	.synchronize_mutex = PTHREAD_MUTEX_INITIALIZER,		\
+}
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+void rcu_read_lock(struct rcu_t *rcu);
+void rcu_read_unlock(struct rcu_t *rcu);
+void rcu_write_lock(struct rcu_t *rcu);
+void rcu_write_unlock(struct rcu_t *rcu);
+void rcu_synchronize(struct rcu_t *rcu);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
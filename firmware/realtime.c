@@ -0,0 +1,212 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <malloc.h>
+#include <sys/mman.h>
+#include "realtime.h"
+#include "logging.h"
+
+struct realtime_thread_start_t {
+	thread_function_t thread_fnc;
+	void *argument;
+	const char *name;
+};
+
+static struct realtime_config_t realtime_config;
+
+static void prefault_stack(void) {
+	volatile uint8_t stack[REALTIME_PREFAULT_STACK_BYTES];
+	for (unsigned int i = 0; i < sizeof(stack); i += 4096) {
+		stack[i] = 0;
+	}
+}
+
+static int get_locked_memory_kib(void) {
+	FILE *f = fopen("/proc/self/status", "r");
+	if (!f) {
+		return -1;
+	}
+	int locked_kib = -1;
+	char line[128];
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "VmLck: %d kB", &locked_kib) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return locked_kib;
+}
+
+bool realtime_init(const struct realtime_config_t *config) {
+	realtime_config = *config;
+	if (!realtime_config.enabled) {
+		return true;
+	}
+
+	long cpu_count = sysconf(_SC_NPROCESSORS_CONF);
+	if ((realtime_config.cpu < 0) || (realtime_config.cpu >= cpu_count) || (realtime_config.cpu >= CPU_SETSIZE)) {
+		logmsg(LLVL_ERROR, "Real-time CPU core %d does not exist, system has %ld cores.", realtime_config.cpu, cpu_count);
+		return false;
+	}
+
+	int min_priority = sched_get_priority_min(SCHED_FIFO);
+	int max_priority = sched_get_priority_max(SCHED_FIFO);
+	if ((realtime_config.priority < min_priority) || (realtime_config.priority > max_priority)) {
+		logmsg(LLVL_ERROR, "Real-time priority %d outside of valid SCHED_FIFO range %d to %d.", realtime_config.priority, min_priority, max_priority);
+		return false;
+	}
+
+	/* Never give heap memory back to the kernel and never satisfy allocations
+	 * with fresh mmap()s; once locked, memory stays resident. */
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+	if (mlockall(MCL_CURRENT | MCL_FUTURE)) {
+		logmsg(LLVL_ERROR, "Unable to lock memory: %s", strerror(errno));
+		return false;
+	}
+	prefault_stack();
+
+	logmsg(LLVL_INFO, "Real-time mode: memory locked (%d kiB resident), threads use SCHED_FIFO priority %d on CPU %d.", get_locked_memory_kib(), realtime_config.priority, realtime_config.cpu);
+	return true;
+}
+
+bool realtime_enabled(void) {
+	return realtime_config.enabled;
+}
+
+static bool verify_realtime_thread(const char *name) {
+	int policy;
+	struct sched_param param;
+	if (pthread_getschedparam(pthread_self(), &policy, &param)) {
+		logmsg(LLVL_ERROR, "%s: cannot query scheduling parameters.", name);
+		return false;
+	}
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	if (pthread_getaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+		logmsg(LLVL_ERROR, "%s: cannot query CPU affinity.", name);
+		return false;
+	}
+
+	if ((policy != SCHED_FIFO) || (param.sched_priority != realtime_config.priority)) {
+		logmsg(LLVL_ERROR, "%s: expected SCHED_FIFO priority %d, but running with policy %d priority %d.", name, realtime_config.priority, policy, param.sched_priority);
+		return false;
+	}
+	if ((CPU_COUNT(&cpuset) != 1) || !CPU_ISSET(realtime_config.cpu, &cpuset)) {
+		logmsg(LLVL_ERROR, "%s: expected to be pinned to CPU %d, but affinity allows %d cores.", name, realtime_config.cpu, CPU_COUNT(&cpuset));
+		return false;
+	}
+
+	logmsg(LLVL_INFO, "%s: running with SCHED_FIFO priority %d pinned to CPU %d (currently on CPU %d).", name, param.sched_priority, realtime_config.cpu, sched_getcpu());
+	return true;
+}
+
+static void* realtime_thread_body(void *vstart) {
+	struct realtime_thread_start_t start = *((struct realtime_thread_start_t*)vstart);
+	free(vstart);
+
+	pthread_setname_np(pthread_self(), start.name);
+	prefault_stack();
+	if (!verify_realtime_thread(start.name)) {
+		logmsg(LLVL_FATAL, "%s: real-time settings could not be verified, refusing to run with unpredictable timing.", start.name);
+		exit(EXIT_FAILURE);
+	}
+	return start.thread_fnc(start.argument);
+}
+
+/* Falls back to a regular detached thread when real-time mode is not enabled.
+ * Otherwise, the thread is created with its scheduling policy and CPU affinity
+ * already set (it never runs a single instruction with normal priority) and
+ * verifies them before entering the actual thread function. */
+bool start_realtime_thread(thread_function_t thread_fnc, void *argument, const char *name) {
+	if (!realtime_config.enabled) {
+		return start_detached_thread(thread_fnc, argument);
+	}
+
+	struct realtime_thread_start_t *start = malloc(sizeof(struct realtime_thread_start_t));
+	if (!start) {
+		logmsg(LLVL_ERROR, "%s: failed to allocate thread start data.", name);
+		return false;
+	}
+	*start = (struct realtime_thread_start_t) {
+		.thread_fnc = thread_fnc,
+		.argument = argument,
+		.name = name,
+	};
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(realtime_config.cpu, &cpuset);
+	struct sched_param param = {
+		.sched_priority = realtime_config.priority,
+	};
+
+	pthread_attr_t attrs;
+	pthread_attr_init(&attrs);
+	pthread_attr_setdetachstate(&attrs, PTHREAD_CREATE_DETACHED);
+	pthread_attr_setinheritsched(&attrs, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attrs, SCHED_FIFO);
+	pthread_attr_setschedparam(&attrs, &param);
+	pthread_attr_setaffinity_np(&attrs, sizeof(cpuset), &cpuset);
+
+	pthread_t thread;
+	int result = pthread_create(&thread, &attrs, realtime_thread_body, start);
+	pthread_attr_destroy(&attrs);
+	if (result) {
+		logmsg(LLVL_ERROR, "%s: failed to create real-time thread: %s", name, strerror(result));
+		free(start);
+		return false;
+	}
+	return true;
+}
+
+/* Mutexes that are shared between real-time and regular threads need priority
+ * inheritance: a real-time thread that waits for one boosts the current owner
+ * instead of waiting for it to be scheduled at its normal priority. */
+bool init_priority_inheritance_mutex(pthread_mutex_t *mutex) {
+	pthread_mutexattr_t attrs;
+	if (pthread_mutexattr_init(&attrs)) {
+		perror("pthread_mutexattr_init");
+		return false;
+	}
+	int result = pthread_mutexattr_setprotocol(&attrs, PTHREAD_PRIO_INHERIT);
+	if (!result) {
+		result = pthread_mutex_init(mutex, &attrs);
+	}
+	pthread_mutexattr_destroy(&attrs);
+	if (result) {
+		logmsg(LLVL_ERROR, "Failed to create priority inheritance mutex: %s", strerror(result));
+		return false;
+	}
+	return true;
+}
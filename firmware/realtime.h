@@ -0,0 +1,48 @@
+/*
+ *	knitpi - Raspberry Pi interface for Brother KH-930 knitting machine
+ *	Copyright (C) 2018-2018 Johannes Bauer
+ *
+ *	This file is part of knitpi.
+ *
+ *	knitpi is free software; you can redistribute it and/or modify
+ *	it under the terms of the GNU General Public License as published by
+ *	the Free Software Foundation; this program is ONLY licensed under
+ *	version 3 of the License, later versions are explicitly excluded.
+ *
+ *	knitpi is distributed in the hope that it will be useful,
+ *	but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *	GNU General Public License for more details.
+ *
+ *	You should have received a copy of the GNU General Public License
+ *	along with knitpi; if not, write to the Free Software
+ *	Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ *
+ *	Johannes Bauer <JohannesBauer@gmx.de>
+ */
+
+#ifndef __REALTIME_H__
+#define __REALTIME_H__
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "tools.h"
+
+/* Stack that every real-time thread touches once on startup so that no page
+ * fault can occur later on in the actuation path. */
+#define REALTIME_PREFAULT_STACK_BYTES		(64 * 1024)
+
+struct realtime_config_t {
+	bool enabled;
+	int cpu;
+	int priority;
+};
+
+/*************** AUTO GENERATED SECTION FOLLOWS ***************/
+bool realtime_init(const struct realtime_config_t *config);
+bool realtime_enabled(void);
+bool start_realtime_thread(thread_function_t thread_fnc, void *argument, const char *name);
+bool init_priority_inheritance_mutex(pthread_mutex_t *mutex);
+/***************  AUTO GENERATED SECTION ENDS   ***************/
+
+#endif
@@ -47,8 +47,10 @@
 #include "tokenizer.h"
 #include "png_reader.h"
 #include "png_writer.h"
+#include "kpat.h"
 #include "isleep.h"
 #include "needles.h"
+#include "latency.h"
 
 #define MAX_CMD_ARG_COUNT		8
 
@@ -65,6 +67,11 @@ enum cmdtype_t {
 	SEND_BINDATA_COMMAND = 2,
 };
 
+enum pattern_format_t {
+	PATTERN_FORMAT_PNG,
+	PATTERN_FORMAT_KPAT,
+};
+
 struct client_thread_data_t {
 	FILE *f;
 	unsigned int client_id;
@@ -113,12 +120,16 @@ static enum execution_state_t handler_statuswait(struct client_thread_data_t *wo
 static enum execution_state_t handler_hwinfo(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_setpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_getpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
+static enum execution_state_t handler_gettile(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
+static enum execution_state_t handler_getregion(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_editpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
+static enum execution_state_t handler_settiling(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_setrow(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_setoffset(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_setknitmode(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_setrepeatmode(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 static enum execution_state_t handler_hwmock(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
+static enum execution_state_t handler_latency(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf);
 
 static bool determine_movement_direction(const char *cmdname, struct client_thread_data_t *worker);
 
@@ -143,11 +154,12 @@ static struct command_t known_commands[] = {
 		.cmdname = "setpattern",
 		.handler = handler_setpattern,
 		.cmd_type = RECV_BINDATA_COMMAND,
-		.arg_count = 4,
+		.arg_count = 5,
 		.arguments = {
 			{ .name = "offsetx/int", .parser = argument_parse_int },
 			{ .name = "offsety/int", .parser = argument_parse_int },
 			{ .name = "merge/bool", .parser = argument_parse_bool },
+			{ .name = "[png|kpat]/str" },
 			{ .name = "bindata_length/int", .parser = argument_parse_int },
 		},
 	},
@@ -155,9 +167,35 @@ static struct command_t known_commands[] = {
 		.cmdname = "getpattern",
 		.handler = handler_getpattern,
 		.cmd_type = SEND_BINDATA_COMMAND,
-		.arg_count = 1,
+		.arg_count = 3,
 		.arguments = {
 			{ .name = "rawdata/bool", .parser = argument_parse_bool },
+			{ .name = "[default|fast|small]/str" },
+			{ .name = "[png|kpat]/str" },
+		},
+	},
+	{
+		.cmdname = "gettile",
+		.handler = handler_gettile,
+		.cmd_type = SEND_BINDATA_COMMAND,
+		.arg_count = 3,
+		.arguments = {
+			{ .name = "zoom/int", .parser = argument_parse_int },
+			{ .name = "tile_x/int", .parser = argument_parse_int },
+			{ .name = "tile_y/int", .parser = argument_parse_int },
+		},
+	},
+	{
+		.cmdname = "getregion",
+		.handler = handler_getregion,
+		.cmd_type = SEND_BINDATA_COMMAND,
+		.arg_count = 5,
+		.arguments = {
+			{ .name = "x/int", .parser = argument_parse_int },
+			{ .name = "y/int", .parser = argument_parse_int },
+			{ .name = "width/int", .parser = argument_parse_int },
+			{ .name = "height/int", .parser = argument_parse_int },
+			{ .name = "[png|bytes|bits]/str" },
 		},
 	},
 	{
@@ -168,6 +206,17 @@ static struct command_t known_commands[] = {
 			{ .name = "[clr|trim|center]/str" },
 		},
 	},
+	{
+		.cmdname = "settiling",
+		.handler = handler_settiling,
+		.arg_count = 4,
+		.arguments = {
+			{ .name = "repeatx/int", .parser = argument_parse_int },
+			{ .name = "repeaty/int", .parser = argument_parse_int },
+			{ .name = "offsetx/int", .parser = argument_parse_int },
+			{ .name = "offsety/int", .parser = argument_parse_int },
+		},
+	},
 	{
 		.cmdname = "setrow",
 		.handler = handler_setrow,
@@ -209,6 +258,14 @@ static struct command_t known_commands[] = {
 			{ .name = "parameter/int", .parser = argument_parse_int },
 		},
 	},
+	{
+		.cmdname = "latency",
+		.handler = handler_latency,
+		.arg_count = 1,
+		.arguments = {
+			{ .name = "[show|reset]/str" },
+		},
+	},
 };
 #define KNOWN_COMMAND_COUNT		(sizeof(known_commands) / sizeof(struct command_t))
 
@@ -233,6 +290,8 @@ static void  __attribute__ ((format (printf, 3, 4))) log_respond_error(struct cl
 }
 
 static enum execution_state_t handler_status(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	const struct pattern_t *pattern = snapshot ? snapshot->pattern : NULL;
 	struct json_dict_entry_t json_dict[] = {
 		JSON_DICTENTRY_STR("msg_type", "status"),
 		JSON_DICTENTRY_BOOL("knitting_mode", worker->server_state->knitting_mode),
@@ -240,17 +299,37 @@ static enum execution_state_t handler_status(struct client_thread_data_t *worker
 		JSON_DICTENTRY_BOOL("carriage_position_valid", worker->server_state->carriage_position_valid),
 		JSON_DICTENTRY_BOOL("even_rows_left_to_right", worker->server_state->even_rows_left_to_right),
 		JSON_DICTENTRY_INT("carriage_position", worker->server_state->carriage_position),
+		JSON_DICTENTRY_INT("carriage_velocity", worker->server_state->carriage_velocity),
 		JSON_DICTENTRY_INT("skipped_needles_cnt", sled_get_skipped_needles_cnt()),
+		JSON_DICTENTRY_INT("spi_sent_cnt", atomic_load(&worker->server_state->spi_cache.sent_cnt)),
+		JSON_DICTENTRY_INT("spi_suppressed_cnt", atomic_load(&worker->server_state->spi_cache.suppressed_cnt)),
+		JSON_DICTENTRY_INT("actuation_table_compiled_cnt", atomic_load(&worker->server_state->actuation_tables.compiled_cnt)),
+		JSON_DICTENTRY_INT("actuation_table_miss_cnt", atomic_load(&worker->server_state->actuation_tables.miss_cnt)),
+		JSON_DICTENTRY_INT("predicted_cnt", atomic_load(&worker->server_state->prediction.predicted_cnt)),
+		JSON_DICTENTRY_INT("mispredicted_cnt", atomic_load(&worker->server_state->prediction.mispredicted_cnt)),
+		JSON_DICTENTRY_INT("pattern_cache_hit_cnt", atomic_load(&worker->server_state->pattern_cache.hit_cnt)),
+		JSON_DICTENTRY_INT("pattern_cache_miss_cnt", atomic_load(&worker->server_state->pattern_cache.miss_cnt)),
+		JSON_DICTENTRY_INT("pattern_cache_bytes", pattern_cache_memory_used(&worker->server_state->pattern_cache)),
+		JSON_DICTENTRY_INT("png_cache_hit_cnt", atomic_load(&worker->server_state->png_cache.hit_cnt)),
+		JSON_DICTENTRY_INT("png_cache_miss_cnt", atomic_load(&worker->server_state->png_cache.miss_cnt)),
+		JSON_DICTENTRY_INT("png_cache_bytes", png_cache_memory_used(&worker->server_state->png_cache)),
 		JSON_DICTENTRY_INT("pattern_row", worker->server_state->pattern_row),
-		JSON_DICTENTRY_INT("pattern_offset", worker->server_state->pattern_offset),
-		JSON_DICTENTRY_INT("pattern_min_x", worker->server_state->pattern ? worker->server_state->pattern->min_x : 0),
-		JSON_DICTENTRY_INT("pattern_min_y", worker->server_state->pattern ? worker->server_state->pattern->min_y : 0),
-		JSON_DICTENTRY_INT("pattern_max_x", worker->server_state->pattern ? worker->server_state->pattern->max_x : -1),
-		JSON_DICTENTRY_INT("pattern_max_y", worker->server_state->pattern ? worker->server_state->pattern->max_y : -1),
-		JSON_DICTENTRY_INT("pattern_width", worker->server_state->pattern ? worker->server_state->pattern->width : 0),
-		JSON_DICTENTRY_INT("pattern_height", worker->server_state->pattern ? worker->server_state->pattern->height : 0),
+		JSON_DICTENTRY_INT("pattern_offset", snapshot ? snapshot->pattern_offset : 0),
+		JSON_DICTENTRY_INT("pattern_min_x", pattern ? pattern->min_x : 0),
+		JSON_DICTENTRY_INT("pattern_min_y", pattern ? pattern->min_y : 0),
+		JSON_DICTENTRY_INT("pattern_max_x", pattern ? pattern->max_x : -1),
+		JSON_DICTENTRY_INT("pattern_max_y", pattern ? pattern->max_y : -1),
+		JSON_DICTENTRY_INT("pattern_layers", pattern ? pattern->layer_count : 0),
+		JSON_DICTENTRY_INT("pattern_unique_rows", pattern ? pattern_unique_rows(pattern) : 0),
+		JSON_DICTENTRY_INT("pattern_width", pattern ? pattern->width : 0),
+		JSON_DICTENTRY_INT("pattern_height", pattern ? pattern->height : 0),
+		JSON_DICTENTRY_INT("pattern_tile_width", pattern ? pattern_tile_width(pattern) : 0),
+		JSON_DICTENTRY_INT("pattern_tile_height", pattern ? pattern_tile_height(pattern) : 0),
+		JSON_DICTENTRY_INT("pattern_repeat_x", (pattern && pattern->tile) ? pattern->repeat.repeat_x : 1),
+		JSON_DICTENTRY_INT("pattern_repeat_y", (pattern && pattern->tile) ? pattern->repeat.repeat_y : 1),
 		{ 0 },
 	};
+	read_snapshot_end(worker->server_state);
 	json_print_dict(worker->f, json_dict);
 	return SUCCESS;
 }
@@ -264,6 +343,14 @@ static enum execution_state_t handler_statuswait(struct client_thread_data_t *wo
 
 static enum execution_state_t handler_hwinfo(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
 	const struct knitmachine_params_t *params = get_knitmachine_params();
+	int preview_tile_stitch_counts[PREVIEW_ZOOM_LEVELS];
+	int preview_stitch_pitches[PREVIEW_ZOOM_LEVELS];
+	int preview_grid_widths[PREVIEW_ZOOM_LEVELS];
+	for (unsigned int i = 0; i < PREVIEW_ZOOM_LEVELS; i++) {
+		preview_tile_stitch_counts[i] = preview_tile_stitches(i);
+		preview_stitch_pitches[i] = preview_stitch_pitch(i);
+		preview_grid_widths[i] = preview_grid_width(i);
+	}
 	struct json_dict_entry_t json_dict[] = {
 		JSON_DICTENTRY_STR("msg_type", "hwinfo"),
 		JSON_DICTENTRY_INT("solenoid_count", params->solenoid_count),
@@ -271,52 +358,105 @@ static enum execution_state_t handler_hwinfo(struct client_thread_data_t *worker
 		JSON_DICTENTRY_INT("needle_count", params->needle_count),
 		JSON_DICTENTRY_INT("active_window_offset", params->active_window_offset),
 		JSON_DICTENTRY_INT("active_window_size", params->active_window_size),
+		JSON_DICTENTRY_INT_ARRAY("preview_tile_stitches", preview_tile_stitch_counts, PREVIEW_ZOOM_LEVELS),
+		JSON_DICTENTRY_INT_ARRAY("preview_stitch_pitch", preview_stitch_pitches, PREVIEW_ZOOM_LEVELS),
+		JSON_DICTENTRY_INT_ARRAY("preview_grid_width", preview_grid_widths, PREVIEW_ZOOM_LEVELS),
 		{ 0 },
 	};
 	json_print_dict(worker->f, json_dict);
 	return SUCCESS;
 }
 
-static void center_pattern(struct client_thread_data_t *worker) {
-	int actual_width = worker->server_state->pattern->max_x - worker->server_state->pattern->min_x + 1;
+static int32_t center_pattern(const struct pattern_t *pattern) {
+	int actual_width = pattern->max_x - pattern->min_x + 1;
 	if (actual_width > 0) {
-		worker->server_state->pattern_offset = (200 / 2) - (actual_width / 2);
+		return (200 / 2) - (actual_width / 2);
 	} else {
-		worker->server_state->pattern_offset = 0;
+		return 0;
 	}
 }
 
+static bool parse_pattern_format(const char *name, enum pattern_format_t *format) {
+	if (!strcasecmp(name, "png")) {
+		*format = PATTERN_FORMAT_PNG;
+	} else if (!strcasecmp(name, "kpat")) {
+		*format = PATTERN_FORMAT_KPAT;
+	} else {
+		return false;
+	}
+	return true;
+}
+
 static enum execution_state_t handler_setpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
 	int offsetx = tokens->token[1].integer;
 	int offsety = tokens->token[2].integer;
 	bool merge = tokens->token[3].boolean;
-	struct pattern_t *pattern = png_read_pattern(membuf, offsetx, offsety);
-	if (!pattern) {
-		log_respond_error(worker, LLVL_ERROR, "%s: Failed to read PNG image.", tokens->token[0].string);
+	enum pattern_format_t format;
+	if (!parse_pattern_format(tokens->token[4].string, &format)) {
+		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[4].string);
+		return FAILED;
+	}
+	if ((offsetx < 0) || (offsety < 0) || (offsetx >= MAX_PATTERN_WIDTH) || ((unsigned int)offsety >= pattern_get_max_height())) {
+		json_respond_simple(worker->f, "error", "Pattern offset %d, %d out of range.", offsetx, offsety);
 		return FAILED;
+	}
+	/* Only PNG uploads are worth caching, kpat data is copied as it is */
+	uint64_t bindata_hash = (format == PATTERN_FORMAT_PNG) ? pattern_cache_hash(membuf) : 0;
+	struct pattern_layer_t *layer = (format == PATTERN_FORMAT_PNG) ? pattern_cache_lookup(&worker->server_state->pattern_cache, membuf, bindata_hash) : NULL;
+	if (layer) {
+		logmsg(LLVL_TRACE, "(%d) Reusing cached %d x %d pattern.", worker->client_id, layer->pattern->width, layer->pattern->height);
 	} else {
-		if (!merge) {
-			pattern_update_min_max(pattern);
-			pattern_free(worker->server_state->pattern);
-			worker->server_state->pattern = pattern;
-		} else {
-			struct pattern_t *merge_pattern = pattern_merge(worker->server_state->pattern, pattern);
-			if (!merge_pattern) {
-				log_respond_error(worker, LLVL_WARN, "%s: Failed to merge patterns.", tokens->token[0].string);
-				pattern_free(pattern);
-				return FAILED;
-			}
-			pattern_update_min_max(merge_pattern);
+		struct pattern_t *decoded_pattern = (format == PATTERN_FORMAT_KPAT) ? kpat_read_pattern(membuf) : png_read_pattern(membuf, 0, 0);
+		if (!decoded_pattern) {
+			log_respond_error(worker, LLVL_ERROR, "%s: Failed to read %s pattern.", tokens->token[0].string, (format == PATTERN_FORMAT_KPAT) ? "kpat" : "PNG");
+			return FAILED;
+		}
+		pattern_update_min_max(decoded_pattern);
+		layer = pattern_layer_new(decoded_pattern);
+		if (!layer) {
+			log_respond_error(worker, LLVL_ERROR, "%s: Failed to create pattern layer.", tokens->token[0].string);
+			return FAILED;
+		}
+		if (format == PATTERN_FORMAT_PNG) {
+			pattern_cache_insert(&worker->server_state->pattern_cache, membuf, bindata_hash, layer);
+		}
+	}
 
-			pattern_free(pattern);
-			pattern_free(worker->server_state->pattern);
-			worker->server_state->pattern = merge_pattern;
+	if ((offsetx + layer->pattern->width > MAX_PATTERN_WIDTH) || (offsety + layer->pattern->height > pattern_get_max_height())) {
+		log_respond_error(worker, LLVL_WARN, "%s: %u x %u pattern at offset %d, %d exceeds the maximum size of %u x %u.", tokens->token[0].string, layer->pattern->width, layer->pattern->height, offsetx, offsety, MAX_PATTERN_WIDTH, pattern_get_max_height());
+		pattern_layer_put(layer);
+		return FAILED;
+	}
+
+	const struct pattern_snapshot_t *snapshot = update_snapshot_begin(worker->server_state);
+	if (merge || offsetx || offsety) {
+		/* The new image becomes the topmost layer of a composition instead of
+		 * materializing the merged pattern. Its rows are flattened ahead of
+		 * the carriage by the actuation table compiler. */
+		struct pattern_t *pattern = pattern_compose((merge && snapshot) ? snapshot->layer : NULL, layer, offsetx, offsety);
+		pattern_layer_put(layer);
+		if (!pattern) {
+			update_snapshot_abort(worker->server_state);
+			log_respond_error(worker, LLVL_WARN, "%s: Failed to %s patterns.", tokens->token[0].string, merge ? "merge" : "compose");
+			return FAILED;
+		}
+		logmsg(LLVL_TRACE, "(%d) Composed %d x %d pattern from %u layer(s).", worker->client_id, pattern->width, pattern->height, pattern->layer_count);
+		pattern_update_min_max(pattern);
+		layer = pattern_layer_new(pattern);
+		if (!layer) {
+			update_snapshot_abort(worker->server_state);
+			log_respond_error(worker, LLVL_ERROR, "%s: Failed to create pattern layer.", tokens->token[0].string);
+			return FAILED;
 		}
 	}
+	/* Otherwise, the decoded pattern is published as it is, in its
+	 * deduplicated form and shared with the pattern cache */
 
 	set_knitting_mode(worker->server_state, false);
-	worker->server_state->pattern_row = 0;
-	center_pattern(worker);
+	if (!update_snapshot_commit_layer(worker->server_state, layer, center_pattern(layer->pattern), 0)) {
+		log_respond_error(worker, LLVL_ERROR, "%s: Failed to publish new pattern.", tokens->token[0].string);
+		return FAILED;
+	}
 	sled_update(worker->server_state);
 	isleep_interrupt(&worker->server_state->event_notification);
 	json_respond_simple(worker->f, "ok", "New pattern set.");
@@ -325,53 +465,243 @@ static enum execution_state_t handler_setpattern(struct client_thread_data_t *wo
 
 static enum execution_state_t handler_getpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
 	bool rawdata = tokens->token[1].boolean;
-	if (!worker->server_state->pattern) {
+	enum png_encoder_profile_t profile;
+	if (!png_encoder_profile_parse(tokens->token[2].string, &profile)) {
+		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[2].string);
+		return FAILED;
+	}
+	enum pattern_format_t format;
+	if (!parse_pattern_format(tokens->token[3].string, &format)) {
+		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[3].string);
+		return FAILED;
+	}
+	/* Encoding may take a while, so it works on its own reference of the
+	 * pattern instead of holding up writers in the read section */
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	if (!snapshot) {
+		read_snapshot_end(worker->server_state);
 		log_respond_error(worker, LLVL_DEBUG, "%s: No pattern is set.", tokens->token[0].string);
 		return SILENT_FAILED;
 	}
+	struct pattern_layer_t *layer = pattern_layer_get(snapshot->layer);
+	uint32_t pattern_version = snapshot->pattern_version;
+	read_snapshot_end(worker->server_state);
+
+	if (format == PATTERN_FORMAT_KPAT) {
+		/* Rendition and encoder profile only apply to PNG */
+		bool success = kpat_write_pattern_mem(layer->pattern, membuf);
+		pattern_layer_put(layer);
+		if (!success) {
+			log_respond_error(worker, LLVL_ERROR, "%s: Unable to convert pattern to kpat.", tokens->token[0].string);
+			return FAILED;
+		}
+		return SUCCESS;
+	}
+	enum png_cache_variant_t variant = rawdata ? PNG_CACHE_RAW : PNG_CACHE_PRETTY;
+	if (png_cache_lookup(&worker->server_state->png_cache, variant, profile, pattern_version, membuf)) {
+		pattern_layer_put(layer);
+		return SUCCESS;
+	}
 	const struct png_write_options_t raw_write_options = {
 		.pixel_width = 1,
 		.pixel_height = 1,
 		.grid_width = 0,
 		.color_scheme = COLSCHEME_RAW,
 	};
-	if (!png_write_pattern_mem(worker->server_state->pattern, membuf, rawdata ? &raw_write_options : NULL)) {
+	struct png_write_options_t write_options = rawdata ? raw_write_options : *png_write_default_options();
+	write_options.profile = profile;
+	bool success = png_write_pattern_mem(layer->pattern, membuf, &write_options);
+	pattern_layer_put(layer);
+	if (!success) {
 		log_respond_error(worker, LLVL_ERROR, "%s: Unable to convert pattern to PNG.", tokens->token[0].string);
 		return FAILED;
 	}
+	png_cache_insert(&worker->server_state->png_cache, variant, profile, pattern_version, membuf);
+	return SUCCESS;
+}
+
+static enum execution_state_t handler_gettile(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	int zoom = tokens->token[1].integer;
+	int tile_x = tokens->token[2].integer;
+	int tile_y = tokens->token[3].integer;
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	if (!snapshot) {
+		read_snapshot_end(worker->server_state);
+		log_respond_error(worker, LLVL_DEBUG, "%s: No pattern is set.", tokens->token[0].string);
+		return SILENT_FAILED;
+	}
+	struct pattern_layer_t *layer = pattern_layer_get(snapshot->layer);
+	uint32_t pattern_version = snapshot->pattern_version;
+	read_snapshot_end(worker->server_state);
+
+	if ((zoom < 0) || (tile_x < 0) || (tile_y < 0) || !preview_tile_exists(layer->pattern, zoom, tile_x, tile_y)) {
+		pattern_layer_put(layer);
+		log_respond_error(worker, LLVL_WARN, "%s: No tile %d, %d at zoom level %d.", tokens->token[0].string, tile_x, tile_y, zoom);
+		return FAILED;
+	}
+	bool success = preview_get_tile(&worker->server_state->preview, layer->pattern, pattern_version, zoom, tile_x, tile_y, membuf);
+	pattern_layer_put(layer);
+	if (!success) {
+		log_respond_error(worker, LLVL_ERROR, "%s: Unable to render preview tile.", tokens->token[0].string);
+		return FAILED;
+	}
+	return SUCCESS;
+}
+
+static void copy_region_bytes(const struct pattern_t *pattern, const struct region_header_t *header, uint8_t *data) {
+	uint8_t row_buffer[pattern->width];
+	for (unsigned int y = 0; y < header->height; y++) {
+		uint8_t *dest = data + (y * header->row_stride);
+		if (pattern_row_is_empty(pattern, header->y + y)) {
+			memset(dest, 0, header->row_stride);
+		} else {
+			memcpy(dest, pattern_get_row(pattern, header->y + y, row_buffer) + header->x, header->width);
+		}
+	}
+}
+
+static void copy_region_bits(const struct pattern_t *pattern, const struct region_header_t *header, uint8_t *data) {
+	memset(data, 0, header->row_stride * header->height);
+	for (unsigned int y = 0; y < header->height; y++) {
+		if (pattern_row_is_empty(pattern, header->y + y)) {
+			continue;
+		}
+		uint8_t *dest = data + (y * header->row_stride);
+		for (unsigned int x = 0; x < header->width; x += PATTERN_MASK_BITS) {
+			uint64_t mask = pattern_get_mask(pattern, header->x + x, header->y + y);
+			unsigned int remaining = header->width - x;
+			if (remaining < PATTERN_MASK_BITS) {
+				mask &= (1ULL << remaining) - 1;
+			}
+			for (unsigned int i = 0; (i < 8) && ((x / 8) + i < header->row_stride); i++) {
+				dest[(x / 8) + i] = mask >> (8 * i);
+			}
+		}
+	}
+}
+
+static enum execution_state_t handler_getregion(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	enum region_format_t format;
+	if (!strcasecmp(tokens->token[5].string, "png")) {
+		format = REGION_FORMAT_PNG;
+	} else if (!strcasecmp(tokens->token[5].string, "bytes")) {
+		format = REGION_FORMAT_BYTES;
+	} else if (!strcasecmp(tokens->token[5].string, "bits")) {
+		format = REGION_FORMAT_BITS;
+	} else {
+		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[5].string);
+		return FAILED;
+	}
+
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	if (!snapshot) {
+		read_snapshot_end(worker->server_state);
+		log_respond_error(worker, LLVL_DEBUG, "%s: No pattern is set.", tokens->token[0].string);
+		return SILENT_FAILED;
+	}
+	struct pattern_layer_t *layer = pattern_layer_get(snapshot->layer);
+	uint32_t pattern_version = snapshot->pattern_version;
+	read_snapshot_end(worker->server_state);
+
+	/* The requested region is clipped to the pattern */
+	const struct pattern_t *pattern = layer->pattern;
+	int64_t x0 = tokens->token[1].integer;
+	int64_t y0 = tokens->token[2].integer;
+	int64_t x1 = x0 + tokens->token[3].integer;
+	int64_t y1 = y0 + tokens->token[4].integer;
+	x0 = (x0 < 0) ? 0 : x0;
+	y0 = (y0 < 0) ? 0 : y0;
+	x1 = (x1 > pattern->width) ? pattern->width : x1;
+	y1 = (y1 > pattern->height) ? pattern->height : y1;
+	if ((x1 <= x0) || (y1 <= y0)) {
+		log_respond_error(worker, LLVL_DEBUG, "%s: Region does not overlap %u x %u pattern.", tokens->token[0].string, pattern->width, pattern->height);
+		pattern_layer_put(layer);
+		return FAILED;
+	}
+
+	bool success;
+	if (format == REGION_FORMAT_PNG) {
+		const struct png_write_options_t raw_write_options = {
+			.pixel_width = 1,
+			.pixel_height = 1,
+			.grid_width = 0,
+			.color_scheme = COLSCHEME_RAW,
+			.profile = PNG_PROFILE_FAST,
+		};
+		const struct png_write_region_t region = {
+			.x = x0,
+			.y = y0,
+			.width = x1 - x0,
+			.height = y1 - y0,
+		};
+		success = png_write_pattern_region_mem(pattern, membuf, &raw_write_options, &region);
+	} else {
+		const struct region_header_t header = {
+			.magic = REGION_HEADER_MAGIC,
+			.format = format,
+			.pattern_version = pattern_version,
+			.x = x0,
+			.y = y0,
+			.width = x1 - x0,
+			.height = y1 - y0,
+			.row_stride = (format == REGION_FORMAT_BYTES) ? (x1 - x0) : ((x1 - x0 + 7) / 8),
+		};
+		success = membuf_resize(membuf, sizeof(header) + (header.row_stride * header.height));
+		if (success) {
+			memcpy(membuf->data, &header, sizeof(header));
+			if (format == REGION_FORMAT_BYTES) {
+				copy_region_bytes(pattern, &header, membuf->data + sizeof(header));
+			} else {
+				copy_region_bits(pattern, &header, membuf->data + sizeof(header));
+			}
+		}
+	}
+	pattern_layer_put(layer);
+	if (!success) {
+		log_respond_error(worker, LLVL_ERROR, "%s: Unable to encode pattern region.", tokens->token[0].string);
+		return FAILED;
+	}
 	return SUCCESS;
 }
 
 static enum execution_state_t handler_editpattern(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	const struct pattern_snapshot_t *snapshot = update_snapshot_begin(worker->server_state);
 	if (!strcasecmp(tokens->token[1].string, "clr")) {
-		pattern_free(worker->server_state->pattern);
-		worker->server_state->pattern = NULL;
-		worker->server_state->pattern_offset = 0;
+		update_snapshot_commit(worker->server_state, NULL, 0, SNAPSHOT_KEEP_PATTERN_ROW);
 	} else if (!strcasecmp(tokens->token[1].string, "trim")) {
-		if (!worker->server_state->pattern) {
+		if (!snapshot) {
+			update_snapshot_abort(worker->server_state);
 			json_respond_simple(worker->f, "error", "Cannot trim without pattern.");
 			return FAILED;
 		}
-		logmsg(LLVL_DEBUG, "(%d) Trimming %d x %d pattern, old minmax (%d, %d), (%d, %d)", worker->client_id, worker->server_state->pattern->width, worker->server_state->pattern->height, worker->server_state->pattern->min_x, worker->server_state->pattern->min_y, worker->server_state->pattern->max_x, worker->server_state->pattern->max_y);
-		struct pattern_t *trimmed = pattern_trim(worker->server_state->pattern);
+		const struct pattern_t *pattern = snapshot->pattern;
+		logmsg(LLVL_DEBUG, "(%d) Trimming %d x %d pattern, old minmax (%d, %d), (%d, %d)", worker->client_id, pattern->width, pattern->height, pattern->min_x, pattern->min_y, pattern->max_x, pattern->max_y);
+		struct pattern_t *trimmed = pattern_trim(pattern);
 		if (!trimmed) {
+			update_snapshot_abort(worker->server_state);
 			json_respond_simple(worker->f, "error", "Trimming of pattern failed.");
 			return FAILED;
 		}
-		pattern_free(worker->server_state->pattern);
-		worker->server_state->pattern = trimmed;
-		logmsg(LLVL_DEBUG, "(%d) Trimmed %d x %d pattern, new minmax (%d, %d), (%d, %d)", worker->client_id, worker->server_state->pattern->width, worker->server_state->pattern->height, worker->server_state->pattern->min_x, worker->server_state->pattern->min_y, worker->server_state->pattern->max_x, worker->server_state->pattern->max_y);
-		if (worker->server_state->pattern_row >= worker->server_state->pattern->height) {
-			worker->server_state->pattern_row = worker->server_state->pattern->height - 1;
+		logmsg(LLVL_DEBUG, "(%d) Trimmed %d x %d pattern, new minmax (%d, %d), (%d, %d)", worker->client_id, trimmed->width, trimmed->height, trimmed->min_x, trimmed->min_y, trimmed->max_x, trimmed->max_y);
+		if (!update_snapshot_commit(worker->server_state, trimmed, snapshot->pattern_offset, SNAPSHOT_KEEP_PATTERN_ROW)) {
+			json_respond_simple(worker->f, "error", "Trimming of pattern failed.");
+			return FAILED;
 		}
 	} else if (!strcasecmp(tokens->token[1].string, "center")) {
-		if (!worker->server_state->pattern) {
+		if (!snapshot) {
+			update_snapshot_abort(worker->server_state);
 			json_respond_simple(worker->f, "error", "Cannot center without pattern.");
 			return FAILED;
 		}
-		center_pattern(worker);
-		logmsg(LLVL_DEBUG, "(%d) Centered %d x %d pattern with minmax (%d, %d), (%d, %d) to %d", worker->client_id, worker->server_state->pattern->width, worker->server_state->pattern->height, worker->server_state->pattern->min_x, worker->server_state->pattern->min_y, worker->server_state->pattern->max_x, worker->server_state->pattern->max_y, worker->server_state->pattern_offset);
+		const struct pattern_t *pattern = snapshot->pattern;
+		int32_t pattern_offset = center_pattern(pattern);
+		logmsg(LLVL_DEBUG, "(%d) Centered %d x %d pattern with minmax (%d, %d), (%d, %d) to %d", worker->client_id, pattern->width, pattern->height, pattern->min_x, pattern->min_y, pattern->max_x, pattern->max_y, pattern_offset);
+		if (!update_snapshot_commit(worker->server_state, snapshot->pattern, pattern_offset, SNAPSHOT_KEEP_PATTERN_ROW)) {
+			json_respond_simple(worker->f, "error", "Centering of pattern failed.");
+			return FAILED;
+		}
 	} else {
+		update_snapshot_abort(worker->server_state);
 		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[1].string);
 		return FAILED;
 	}
@@ -381,11 +711,52 @@ static enum execution_state_t handler_editpattern(struct client_thread_data_t *w
 	return SUCCESS;
 }
 
+static enum execution_state_t handler_settiling(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	for (int i = 1; i <= 4; i++) {
+		if (tokens->token[i].integer < ((i <= 2) ? 1 : 0)) {
+			log_respond_error(worker, LLVL_WARN, "%s: Invalid tiling parameter %d.", tokens->token[0].string, tokens->token[i].integer);
+			return FAILED;
+		}
+	}
+	const struct pattern_repeat_t repeat = {
+		.repeat_x = tokens->token[1].integer,
+		.repeat_y = tokens->token[2].integer,
+		.offset_x = tokens->token[3].integer,
+		.offset_y = tokens->token[4].integer,
+	};
+
+	const struct pattern_snapshot_t *snapshot = update_snapshot_begin(worker->server_state);
+	if (!snapshot) {
+		update_snapshot_abort(worker->server_state);
+		json_respond_simple(worker->f, "error", "Cannot tile without pattern.");
+		return FAILED;
+	}
+	struct pattern_t *tiled = pattern_new_tiled(snapshot->pattern, &repeat);
+	if (!tiled) {
+		update_snapshot_abort(worker->server_state);
+		log_respond_error(worker, LLVL_WARN, "%s: Failed to repeat pattern %u x %u times.", tokens->token[0].string, repeat.repeat_x, repeat.repeat_y);
+		return FAILED;
+	}
+	logmsg(LLVL_DEBUG, "(%d) Tiled %d x %d pattern %u x %u times, logical size %d x %d", worker->client_id, pattern_tile_width(tiled), pattern_tile_height(tiled), repeat.repeat_x, repeat.repeat_y, tiled->width, tiled->height);
+	if (!update_snapshot_commit(worker->server_state, tiled, snapshot->pattern_offset, SNAPSHOT_KEEP_PATTERN_ROW)) {
+		json_respond_simple(worker->f, "error", "Tiling of pattern failed.");
+		return FAILED;
+	}
+	sled_update(worker->server_state);
+	isleep_interrupt(&worker->server_state->event_notification);
+	json_respond_simple(worker->f, "ok", "Pattern tiled.");
+	return SUCCESS;
+}
+
 static enum execution_state_t handler_setrow(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
-	if ((worker->server_state->pattern) && (tokens->token[1].integer >= 0) && (tokens->token[1].integer < worker->server_state->pattern->height)) {
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	bool row_valid = snapshot && (tokens->token[1].integer >= 0) && (tokens->token[1].integer < snapshot->pattern->height);
+	read_snapshot_end(worker->server_state);
+	if (row_valid) {
 		int current_row = worker->server_state->pattern_row;
 		worker->server_state->pattern_row = tokens->token[1].integer;
 		if (determine_movement_direction(tokens->token[0].string, worker)) {
+			persist_server_state(worker->server_state);
 			sled_update(worker->server_state);
 			isleep_interrupt(&worker->server_state->event_notification);
 			json_respond_simple(worker->f, "ok", "New row set.");
@@ -401,39 +772,54 @@ static enum execution_state_t handler_setrow(struct client_thread_data_t *worker
 }
 
 static enum execution_state_t handler_setoffset(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
-	worker->server_state->pattern_offset = tokens->token[1].integer;
+	const struct pattern_snapshot_t *snapshot = update_snapshot_begin(worker->server_state);
+	if (snapshot) {
+		if (!update_snapshot_commit(worker->server_state, snapshot->pattern, tokens->token[1].integer, SNAPSHOT_KEEP_PATTERN_ROW)) {
+			json_respond_simple(worker->f, "error", "Failed to set new offset.");
+			return FAILED;
+		}
+	} else {
+		/* Without a pattern there is no offset to keep */
+		update_snapshot_abort(worker->server_state);
+	}
 	sled_update(worker->server_state);
 	isleep_interrupt(&worker->server_state->event_notification);
-	json_respond_simple(worker->f, "ok", "New offset set to %d.", worker->server_state->pattern_offset);
+	json_respond_simple(worker->f, "ok", "New offset set to %d.", tokens->token[1].integer);
 	return SUCCESS;
 }
 
 static bool determine_movement_direction(const char *cmdname, struct client_thread_data_t *worker) {
-	if (!worker->server_state->pattern) {
+	const struct pattern_snapshot_t *snapshot = read_snapshot_begin(worker->server_state);
+	if (!snapshot) {
+		read_snapshot_end(worker->server_state);
 		log_respond_error(worker, LLVL_WARN, "%s: Cannot determine movement direction without a pattern set.", cmdname);
 		return false;
 	}
 
 	if (!worker->server_state->carriage_position_valid) {
+		read_snapshot_end(worker->server_state);
 		log_respond_error(worker, LLVL_WARN, "%s: Cannot determine movement direction without a valid carriage position.", cmdname);
 		return false;
 	}
 
-	if (worker->server_state->carriage_position <= worker->server_state->pattern->min_x + worker->server_state->pattern_offset) {
+	bool success = true;
+	if (worker->server_state->carriage_position <= snapshot->pattern->min_x + snapshot->pattern_offset) {
 		/* We're left of pattern */
 		worker->server_state->even_rows_left_to_right = ((worker->server_state->pattern_row % 2) == 0);
-	} else if (worker->server_state->carriage_position >= worker->server_state->pattern->max_x + worker->server_state->pattern_offset) {
+	} else if (worker->server_state->carriage_position >= snapshot->pattern->max_x + snapshot->pattern_offset) {
 		/* We're right of pattern */
 		worker->server_state->even_rows_left_to_right = ((worker->server_state->pattern_row % 2) != 0);
 	} else {
-		log_respond_error(worker, LLVL_ERROR, "%s: Cannot determine movement direction at this carriage postion: carriage at %d and pattern from %d to %d.", cmdname, worker->server_state->carriage_position, worker->server_state->pattern->min_x + worker->server_state->pattern_offset, worker->server_state->pattern->max_x + worker->server_state->pattern_offset);
-		return false;
+		log_respond_error(worker, LLVL_ERROR, "%s: Cannot determine movement direction at this carriage postion: carriage at %d and pattern from %d to %d.", cmdname, worker->server_state->carriage_position, snapshot->pattern->min_x + snapshot->pattern_offset, snapshot->pattern->max_x + snapshot->pattern_offset);
+		success = false;
 	}
+	read_snapshot_end(worker->server_state);
 
-	return true;
+	return success;
 }
 
 static enum execution_state_t handler_setknitmode(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	atomic_store(&worker->server_state->resume_knitting, false);
 	if (tokens->token[1].boolean) {
 		/* Turn knitting on */
 		if (determine_movement_direction(tokens->token[0].string, worker)) {
@@ -444,6 +830,7 @@ static enum execution_state_t handler_setknitmode(struct client_thread_data_t *w
 	} else {
 		set_knitting_mode(worker->server_state, false);
 	}
+	persist_server_state(worker->server_state);
 	sled_update(worker->server_state);
 	isleep_interrupt(&worker->server_state->event_notification);
 	json_respond_simple(worker->f, "ok", "New knitting mode: %s", worker->server_state->knitting_mode ? "enabled" : "disabled");
@@ -461,6 +848,7 @@ static enum execution_state_t handler_setrepeatmode(struct client_thread_data_t
 		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[1].string);
 		return FAILED;
 	}
+	persist_server_state(worker->server_state);
 	isleep_interrupt(&worker->server_state->event_notification);
 	json_respond_simple(worker->f, "ok", "New repeat mode: %s", repeat_mode_to_str(worker->server_state->repeat_mode));
 	return SUCCESS;
@@ -472,7 +860,13 @@ static enum execution_state_t handler_hwmock(struct client_thread_data_t *worker
 		return FAILED;
 	}
 	if (!strcasecmp(tokens->token[1].string, "setpos")) {
-		sled_actuation_callback(worker->server_state, tokens->token[2].integer, true);
+		/* Treat the command as if an edge had occurred just now */
+		struct timespec edge_time;
+		latency_timestamp(&edge_time);
+		latency_set_edge(&edge_time);
+		sled_actuation_callback(worker->server_state, tokens->token[2].integer, true, NULL);
+		latency_set_edge(NULL);
+		latency_record_since(LATENCY_CALLBACK, &edge_time);
 		json_respond_simple(worker->f, "ok", "Set position.");
 	} else {
 		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[1].string);
@@ -481,6 +875,41 @@ static enum execution_state_t handler_hwmock(struct client_thread_data_t *worker
 	return SUCCESS;
 }
 
+static enum execution_state_t handler_latency(struct client_thread_data_t *worker, struct tokens_t* tokens, struct membuf_t *membuf) {
+	if (!strcasecmp(tokens->token[1].string, "show")) {
+		int bucket_min_us[LATENCY_HISTOGRAM_BUCKETS];
+		for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++) {
+			bucket_min_us[i] = latency_bucket_min_us(i);
+		}
+
+		struct latency_stats_t stats[LATENCY_STAGE_COUNT];
+		struct json_dict_entry_t stage_dicts[LATENCY_STAGE_COUNT][5];
+		struct json_dict_entry_t json_dict[2 + LATENCY_STAGE_COUNT + 1] = {
+			JSON_DICTENTRY_STR("msg_type", "latency"),
+			JSON_DICTENTRY_INT_ARRAY("bucket_min_us", bucket_min_us, LATENCY_HISTOGRAM_BUCKETS),
+		};
+		for (int stage = 0; stage < LATENCY_STAGE_COUNT; stage++) {
+			latency_get_stats(stage, &stats[stage]);
+			struct json_dict_entry_t stage_dict[] = {
+				JSON_DICTENTRY_INT("count", stats[stage].count),
+				JSON_DICTENTRY_INT("min_us", stats[stage].min_us),
+				JSON_DICTENTRY_INT("max_us", stats[stage].max_us),
+				JSON_DICTENTRY_INT_ARRAY("histogram", stats[stage].buckets, LATENCY_HISTOGRAM_BUCKETS),
+				{ 0 },
+			};
+			memcpy(stage_dicts[stage], stage_dict, sizeof(stage_dict));
+			json_dict[2 + stage] = (struct json_dict_entry_t)JSON_DICTENTRY_DICT(latency_stage_to_str(stage), stage_dicts[stage]);
+		}
+		json_print_dict(worker->f, json_dict);
+	} else if (!strcasecmp(tokens->token[1].string, "reset")) {
+		latency_reset();
+		json_respond_simple(worker->f, "ok", "Latency histograms reset.");
+	} else {
+		json_respond_simple(worker->f, "error", "Invalid choice: %s", tokens->token[1].string);
+		return FAILED;
+	}
+	return SUCCESS;
+}
 
 static enum execution_state_t parse_execute_command(struct client_thread_data_t *worker, char *line) {
 	enum execution_state_t result = SUCCESS;
@@ -25,8 +25,30 @@
 #define __SERVER_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "knitcore.h"
 
+#define REGION_HEADER_MAGIC			0x4e47524b		/* "KRGN" */
+
+enum region_format_t {
+	REGION_FORMAT_PNG,
+	REGION_FORMAT_BYTES,
+	REGION_FORMAT_BITS,
+};
+
+/* Precedes the stitches that getregion returns in the bytes or bits format,
+ * in host byte order. Origin and size are those of the region after clipping
+ * to the pattern. Rows are row_stride bytes apart; in the bits format, the
+ * leftmost stitch of each byte is in its least significant bit. */
+struct region_header_t {
+	uint32_t magic;
+	uint32_t format;
+	uint32_t pattern_version;
+	uint32_t x, y;
+	uint32_t width, height;
+	uint32_t row_stride;
+};
+
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool start_server(struct server_state_t *server_state);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
@@ -27,6 +27,7 @@
 #include "peripherals_gpio.h"
 #include "sled.h"
 #include "logging.h"
+#include "tools.h"
 
 static int sled_position = 0;
 static uint8_t last_rotary = 0xff;
@@ -34,8 +35,13 @@ static bool pos_valid = false;
 static unsigned int skipped_needles_cnt = 0;
 static struct server_state_t *server_state;
 static sled_callback_t sled_callback = NULL;
+static sled_phase_callback_t sled_phase_callback = NULL;
+static unsigned int sled_latch_phase = 0;
+static int last_latched_position = 0xffff;
 static int last_reported_position = 0xffff;
 static bool belt_phase = false;
+static struct sled_motion_t motion;
+static unsigned int consecutive_steps = 0;
 
 static const int fixed_position_left = 0;
 static const int fixed_position_right = 794;
@@ -45,10 +51,44 @@ unsigned int sled_get_skipped_needles_cnt(void) {
 }
 
 static int rotary_get_position(void) {
-	return sled_position / 4;
+	return sled_position / SLED_STEPS_PER_POSITION;
 }
 
-static void rotary_encoder_movement(void) {
+static unsigned int steps_to_next_position(int direction) {
+	int position = rotary_get_position();
+	unsigned int steps = 1;
+	while ((sled_position + (direction * (int)steps)) / SLED_STEPS_PER_POSITION == position) {
+		steps++;
+	}
+	return steps;
+}
+
+static void motion_step(int direction, const struct timespec *ts) {
+	int64_t step_time_ns = timespec_diff(ts, &motion.last_step);
+	if ((consecutive_steps > 0) && (direction == motion.direction) && (step_time_ns > 0) && (step_time_ns < SLED_MOTION_STALE_MS * 1000000LL)) {
+		if (consecutive_steps == 1) {
+			motion.step_period_ns = step_time_ns;
+		} else {
+			/* Exponential moving average, weight 1/4 for the newest step */
+			motion.step_period_ns = ((3 * (int64_t)motion.step_period_ns) + step_time_ns) / 4;
+		}
+		consecutive_steps++;
+	} else {
+		motion.step_period_ns = 0;
+		consecutive_steps = 1;
+	}
+	motion.direction = direction;
+	motion.last_step = *ts;
+	motion.valid = (consecutive_steps > SLED_STEPS_PER_POSITION);
+	motion.steps_to_next_position = steps_to_next_position(direction);
+}
+
+static void motion_invalidate(void) {
+	motion.valid = false;
+	consecutive_steps = 0;
+}
+
+static void rotary_encoder_movement(const struct timespec *ts) {
 	uint8_t pos = (gpio_get_last_value(GPIO_BROTHER_V1) ? 1 : 0) | (gpio_get_last_value(GPIO_BROTHER_V2) ? 2 : 0);
 	if (pos == 3) {
 		pos = 2;
@@ -59,11 +99,14 @@ static void rotary_encoder_movement(void) {
 	if (pos == ((last_rotary + 1) % 4)) {
 		/* Movement to left */
 		sled_position--;
+		motion_step(-1, ts);
 	} else if (pos == ((last_rotary + 3) % 4)) {
 		/* Movement to right */
 		sled_position++;
+		motion_step(1, ts);
 	} else {
 		skipped_needles_cnt++;
+		motion_invalidate();
 	}
 	last_rotary = pos;
 }
@@ -73,6 +116,27 @@ void sled_set_callback(struct server_state_t *new_server_state, sled_callback_t
 	sled_callback = callback;
 }
 
+void sled_set_phase_callback(sled_phase_callback_t callback, unsigned int latch_phase) {
+	sled_phase_callback = callback;
+	sled_latch_phase = latch_phase;
+}
+
+static void check_latch_phase(void) {
+	if (motion.direction == 0) {
+		return;
+	}
+
+	int sled_pos = rotary_get_position();
+	int latch_position = sled_pos;
+	if (steps_to_next_position(motion.direction) <= sled_latch_phase) {
+		latch_position += motion.direction;
+	}
+	if (latch_position != last_latched_position) {
+		sled_phase_callback(server_state, latch_position);
+		last_latched_position = latch_position;
+	}
+}
+
 void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 	switch (gpio) {
 		case GPIO_BROTHER_LEFT_HALL:
@@ -80,6 +144,9 @@ void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 				belt_phase = gpio_get_last_value(GPIO_BROTHER_BP);
 				logmsg(LLVL_DEBUG, "Left hall sensor triggered, previous rotary position %d, deviation %+d (%+d needles), belt_phase %d, new rotary position %d.", sled_position, sled_position - fixed_position_left, (sled_position - fixed_position_left + 2) / 4, belt_phase, fixed_position_left);
 				sled_position = fixed_position_left;
+				if (motion.valid) {
+					motion.steps_to_next_position = steps_to_next_position(motion.direction);
+				}
 				skipped_needles_cnt = 0;
 				pos_valid = true;
 			}
@@ -90,6 +157,9 @@ void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 				belt_phase = !gpio_get_last_value(GPIO_BROTHER_BP);
 				logmsg(LLVL_DEBUG, "Right hall sensor triggered, previous rotary position %d, deviation %+d (%+d needles), belt_phase %d, new rotary position %d.", sled_position, sled_position - fixed_position_right, (sled_position - fixed_position_right + 2) / 4, belt_phase, fixed_position_right);
 				sled_position = fixed_position_right;
+				if (motion.valid) {
+					motion.steps_to_next_position = steps_to_next_position(motion.direction);
+				}
 				skipped_needles_cnt = 0;
 				pos_valid = true;
 			}
@@ -97,7 +167,7 @@ void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 
 		case GPIO_BROTHER_V1:
 		case GPIO_BROTHER_V2:
-			rotary_encoder_movement();
+			rotary_encoder_movement(ts);
 			break;
 
 		default: break;
@@ -106,8 +176,13 @@ void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value) {
 	if (sled_callback) {
 		int sled_pos = rotary_get_position();
 		if ((sled_pos != last_reported_position) && pos_valid) {
-			sled_callback(server_state, sled_pos, belt_phase);
+			sled_callback(server_state, sled_pos, belt_phase, &motion);
 			last_reported_position = sled_pos;
+			last_latched_position = sled_pos;
 		}
 	}
+
+	if (sled_phase_callback && pos_valid && ((gpio == GPIO_BROTHER_V1) || (gpio == GPIO_BROTHER_V2))) {
+		check_latch_phase();
+	}
 }
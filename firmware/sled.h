@@ -29,11 +29,35 @@
 #include "peripherals_gpio.h"
 #include "knitcore.h"
 
-typedef void (*sled_callback_t)(struct server_state_t *server_state, int position, bool belt_phase);
+/* Quadrature steps of the rotary encoder per needle position */
+#define SLED_STEPS_PER_POSITION		4
+
+/* If no encoder step was seen for this time, the carriage is considered to
+ * have stopped and velocity estimation starts over. */
+#define SLED_MOTION_STALE_MS		100
+
+/* Carriage movement estimated from the kernel timestamps of the rotary encoder
+ * edges. Only valid after several consecutive steps in the same direction. */
+struct sled_motion_t {
+	bool valid;
+	int direction;
+	uint32_t step_period_ns;
+	struct timespec last_step;
+	unsigned int steps_to_next_position;
+};
+
+typedef void (*sled_callback_t)(struct server_state_t *server_state, int position, bool belt_phase, const struct sled_motion_t *motion);
+
+/* Called between needle positions when the solenoid word should be latched
+ * for latch_position already, i.e., when the carriage is within the
+ * configured number of quadrature steps of the next needle. Also called with
+ * the current position if the carriage reverses before reaching it. */
+typedef void (*sled_phase_callback_t)(struct server_state_t *server_state, int latch_position);
 
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 unsigned int sled_get_skipped_needles_cnt(void);
 void sled_set_callback(struct server_state_t *server_state, sled_callback_t callback);
+void sled_set_phase_callback(sled_phase_callback_t callback, unsigned int latch_phase);
 void sled_input(enum gpio_t gpio, const struct timespec *ts, bool value);
 /***************  AUTO GENERATED SECTION ENDS   ***************/
 
@@ -35,7 +35,9 @@
 #include "sled.h"
 #include "needles.h"
 #include "pattern.h"
+#include "png_reader.h"
 #include "png_writer.h"
+#include "kpat.h"
 #include "tokenizer.h"
 
 struct test_mode_t {
@@ -56,6 +58,8 @@ static int run_test_gpio_irqs_debounced(int argc, char **argv);
 static int run_test_sled(int argc, char **argv);
 static int run_test_sled_actuate(int argc, char **argv);
 static int run_test_needle_name(int argc, char **argv);
+static int run_test_png_encode(int argc, char **argv);
+static int run_test_pattern_decode(int argc, char **argv);
 
 static struct timespec last_gpio_event[GPIO_COUNT];
 static int knit_needle_first = 96;
@@ -122,6 +126,16 @@ static struct test_mode_t test_modes[] = {
 		.description = "Test needle names",
 		.run_test = run_test_needle_name,
 	},
+	{
+		.mode_name = "png-encode",
+		.description = "Benchmark PNG encoder profiles on the given PNG files",
+		.run_test = run_test_png_encode,
+	},
+	{
+		.mode_name = "pattern-decode",
+		.description = "Benchmark decoding the given PNG files against their kpat equivalents",
+		.run_test = run_test_pattern_decode,
+	},
 };
 
 static int run_test_wiggle(int argc, char **argv) {
@@ -313,8 +327,12 @@ static int run_test_debounce(int argc, char **argv) {
 	return 0;
 }
 
-static void print_sled_callback(struct server_state_t *server_state, int position, bool belt_phase) {
-	fprintf(stderr, "Sled at: %3d phase %d\n", position, belt_phase);
+static void print_sled_callback(struct server_state_t *server_state, int position, bool belt_phase, const struct sled_motion_t *motion) {
+	if (motion->valid) {
+		fprintf(stderr, "Sled at: %3d phase %d, %+.1f needles/sec\n", position, belt_phase, motion->direction * 1e9 / (motion->step_period_ns * SLED_STEPS_PER_POSITION));
+	} else {
+		fprintf(stderr, "Sled at: %3d phase %d\n", position, belt_phase);
+	}
 }
 
 static int run_test_sled(int argc, char **argv) {
@@ -329,7 +347,7 @@ static int run_test_sled(int argc, char **argv) {
 	return 0;
 }
 
-static void single_sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase) {
+static void single_sled_actuation_callback(struct server_state_t *server_state, int position, bool belt_phase, const struct sled_motion_t *motion) {
 	uint8_t spi_data[] = { 0, 0 };
 	static int last_position = 0;
 
@@ -441,6 +459,105 @@ static int run_test_needle_name(int argc, char **argv) {
 	return 0;
 }
 
+static int run_test_png_encode(int argc, char **argv) {
+	const unsigned int iterations = 20;
+	const struct png_write_options_t raw_write_options = {
+		.pixel_width = 1,
+		.pixel_height = 1,
+		.grid_width = 0,
+		.color_scheme = COLSCHEME_RAW,
+	};
+	for (int i = 2; i < argc; i++) {
+		struct membuf_t png_data = MEMBUF_INITIALIZER;
+		if (!membuf_read_from_file(&png_data, argv[i])) {
+			perror(argv[i]);
+			membuf_free(&png_data);
+			continue;
+		}
+		struct pattern_t *pattern = png_read_pattern(&png_data, 0, 0);
+		membuf_free(&png_data);
+		if (!pattern) {
+			fprintf(stderr, "%s: cannot decode\n", argv[i]);
+			continue;
+		}
+		for (int raw = 0; raw < 2; raw++) {
+			for (enum png_encoder_profile_t profile = 0; profile < PNG_PROFILE_COUNT; profile++) {
+				struct png_write_options_t options = raw ? raw_write_options : *png_write_default_options();
+				options.profile = profile;
+				struct membuf_t encoded = MEMBUF_INITIALIZER;
+				struct timespec t0, t1;
+				get_timespec_now(&t0);
+				for (unsigned int j = 0; j < iterations; j++) {
+					encoded.length = 0;
+					png_write_pattern_mem(pattern, &encoded, &options);
+				}
+				get_timespec_now(&t1);
+				printf("%-32s %3d x %-5d %-6s %-7s %8u bytes %9.3f ms\n", argv[i], pattern->width, pattern->height, raw ? "raw" : "pretty", png_encoder_profile_name(profile), encoded.length, timespec_diff(&t1, &t0) / 1e6 / iterations);
+				membuf_free(&encoded);
+			}
+		}
+		pattern_free(pattern);
+	}
+	return 0;
+}
+
+static bool patterns_equal(const struct pattern_t *a, const struct pattern_t *b) {
+	if ((a->width != b->width) || (a->height != b->height) || (a->used_colors != b->used_colors) || memcmp(a->rgb_palette, b->rgb_palette, a->used_colors * sizeof(uint32_t))) {
+		return false;
+	}
+	uint8_t buffer_a[a->width], buffer_b[b->width];
+	for (unsigned int y = 0; y < a->height; y++) {
+		if (memcmp(pattern_get_row(a, y, buffer_a), pattern_get_row(b, y, buffer_b), a->width)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int run_test_pattern_decode(int argc, char **argv) {
+	const unsigned int iterations = 20;
+	for (int i = 2; i < argc; i++) {
+		struct membuf_t png_data = MEMBUF_INITIALIZER;
+		if (!membuf_read_from_file(&png_data, argv[i])) {
+			perror(argv[i]);
+			membuf_free(&png_data);
+			continue;
+		}
+		struct pattern_t *pattern = png_read_pattern(&png_data, 0, 0);
+		if (!pattern) {
+			fprintf(stderr, "%s: cannot decode\n", argv[i]);
+			membuf_free(&png_data);
+			continue;
+		}
+		struct membuf_t kpat_data = MEMBUF_INITIALIZER;
+		if (!kpat_write_pattern_mem(pattern, &kpat_data)) {
+			fprintf(stderr, "%s: cannot encode kpat\n", argv[i]);
+			pattern_free(pattern);
+			membuf_free(&png_data);
+			continue;
+		}
+
+		struct timespec t0, t1, t2;
+		get_timespec_now(&t0);
+		for (unsigned int j = 0; j < iterations; j++) {
+			pattern_free(png_read_pattern(&png_data, 0, 0));
+		}
+		get_timespec_now(&t1);
+		for (unsigned int j = 0; j < iterations; j++) {
+			pattern_free(kpat_read_pattern(&kpat_data));
+		}
+		get_timespec_now(&t2);
+
+		struct pattern_t *decoded = kpat_read_pattern(&kpat_data);
+		printf("%-32s %3d x %-5d png %8u bytes %9.3f ms, kpat %8u bytes %9.3f ms %s\n", argv[i], pattern->width, pattern->height, png_data.length, timespec_diff(&t1, &t0) / 1e6 / iterations, kpat_data.length, timespec_diff(&t2, &t1) / 1e6 / iterations, (decoded && patterns_equal(pattern, decoded)) ? "identical" : "MISMATCH");
+		pattern_free(decoded);
+		pattern_free(pattern);
+		membuf_free(&kpat_data);
+		membuf_free(&png_data);
+	}
+	return 0;
+}
+
 static void show_syntax(const char *errmsg) {
 	if (errmsg) {
 		fprintf(stderr, "error: %s\n", errmsg);
@@ -63,6 +63,18 @@ void add_timespec_offset(struct timespec *timespec, int32_t offset_milliseconds)
 	}
 }
 
+void add_timespec_offset_ns(struct timespec *timespec, int64_t offset_nanoseconds) {
+	timespec->tv_sec += offset_nanoseconds / 1000000000;
+	timespec->tv_nsec += offset_nanoseconds % 1000000000;
+	if (timespec->tv_nsec < 0) {
+		timespec->tv_sec -= 1;
+		timespec->tv_nsec += 1000000000;
+	} else if (timespec->tv_nsec >= 1000000000) {
+		timespec->tv_sec += 1;
+		timespec->tv_nsec -= 1000000000;
+	}
+}
+
 void get_timespec_now(struct timespec *timespec) {
 	struct timeval now;
 	if (gettimeofday(&now, NULL) != 0) {
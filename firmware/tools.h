@@ -34,6 +34,7 @@ typedef void* (*thread_function_t)(void *arg);
 /*************** AUTO GENERATED SECTION FOLLOWS ***************/
 bool start_detached_thread(thread_function_t thread_fnc, void *argument);
 void add_timespec_offset(struct timespec *timespec, int32_t offset_milliseconds);
+void add_timespec_offset_ns(struct timespec *timespec, int64_t offset_nanoseconds);
 void get_timespec_now(struct timespec *timespec);
 void get_abs_timespec_offset(struct timespec *timespec, int32_t offset_milliseconds);
 int64_t timespec_diff(const struct timespec *a, const struct timespec *b);
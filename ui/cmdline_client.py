@@ -75,8 +75,41 @@ class Actions(object):
 		else:
 			print("Last error: %s" % (self._conn.last_error))
 
+	def _run_latency(self):
+		if self._args.reset:
+			result = self._conn.reset_latency(parse = True)
+			print(json.dumps(result, sort_keys = True, indent = 4))
+			return
+
+		latency = self._conn.get_latency(parse = True)
+		if latency is None:
+			print("Last error: %s" % (self._conn.last_error))
+			return
+		bucket_min_us = latency["bucket_min_us"]
+		for (stage, stats) in sorted(latency.items()):
+			if not isinstance(stats, dict):
+				continue
+			print("%s: %d samples, min %d µs, max %d µs" % (stage, stats["count"], stats["min_us"], stats["max_us"]))
+			for (min_us, count) in zip(bucket_min_us, stats["histogram"]):
+				if count > 0:
+					print("    >= %7d µs: %d" % (min_us, count))
+
+	def _pattern_format(self):
+		if self._args.format is not None:
+			return self._args.format
+		return "kpat" if self._args.filename.lower().endswith(".kpat") else "png"
+
 	def _run_getpattern(self):
-		data = self._conn.get_pattern(rawdata = not self._args.pretty)
+		data = self._conn.get_pattern(rawdata = not self._args.pretty, profile = self._args.profile, pattern_format = self._pattern_format())
+		if data is not None:
+			print("Received %d bytes." % (len(data)))
+			with open(self._args.filename, "wb") as f:
+				f.write(data)
+		else:
+			print("Error receving data.")
+
+	def _run_gettile(self):
+		data = self._conn.get_tile(self._args.zoom, self._args.tile_x, self._args.tile_y)
 		if data is not None:
 			print("Received %d bytes." % (len(data)))
 			with open(self._args.pngfile, "wb") as f:
@@ -84,10 +117,32 @@ class Actions(object):
 		else:
 			print("Error receving data.")
 
+	def _run_getregion(self):
+		if self._args.outfile is not None:
+			data = self._conn.get_region(self._args.x, self._args.y, self._args.width, self._args.height, region_format = self._args.format)
+			if data is not None:
+				print("Received %d bytes." % (len(data)))
+				with open(self._args.outfile, "wb") as f:
+					f.write(data)
+			else:
+				print("Error receving data.")
+		else:
+			region = self._conn.get_region(self._args.x, self._args.y, self._args.width, self._args.height, region_format = "bytes", parse = True)
+			if region is not None:
+				print("%d x %d stitches at %d, %d of pattern version %d:" % (region["width"], region["height"], region["x"], region["y"], region["pattern_version"]))
+				for row in region["rows"]:
+					print("".join(".#23456789ABCDEF"[min(value, 15)] for value in row))
+			else:
+				print("Error receving data.")
+
 	def _run_setpattern(self):
-		with open(self._args.pngfile, "rb") as f:
+		with open(self._args.filename, "rb") as f:
 			data = f.read()
-		result = self._conn.set_pattern(xoffset = self._args.xoffset, yoffset = self._args.yoffset, merge = self._args.merge, png_data = data, parse = True)
+		result = self._conn.set_pattern(xoffset = self._args.xoffset, yoffset = self._args.yoffset, merge = self._args.merge, pattern_data = data, pattern_format = self._pattern_format(), parse = True)
+		print(json.dumps(result, sort_keys = True, indent = 4))
+
+	def _run_settiling(self):
+		result = self._conn.set_tiling(repeat_x = self._args.repeat_x, repeat_y = self._args.repeat_y, offset_x = self._args.xoffset, offset_y = self._args.yoffset, parse = True)
 		print(json.dumps(result, sort_keys = True, indent = 4))
 
 mc = MultiCommand()
@@ -110,19 +165,53 @@ def genparser(parser):
 	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
 mc.register("cstatus", "Get the status of the knit machine core continuously", genparser, action = Actions)
 
+def genparser(parser):
+	parser.add_argument("-r", "--reset", action = "store_true", help = "Reset the latency histograms instead of showing them.")
+	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
+mc.register("latency", "Show the edge to SPI latency histograms of the knit machine core", genparser, action = Actions)
+
 def genparser(parser):
 	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
 	parser.add_argument("-p", "--pretty", action = "store_true", help = "Get the pretty image for the pattern instead of the raw one")
-	parser.add_argument("pngfile", type = str, help = "PNG file to save pattern to.")
-mc.register("getpattern", "Get the current pattern and save as a PNG file", genparser, action = Actions)
+	parser.add_argument("-c", "--profile", choices = [ "default", "fast", "small" ], default = "default", help = "PNG encoder profile to use, trading encoding time against size. Defaults to %(default)s.")
+	parser.add_argument("-f", "--format", choices = [ "png", "kpat" ], help = "File format to save the pattern in. By default determined from the file extension.")
+	parser.add_argument("filename", type = str, help = "PNG or kpat file to save pattern to.")
+mc.register("getpattern", "Get the current pattern and save as a PNG or kpat file", genparser, action = Actions)
+
+def genparser(parser):
+	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
+	parser.add_argument("-z", "--zoom", metavar = "level", type = int, default = 2, help = "Zoom level of the tile. Tile sizes per zoom level are reported by hwinfo. Defaults to %(default)d.")
+	parser.add_argument("tile_x", type = int, help = "Horizontal index of the tile.")
+	parser.add_argument("tile_y", type = int, help = "Vertical index of the tile.")
+	parser.add_argument("pngfile", type = str, help = "PNG file to save tile to.")
+mc.register("gettile", "Get one tile of the pattern preview and save as a PNG file", genparser, action = Actions)
+
+def genparser(parser):
+	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
+	parser.add_argument("-f", "--format", choices = [ "png", "bytes", "bits" ], default = "png", help = "Format to save the region in, either a PNG file or a raw bitmap with one byte or one bit per stitch. Defaults to %(default)s.")
+	parser.add_argument("-o", "--outfile", metavar = "filename", type = str, help = "File to save the region to. When omitted, the region is printed instead.")
+	parser.add_argument("x", type = int, help = "Leftmost stitch of the region.")
+	parser.add_argument("y", type = int, help = "Topmost row of the region.")
+	parser.add_argument("width", type = int, help = "Width of the region in stitches.")
+	parser.add_argument("height", type = int, help = "Height of the region in rows.")
+mc.register("getregion", "Get a rectangular region of the current pattern", genparser, action = Actions)
 
 def genparser(parser):
 	parser.add_argument("-x", "--xoffset", metavar = "pos", type = int, default = 0, help = "X offset to place pattern at. Defaults to %(default)d.")
 	parser.add_argument("-y", "--yoffset", metavar = "pos", type = int, default = 0, help = "Y offset to place pattern at. Defaults to %(default)d.")
 	parser.add_argument("-m", "--merge", action = "store_true", help = "Merge given pattern file with currently set pattern instead of replacing it.")
 	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
-	parser.add_argument("pngfile", type = str, help = "PNG file to load pattern from.")
-mc.register("setpattern", "Set the current pattern to the given PNG file", genparser, action = Actions)
+	parser.add_argument("-f", "--format", choices = [ "png", "kpat" ], help = "File format of the pattern file. By default determined from the file extension.")
+	parser.add_argument("filename", type = str, help = "PNG or kpat file to load pattern from.")
+mc.register("setpattern", "Set the current pattern to the given PNG or kpat file", genparser, action = Actions)
+
+def genparser(parser):
+	parser.add_argument("-x", "--xoffset", metavar = "stitches", type = int, default = 0, help = "Horizontal offset into the tile at which the repetition starts. Defaults to %(default)d.")
+	parser.add_argument("-y", "--yoffset", metavar = "rows", type = int, default = 0, help = "Vertical offset into the tile at which the repetition starts. Defaults to %(default)d.")
+	parser.add_argument("-s", "--socket", metavar = "filename", default = default_socket, help = "Specifies the UNIX socket that the knitcore is found at, defaults to %(default)s.")
+	parser.add_argument("repeat_x", type = int, help = "Number of horizontal repetitions of the current pattern.")
+	parser.add_argument("repeat_y", type = int, help = "Number of vertical repetitions of the current pattern.")
+mc.register("settiling", "Repeat the current pattern without uploading a pre-tiled image", genparser, action = Actions)
 
 mc.run(sys.argv[1:])
 
@@ -61,6 +61,11 @@ class Controller(object):
 		server_connection = ServerConnection(self._config["server_socket"])
 		template_args["hwinfo"] = server_connection.get_hwinfo(parse = True)
 
+	def _handler_pattern(self, template_args):
+		server_connection = ServerConnection(self._config["server_socket"])
+		template_args["hwinfo"] = server_connection.get_hwinfo(parse = True)
+		template_args["status"] = server_connection.get_status(parse = True)
+
 	def serve_page(self, request, template_name, args = None):
 		if args is None:
 			args = {
@@ -78,7 +83,8 @@ class Controller(object):
 
 	def rest_pattern_get(self, request, raw_pattern = False, attachment = False):
 		server_connection = ServerConnection(self._config["server_socket"])
-		pattern = server_connection.get_pattern(rawdata = raw_pattern)
+		# Previews are shown right away, downloads are kept
+		pattern = server_connection.get_pattern(rawdata = raw_pattern, profile = "small" if attachment else "fast")
 		if pattern is not None:
 			headers = { }
 			if attachment:
@@ -89,6 +95,14 @@ class Controller(object):
 		else:
 			return flask.Response("No pattern loaded.\n", status = 404, mimetype = "text/plain")
 
+	def rest_pattern_tile_get(self, request, zoom, tile_x, tile_y):
+		server_connection = ServerConnection(self._config["server_socket"])
+		tile = server_connection.get_tile(zoom, tile_x, tile_y)
+		if tile is not None:
+			return flask.Response(tile, mimetype = "image/png")
+		else:
+			return flask.Response("No such tile.\n", status = 404, mimetype = "text/plain")
+
 	def _msg(self, request, msgtype, msg):
 		# TODO: Implement me!
 		print(msgtype, msg)
@@ -105,12 +119,18 @@ class Controller(object):
 					self._msg(request, "error", "Could not read X or Y offset.")
 
 				pattern_file = request.files["pattern"]
-				if pattern_file.mimetype not in [ "image/png" ]:
+				if (pattern_file.filename or "").lower().endswith(".kpat"):
+					pattern_format = "kpat"
+				elif pattern_file.mimetype == "image/png":
+					pattern_format = "png"
+				else:
+					pattern_format = None
+				if pattern_format is None:
 					self._msg(request, "error", "Unsupported file type uploaded: %s" % (pattern_file.mimetype))
 				else:
 					file_data = pattern_file.stream.read()
 					server_connection = ServerConnection(self._config["server_socket"])
-					server_connection.set_pattern(xoffset = x, yoffset = y, merge = ("merge_pattern" in request.form), png_data = file_data)
+					server_connection.set_pattern(xoffset = x, yoffset = y, merge = ("merge_pattern" in request.form), pattern_data = file_data, pattern_format = pattern_format)
 					if server_connection.last_error is not None:
 						self._msg(request, "error", "Could not send pattern to knitserver.")
 		elif "center_pattern" in request.form:
@@ -62,6 +62,10 @@ def rest_pattern_get():
 def rest_pattern_raw_get():
 	return ctrlr.rest_pattern_get(flask.request, raw_pattern = True, attachment = True)
 
+@app.route("/rest/pattern/tile/<int:zoom>/<int:tile_x>/<int:tile_y>", methods = [ "GET" ])
+def rest_pattern_tile_get(zoom, tile_x, tile_y):
+	return ctrlr.rest_pattern_tile_get(flask.request, zoom, tile_x, tile_y)
+
 @app.route("/rest/pattern", methods = [ "POST" ])
 def rest_pattern_post():
 	return ctrlr.rest_pattern_post(flask.request)
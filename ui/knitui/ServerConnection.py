@@ -96,20 +96,56 @@ class ServerConnection(object):
 	def get_hwinfo(self, parse = False):
 		return self._execute("hwinfo", parse = parse)
 
-	def get_pattern(self, rawdata = False):
+	def get_pattern(self, rawdata = False, profile = "default", pattern_format = "png"):
 		assert(isinstance(rawdata, bool))
+		assert(profile in [ "default", "fast", "small" ])
+		assert(pattern_format in [ "png", "kpat" ])
 		try:
-			return self._execute("getpattern %s" % (str(rawdata)), read_bindata = True)
+			return self._execute("getpattern %s %s %s" % (str(rawdata), profile, pattern_format), read_bindata = True)
 		except FileReceptionFailedException:
 			return None
 
-	def set_pattern(self, xoffset, yoffset, merge, png_data, parse = False):
+	def get_tile(self, zoom, tile_x, tile_y):
+		try:
+			return self._execute("gettile %d %d %d" % (zoom, tile_x, tile_y), read_bindata = True)
+		except FileReceptionFailedException:
+			return None
+
+	def get_region(self, x, y, width, height, region_format = "png", parse = False):
+		try:
+			data = self._execute("getregion %d %d %d %d %s" % (x, y, width, height, region_format), read_bindata = True)
+		except FileReceptionFailedException:
+			return None
+		if (not parse) or (region_format == "png"):
+			return data
+
+		header_fields = struct.unpack("<8L", data[:32])
+		(magic, fmt, pattern_version, x, y, width, height, row_stride) = header_fields
+		if magic != 0x4e47524b:
+			return None
+		rows = [ data[32 + (row_stride * i) : 32 + (row_stride * (i + 1))] for i in range(height) ]
+		if region_format == "bits":
+			rows = [ bytes((row[i // 8] >> (i % 8)) & 1 for i in range(width)) for row in rows ]
+		return {
+			"pattern_version":	pattern_version,
+			"x":				x,
+			"y":				y,
+			"width":			width,
+			"height":			height,
+			"rows":				rows,
+		}
+
+	def set_pattern(self, xoffset, yoffset, merge, pattern_data, pattern_format = "png", parse = False):
 		assert(isinstance(merge, bool))
-		return self._execute("setpattern %d %d %s" % (xoffset, yoffset, str(merge)), write_bindata = png_data, parse = parse)
+		assert(pattern_format in [ "png", "kpat" ])
+		return self._execute("setpattern %d %d %s %s" % (xoffset, yoffset, str(merge), pattern_format), write_bindata = pattern_data, parse = parse)
 
 	def edit_pattern(self, edit_mode, parse = False):
 		return self._execute("editpattern %s" % (edit_mode), parse = parse)
 
+	def set_tiling(self, repeat_x, repeat_y, offset_x = 0, offset_y = 0, parse = False):
+		return self._execute("settiling %d %d %d %d" % (repeat_x, repeat_y, offset_x, offset_y), parse = parse)
+
 	def set_row(self, row_id, parse = False):
 		return self._execute("setrow %d" % (row_id), parse = parse)
 
@@ -124,3 +160,9 @@ class ServerConnection(object):
 
 	def mock_command(self, cmd, parameter, parse = False):
 		return self._execute("hwmock %s %d" % (cmd, parameter), parse = parse)
+
+	def get_latency(self, parse = False):
+		return self._execute("latency show", parse = parse)
+
+	def reset_latency(self, parse = False):
+		return self._execute("latency reset", parse = parse)